@@ -0,0 +1,158 @@
+/*
+ * access_log.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+
+#include "spsc_ring.h"
+#include "util.h"
+
+namespace access_log {
+
+constexpr std::size_t RING_SIZE = 1 << 20; // per producing thread
+
+static const char * const phase_names[PHASES] = { "accepted", "headers",
+		"dns_queued", "dns_resolved", "connected", "uploaded", "first_byte",
+		"response_done", "cleanup" };
+
+static std::unique_ptr<ring_writer> writer;
+static int fd = -1;
+static std::atomic<bool> running { false };
+static std::atomic<std::uint64_t> records { 0 }, dropped { 0 };
+
+void record::mark(phase p) {
+	at[p] = clock::now();
+}
+
+static void write_lines(iovec * iov, int iovcnt, std::size_t) {
+	if (!util::write_all(fd, iov, iovcnt)) {
+		util::log() << "Access log write failed: " << util::error();
+	}
+}
+
+void start(const std::string & path) {
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		throw std::runtime_error("Unable to open access log " + path);
+	}
+	writer = std::make_unique<ring_writer>(RING_SIZE,
+			std::chrono::milliseconds(50), write_lines);
+	running = true;
+}
+
+void stop() {
+	if (!running) {
+		return;
+	}
+	running = false;
+	writer->stop();
+	close(fd);
+	fd = -1;
+}
+
+bool enabled() {
+	return running.load(std::memory_order_relaxed);
+}
+
+// host and method come from the client, so they are escaped
+static void append_string(std::string & out, const std::string & s) {
+	out += '"';
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += char(c);
+		} else if (c < 0x20 || c >= 0x7f) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+		} else {
+			out += char(c);
+		}
+	}
+	out += '"';
+}
+
+void write(const record & r) {
+	if (!enabled()) {
+		return;
+	}
+	std::string line;
+	line.reserve(512);
+	char num[64];
+	snprintf(num, sizeof(num), "{\"time_ms\":%lld,",
+			(long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::system_clock::now().time_since_epoch()).count());
+	line += num;
+	line += "\"client\":";
+	append_string(line, r.client);
+	line += ",\"host\":";
+	append_string(line, r.host);
+	line += ",\"method\":";
+	append_string(line, r.method);
+	snprintf(num, sizeof(num), ",\"served\":\"%s\",\"status\":%d", r.served,
+			r.status);
+	line += num;
+	snprintf(num, sizeof(num), ",\"bytes_in\":%llu,\"bytes_out\":%llu",
+			(unsigned long long) r.bytes_in, (unsigned long long) r.bytes_out);
+	line += num;
+	for (int p = headers; p < PHASES && r.at[accepted] != clock::time_point();
+			p++) {
+		if (r.at[p] == clock::time_point()) {
+			continue;
+		}
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+				r.at[p] - r.at[accepted]).count();
+		snprintf(num, sizeof(num), ",\"%s_us\":%lld", phase_names[p],
+				(long long) us);
+		line += num;
+	}
+	line += "}\n";
+
+	iovec iov { &line[0], line.size() };
+	if (writer->push(nullptr, 0, &iov, 1, line.size())) {
+		records.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+std::string peer_of(int fd) {
+	sockaddr_storage addr { };
+	socklen_t len = sizeof(addr);
+	if (getpeername(fd, (sockaddr *) &addr, &len) == -1) {
+		errno = 0;
+		return "";
+	}
+	char host[INET6_ADDRSTRLEN] = "";
+	int port = 0;
+	if (addr.ss_family == AF_INET) {
+		auto in = (sockaddr_in *) &addr;
+		inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+		port = ntohs(in->sin_port);
+	} else if (addr.ss_family == AF_INET6) {
+		auto in6 = (sockaddr_in6 *) &addr;
+		inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+		port = ntohs(in6->sin6_port);
+	}
+	return std::string(host) + ":" + std::to_string(port);
+}
+
+stats_t stats() {
+	return {records.load(), dropped.load()};
+}
+
+}
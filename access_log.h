@@ -0,0 +1,79 @@
+/*
+ * access_log.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// One JSON line per finished connection, saying what was asked, what was
+// answered and where the time went. Lines are formatted on the connection's
+// thread and handed to a background writer the way capture records are, a
+// full ring drops the line.
+//
+// Times are microseconds since the client was accepted, steps a connection
+// never reached are left out:
+//   headers       request head read
+//   dns_queued    handed to the resolver
+//   dns_resolved  name resolved
+//   connected     connect() returned (with fast open before the handshake)
+//   uploaded      request sent to the server
+//   first_byte    first response byte from the server
+//   response_done whole response read from the server
+//   cleanup       connection closed
+namespace access_log {
+
+using clock = std::chrono::steady_clock;
+
+enum phase {
+	accepted,
+	headers,
+	dns_queued,
+	dns_resolved,
+	connected,
+	uploaded,
+	first_byte,
+	response_done,
+	cleanup,
+	PHASES
+};
+
+struct record {
+	std::string client; // address:port
+	std::string host, method;
+	// origin, cache, disk, collapsed or tunnel
+	const char * served = "origin";
+	int status = 0; // 0 if nothing was answered
+	std::uint64_t bytes_in = 0, bytes_out = 0; // from and to the client
+	clock::time_point at[PHASES]; // default constructed when not reached
+
+	void mark(phase p);
+};
+
+struct stats_t {
+	std::uint64_t records, dropped;
+};
+
+// Starts the writer thread appending to path, throws std::runtime_error if
+// the file can't be opened
+void start(const std::string & path);
+// Writes out what is left and stops the writer
+void stop();
+bool enabled();
+
+void write(const record & r);
+
+// peer address of a connected socket as address:port
+std::string peer_of(int fd);
+
+stats_t stats();
+
+}
+
+#endif /* ACCESS_LOG_H_ */
@@ -0,0 +1,263 @@
+/*
+ * admission.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "admission.h"
+
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+
+#include "dispatch.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "util.h"
+
+// addresses a shard keeps before it looks for idle ones
+constexpr std::size_t SWEEP_MIN = 4096;
+// descriptors kept for everything but connections
+constexpr rlim_t SPARE_FDS = 64;
+
+admission::ticket::ticket(ticket && other) :
+		gate(other.gate), address(other.address), per_client(
+				other.per_client) {
+	other.gate = nullptr;
+}
+
+admission::ticket & admission::ticket::operator =(ticket && other) {
+	if (this != &other) {
+		release();
+		gate = other.gate;
+		address = other.address;
+		per_client = other.per_client;
+		other.gate = nullptr;
+	}
+	return *this;
+}
+
+admission::ticket::~ticket() {
+	release();
+}
+
+void admission::ticket::release() {
+	if (gate) {
+		gate->release(*this);
+		gate = nullptr;
+	}
+}
+
+admission::admission(const admission_limits & limits) :
+		lim(limits) {
+	if (lim.client_rate > 0 && lim.client_burst < 1) {
+		lim.client_burst = std::max(1.0, lim.client_rate);
+	}
+}
+
+admission::verdict admission::admit(int fd, ticket & t) {
+	if (lim.max_loop_lag_ms > 0
+			&& dispatch::last_iteration()
+					> std::chrono::milliseconds(lim.max_loop_lag_ms)) {
+		return loop_lagging;
+	}
+	if (memory_budget::over_budget()) {
+		return over_memory;
+	}
+	int before = active.fetch_add(1, std::memory_order_relaxed);
+	if (lim.max_connections > 0 && before >= lim.max_connections) {
+		active.fetch_sub(1, std::memory_order_relaxed);
+		return over_connections;
+	}
+	t.release();
+	t.gate = this;
+	t.per_client = false;
+	if (lim.max_client_connections == 0 && lim.client_rate <= 0) {
+		return admitted;
+	}
+	sockaddr_storage addr { };
+	socklen_t len = sizeof(addr);
+	std::uint64_t address;
+	if (getpeername(fd, (sockaddr *) &addr, &len) == -1) {
+		// the client is gone already, it fails on its first read
+		errno = 0;
+		return admitted;
+	}
+	if (addr.ss_family == AF_INET) {
+		address = ntohl(((sockaddr_in *) &addr)->sin_addr.s_addr);
+	} else if (addr.ss_family == AF_INET6) {
+		const in6_addr & a = ((sockaddr_in6 *) &addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&a)) {
+			address = std::uint32_t(a.s6_addr[12]) << 24
+					| a.s6_addr[13] << 16 | a.s6_addr[14] << 8 | a.s6_addr[15];
+		} else {
+			// the /64 prefix, IPv4 addresses take the reserved ::/32 of it
+			address = 0;
+			for (int i = 0; i < 8; i++) {
+				address = address << 8 | a.s6_addr[i];
+			}
+		}
+	} else {
+		return admitted;
+	}
+	verdict v = admit_client(address);
+	if (v != admitted) {
+		t.release();
+		return v;
+	}
+	t.address = address;
+	t.per_client = true;
+	return admitted;
+}
+
+// addresses of one network differ in their last bits only, the multiply
+// spreads them over all shards
+admission::shard & admission::shard_of(std::uint64_t address) {
+	return shards[(address * 0x9E3779B97F4A7C15ull >> 32) % SHARDS];
+}
+
+admission::verdict admission::admit_client(std::uint64_t address) {
+	auto now = std::chrono::steady_clock::now();
+	shard & s = shard_of(address);
+	std::lock_guard<std::mutex> lg(s.mut);
+	auto it = s.clients.find(address);
+	if (it == s.clients.end()) {
+		if (s.clients.size() >= std::max(s.sweep_at, SWEEP_MIN)) {
+			sweep(s, now);
+		}
+		it = s.clients.emplace(address, client()).first;
+		it->second.tokens = lim.client_burst;
+		it->second.refilled = now;
+	}
+	client & c = it->second;
+	if (lim.max_client_connections > 0
+			&& c.connections >= lim.max_client_connections) {
+		return over_client_connections;
+	}
+	if (lim.client_rate > 0) {
+		std::chrono::duration<double> idle = now - c.refilled;
+		c.tokens = std::min(lim.client_burst,
+				c.tokens + idle.count() * lim.client_rate);
+		c.refilled = now;
+		if (c.tokens < 1) {
+			return over_client_rate;
+		}
+		c.tokens -= 1;
+	}
+	c.connections++;
+	return admitted;
+}
+
+void admission::release(ticket & t) {
+	active.fetch_sub(1, std::memory_order_relaxed);
+	if (!t.per_client) {
+		return;
+	}
+	shard & s = shard_of(t.address);
+	std::lock_guard<std::mutex> lg(s.mut);
+	auto it = s.clients.find(t.address);
+	if (it != s.clients.end()) {
+		it->second.connections--;
+	}
+}
+
+// drops addresses without connections whose bucket has filled up again, they
+// would start over the same way
+void admission::sweep(shard & s, std::chrono::steady_clock::time_point now) {
+	for (auto it = s.clients.begin(); it != s.clients.end();) {
+		std::chrono::duration<double> idle = now - it->second.refilled;
+		bool full = lim.client_rate <= 0
+				|| it->second.tokens + idle.count() * lim.client_rate
+						>= lim.client_burst;
+		if (it->second.connections == 0 && full) {
+			it = s.clients.erase(it);
+		} else {
+			++it;
+		}
+	}
+	s.sweep_at = s.clients.size() * 2;
+}
+
+bool admission::dns_backlogged(std::size_t queue_depth) const {
+	return lim.max_dns_queue > 0 && queue_depth >= lim.max_dns_queue;
+}
+
+void admission::refuse(int fd, verdict v) {
+	switch (v) {
+	case over_connections:
+		metrics::add(metrics::refused_connections);
+		break;
+	case over_client_connections:
+		metrics::add(metrics::refused_client_connections);
+		break;
+	case over_client_rate:
+		metrics::add(metrics::rate_limited);
+		break;
+	case loop_lagging:
+		metrics::add(metrics::refused_lagging);
+		break;
+	case over_memory:
+		metrics::add(metrics::refused_memory);
+		break;
+	default:
+		break;
+	}
+	// whatever the client sent already would make close() reset the
+	// connection, possibly before the response got there
+	char discard[4096];
+	for (int i = 0;
+			i < 4 && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0;
+			i++) {
+	}
+	const std::string & r = refusal();
+	if (send(fd, r.data(), r.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+		util::debug() << "Unable to refuse fd " << fd << ": " << util::error();
+	}
+	errno = 0;
+	close(fd);
+}
+
+const std::string & admission::refusal() {
+	static const std::string response = "HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"Retry-After: 1\r\n\r\n";
+	return response;
+}
+
+int admission::connections() const {
+	return active.load(std::memory_order_relaxed);
+}
+
+const admission_limits & admission::limits() const {
+	return lim;
+}
+
+int connections_for_fd_limit() {
+	rlimit fds { };
+	if (getrlimit(RLIMIT_NOFILE, &fds) == -1) {
+		errno = 0;
+		return 0;
+	}
+	if (fds.rlim_cur < fds.rlim_max) {
+		rlimit raised = fds;
+		raised.rlim_cur = fds.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+			fds = raised;
+		} else {
+			errno = 0;
+		}
+	}
+	if (fds.rlim_cur == RLIM_INFINITY || fds.rlim_cur > (1 << 24)) {
+		return 1 << 23;
+	}
+	if (fds.rlim_cur <= SPARE_FDS * 2) {
+		return 1;
+	}
+	// a client and a server socket each, splice tunnels take pipes on top
+	return (fds.rlim_cur - SPARE_FDS) / 2;
+}
@@ -0,0 +1,118 @@
+/*
+ * admission.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// every limit is off at 0
+struct admission_limits {
+	int max_connections = 0; // connections open at once
+	int max_client_connections = 0; // connections open at once per address
+	double client_rate = 0; // new connections per second per address
+	double client_burst = 0; // connections an idle address may open at once
+	int max_loop_lag_ms = 0; // longest wakeup of the accepting loop
+	std::size_t max_dns_queue = 0; // requests waiting for a resolver
+};
+
+// Admission control for new clients. A connection is refused while the
+// proxy holds max_connections, while its address holds
+// max_client_connections or has run out of tokens, while the loop that
+// accepted it took longer than max_loop_lag_ms for its last wakeup, or while
+// connections hold more memory than memory_budget allows. Refused clients
+// get a canned 503 straight from the accepting loop, nothing is registered
+// with dispatch for them.
+//
+// Every connection is one request, so the token bucket of an address limits
+// its request rate as well.
+//
+// Per address limits take an IPv4 address as it is and an IPv6 one by its
+// /64 prefix, which is what one host usually gets. Clients of other address
+// families only count against the global limits.
+class admission {
+public:
+	enum verdict {
+		admitted,
+		over_connections,
+		over_client_connections,
+		over_client_rate,
+		loop_lagging,
+		over_memory // see memory_budget
+	};
+
+	// Held by an admitted connection, the connection counts against the
+	// limits until it is released or destroyed
+	class ticket {
+		friend class admission;
+		admission * gate = nullptr;
+		std::uint64_t address = 0;
+		bool per_client = false;
+	public:
+		ticket() = default;
+		ticket(ticket && other);
+		ticket & operator =(ticket && other);
+		ticket(const ticket &) = delete;
+		ticket & operator =(const ticket &) = delete;
+		~ticket();
+
+		void release();
+	};
+
+	explicit admission(const admission_limits & limits);
+
+	// t holds the connection if it was admitted
+	verdict admit(int fd, ticket & t);
+	// true if requests should be answered with refusal() instead of queueing
+	// another lookup
+	bool dns_backlogged(std::size_t queue_depth) const;
+
+	// writes refusal() to a client that was not admitted and closes it
+	static void refuse(int fd, verdict v);
+	// 503 response asking the client to come back later
+	static const std::string & refusal();
+
+	int connections() const;
+	const admission_limits & limits() const;
+
+private:
+	struct client {
+		int connections = 0;
+		double tokens = 0;
+		std::chrono::steady_clock::time_point refilled;
+	};
+	struct shard {
+		std::mutex mut;
+		std::unordered_map<std::uint64_t, client> clients;
+		// idle addresses are dropped once the map grows past this
+		std::size_t sweep_at = 0;
+	};
+	static constexpr int SHARDS = 16;
+
+	shard & shard_of(std::uint64_t address);
+	verdict admit_client(std::uint64_t address);
+	void release(ticket & t);
+	void sweep(shard & s, std::chrono::steady_clock::time_point now);
+
+	admission_limits lim;
+	std::atomic<int> active { 0 };
+	shard shards[SHARDS];
+};
+
+// Raises the soft descriptor limit to the hard one and returns how many
+// connections fit in it, keeping room for listeners, logs and cache files.
+// Only for the default limit, a --max-connections leaves the descriptor
+// limit alone.
+int connections_for_fd_limit();
+
+#endif /* ADMISSION_H_ */
@@ -0,0 +1,104 @@
+/*
+ * accept_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "dispatch.h"
+#include "listener.h"
+
+// Connection storm against a listener served by the dispatcher: client
+// threads connect and close as fast as they can while the dispatcher accepts
+// and closes. Reports accepts per second and per dispatcher wakeup for the
+// old single accept with a backlog of 10 and the batched accept path.
+
+static void run(int backlog, int batch, int clients, double seconds) {
+	if (!freopen("/dev/null", "w", stderr)) {
+		exit(1);
+	}
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigmask, nullptr);
+
+	listener_options opts;
+	opts.backlog = backlog;
+	opts.accept_batch = batch;
+	int fd = open_listener(0, opts);
+	sockaddr_in addr { };
+	socklen_t len = sizeof(addr);
+	getsockname(fd, (sockaddr *) &addr, &len);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	std::atomic<bool> done { false };
+	std::vector<std::thread> threads;
+	for (int i = 0; i < clients; i++) {
+		threads.emplace_back([&] {
+			while (!done) {
+				int c = socket(AF_INET, SOCK_STREAM, 0);
+				connect(c, (sockaddr *) &addr, len);
+				close(c);
+			}
+		});
+	}
+
+	long accepted = 0, wakeups = 0;
+	auto start = std::chrono::steady_clock::now();
+	{
+		dispatch::fd_ref acceptor(fd, EPOLLIN);
+		dispatch::event_ref ev([&] {
+			wakeups++;
+			accepted += accept_clients(fd, batch, [](int client) {
+				close(client);
+			});
+		});
+		dispatch::link(acceptor, EPOLLIN, ev);
+		std::thread timer([seconds] {
+			std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+			kill(getpid(), SIGINT);
+		});
+		dispatch::run_dispatcher_in_current_thread();
+		timer.join();
+	}
+	double wall = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	done = true;
+	for (auto & t : threads) {
+		t.join();
+	}
+	printf("backlog=%d batch=%d clients=%d accepts_per_s=%.0f "
+			"accepts_per_wakeup=%.2f\n", backlog, batch, clients,
+			accepted / wall, wakeups ? double(accepted) / wakeups : 0.0);
+	fflush(stdout);
+	_exit(0);
+}
+
+int main(int argc, char ** argv) {
+	int clients = argc > 1 ? atoi(argv[1]) : 8;
+	double seconds = argc > 2 ? atof(argv[2]) : 3;
+	int res = 0;
+	for (auto cfg : { std::make_pair(10, 1), std::make_pair(1024, 64) }) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			run(cfg.first, cfg.second, clients, seconds);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		res |= !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+	return res;
+}
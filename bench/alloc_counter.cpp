@@ -0,0 +1,59 @@
+/*
+ * alloc_counter.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// The replacements live in a translation unit of their own so they are never
+// inlined into a caller, where GCC would take the free() of a pointer from
+// new for a mismatched pair (-Wmismatched-new-delete).
+
+static std::atomic<std::uint64_t> count { 0 };
+
+std::uint64_t alloc_counter::allocations() {
+	return count.load(std::memory_order_relaxed);
+}
+
+void * operator new(std::size_t size) {
+	count.fetch_add(1, std::memory_order_relaxed);
+	if (void * p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept {
+	std::free(p);
+}
+
+#if defined(__cpp_aligned_new)
+void * operator new(std::size_t size, std::align_val_t align) {
+	count.fetch_add(1, std::memory_order_relaxed);
+	std::size_t a = static_cast<std::size_t>(align);
+	// aligned_alloc wants a non-zero multiple of the alignment
+	std::size_t rounded = size ? (size + a - 1) / a * a : a;
+	if (void * p = std::aligned_alloc(a, rounded)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t, std::align_val_t) noexcept {
+	std::free(p);
+}
+#endif
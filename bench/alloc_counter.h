@@ -0,0 +1,22 @@
+/*
+ * alloc_counter.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef BENCH_ALLOC_COUNTER_H_
+#define BENCH_ALLOC_COUNTER_H_
+
+#include <cstdint>
+
+// Linking alloc_counter.cpp replaces the global operator new and delete with
+// ones that count heap allocations, for the benchmarks that report them.
+namespace alloc_counter {
+
+// allocations since the process started
+std::uint64_t allocations();
+
+}
+
+#endif /* BENCH_ALLOC_COUNTER_H_ */
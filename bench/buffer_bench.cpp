@@ -0,0 +1,172 @@
+/*
+ * buffer_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "buffer_pool.h"
+#include "dispatch.h"
+#include "relay.h"
+
+// Keeps many relays open at once and pushes short messages through all of
+// them in rounds, reporting heap allocations per message and memory use with
+// the buffer pool caching enabled and disabled.
+
+static long rss_kb() {
+	long pages = 0, resident = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static bool write_all(int fd, const char * data, std::size_t length) {
+	while (length) {
+		ssize_t wr = write(fd, data, length);
+		if (wr <= 0) {
+			return false;
+		}
+		data += wr;
+		length -= wr;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char * data, std::size_t length) {
+	while (length) {
+		ssize_t rd = read(fd, data, length);
+		if (rd <= 0) {
+			return false;
+		}
+		data += rd;
+		length -= rd;
+	}
+	return true;
+}
+
+static void run(bool pooled, int conns, int rounds, std::size_t message) {
+	if (!freopen("/dev/null", "w", stderr)) {
+		exit(1);
+	}
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigmask, nullptr);
+	if (!pooled) {
+		buffer_pool::set_cache_limit(0);
+	}
+
+	std::vector<int> src(conns), sink(conns);
+	std::vector<dispatch::fd_ref> in, out;
+	in.reserve(conns);
+	out.reserve(conns);
+	int active = conns;
+	auto fin = [&active] {
+		if (--active == 0) {
+			kill(getpid(), SIGINT);
+		}
+	};
+	for (int i = 0; i < conns; i++) {
+		int a[2], b[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) == -1
+				|| socketpair(AF_UNIX, SOCK_STREAM, 0, b) == -1) {
+			perror("socketpair");
+			exit(1);
+		}
+		src[i] = a[0];
+		sink[i] = b[1];
+		in.emplace_back(a[1], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		out.emplace_back(b[0], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		make_relay(in.back(), out.back(), "", [&fin, b] {
+			shutdown(b[0], SHUT_WR);
+			fin();
+		});
+	}
+
+	double ns_per_msg = 0;
+	std::uint64_t allocs = 0;
+	long busy_rss = 0, idle_rss = 0;
+	bool ok = true;
+	std::thread driver([&] {
+		std::vector<char> msg(message, 'x'), got(message);
+		auto start = std::chrono::steady_clock::now();
+		std::uint64_t alloc_start = alloc_counter::allocations();
+		for (int r = 0; r < rounds && ok; r++) {
+			for (int i = 0; i < conns && ok; i++) {
+				ok = write_all(src[i], msg.data(), message);
+			}
+			busy_rss = std::max(busy_rss, rss_kb());
+			for (int i = 0; i < conns && ok; i++) {
+				ok = read_all(sink[i], got.data(), message);
+			}
+		}
+		allocs = alloc_counter::allocations() - alloc_start;
+		ns_per_msg = std::chrono::duration<double, std::nano>(
+				std::chrono::steady_clock::now() - start).count()
+				/ (double(rounds) * conns);
+		idle_rss = rss_kb();
+		for (int i = 0; i < conns; i++) {
+			shutdown(src[i], SHUT_WR);
+		}
+	});
+	dispatch::run_dispatcher_in_current_thread();
+	driver.join();
+
+	auto bs = buffer_pool::stats();
+	printf("mode=%s conns=%d messages=%lld ns_per_msg=%.0f "
+			"allocs_per_msg=%.3f busy_rss_mb=%.1f idle_rss_mb=%.1f "
+			"heap_allocations=%llu reuses=%llu\n",
+			pooled ? "pooled" : "unpooled", conns,
+			(long long) rounds * conns, ns_per_msg,
+			double(allocs) / (double(rounds) * conns), busy_rss / 1024.0,
+			idle_rss / 1024.0, (unsigned long long) bs.heap_allocations,
+			(unsigned long long) bs.reuses);
+	fflush(stdout);
+	_exit(ok ? 0 : 1);
+}
+
+int main(int argc, char ** argv) {
+	int conns = argc > 1 ? atoi(argv[1]) : 10000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 20;
+	std::size_t message = argc > 3 ? atol(argv[3]) : 16 << 10;
+
+	// every relay takes four descriptors
+	rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rlim_t(conns) * 4 + 64 > rl.rlim_cur) {
+		conns = (rl.rlim_cur - 64) / 4;
+		printf("descriptor limit allows %d connections\n", conns);
+		fflush(stdout);
+	}
+
+	int res = 0;
+	for (bool pooled : { true, false }) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			run(pooled, conns, rounds, message);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		res |= !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+	return res;
+}
@@ -0,0 +1,91 @@
+/*
+ * chunked_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "chunked.h"
+
+// Builds a chunked body carrying payload split into chunks of
+// [min_chunk, max_chunk] bytes, every fourth one with an extension.
+static std::string make_stream(const std::string & payload, int min_chunk,
+		int max_chunk, std::mt19937 & rnd) {
+	std::uniform_int_distribution<int> len(min_chunk, max_chunk);
+	std::string res;
+	char hdr[64];
+	int n = 0;
+	for (std::size_t pos = 0; pos < payload.size(); n++) {
+		std::size_t sz = std::min<std::size_t>(len(rnd), payload.size() - pos);
+		snprintf(hdr, sizeof(hdr), n % 4 ? "%zx\r\n" : "%zx;ext=\"v\"\r\n", sz);
+		res += hdr;
+		res.append(payload, pos, sz);
+		res += "\r\n";
+		pos += sz;
+	}
+	res += "0\r\nX-Checksum: 1234\r\nX-Other: a\r\n\r\n";
+	return res;
+}
+
+static void run(const char * name, const std::string & payload,
+		const std::string & stream, chunked_decoder::mode md, int read_size,
+		int iterations) {
+	using clock = std::chrono::steady_clock;
+	std::size_t chunks = 0;
+	auto start = clock::now();
+	for (int it = 0; it < iterations; it++) {
+		std::string buf;
+		buf.reserve(stream.size());
+		chunked_decoder dec(0, md);
+		chunked_decoder::status st = chunked_decoder::status::more;
+		for (std::size_t pos = 0;
+				pos < stream.size() && st == chunked_decoder::status::more;
+				pos += read_size) {
+			buf.append(stream, pos, read_size);
+			st = dec.feed(buf);
+		}
+		if (st != chunked_decoder::status::done
+				|| (md == chunked_decoder::mode::dechunk && buf != payload)) {
+			fprintf(stderr, "%s: decoding failed (%s)\n", name,
+					dec.error() ? dec.error() : "incomplete");
+			exit(1);
+		}
+		chunks = dec.chunk_count();
+	}
+	double sec = std::chrono::duration<double>(clock::now() - start).count();
+	double bytes = double(stream.size()) * iterations;
+	printf("%-28s %-8s %9.1f MB/s %8.2f ns/chunk\n", name,
+			md == chunked_decoder::mode::dechunk ? "dechunk" : "validate",
+			bytes / sec / 1e6, sec * 1e9 / (double(chunks) * iterations));
+}
+
+int main(int argc, char ** argv) {
+	int scale = argc > 1 ? atoi(argv[1]) : 1;
+	std::mt19937 rnd(42);
+	std::string payload(8 << 20, 0);
+	for (auto & c : payload) {
+		c = char(rnd());
+	}
+	struct {
+		const char * name;
+		int min_chunk, max_chunk, iterations;
+	} cases[] = { { "tiny chunks (1-16)", 1, 16, 2 }, { "small chunks (64-512)",
+			64, 512, 10 }, { "huge chunks (1M-4M)", 1 << 20, 4 << 20, 50 } };
+	for (auto & c : cases) {
+		std::string stream = make_stream(payload, c.min_chunk, c.max_chunk, rnd);
+		for (int read_size : { 4096, 1 << 16 }) {
+			std::string name = std::string(c.name) + " /"
+					+ std::to_string(read_size);
+			run(name.c_str(), payload, stream, chunked_decoder::mode::validate,
+					read_size, c.iterations * scale);
+			run(name.c_str(), payload, stream, chunked_decoder::mode::dechunk,
+					read_size, c.iterations * scale);
+		}
+	}
+}
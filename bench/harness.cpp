@@ -0,0 +1,172 @@
+/*
+ * harness.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "harness.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace harness {
+
+bool write_all(int fd, const char * data, std::size_t length) {
+	while (length) {
+		ssize_t n = write(fd, data, length);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		length -= n;
+	}
+	return true;
+}
+
+int listen_loopback(int & port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(fd, (sockaddr *) &addr, len) == -1 || listen(fd, 4096) == -1
+			|| getsockname(fd, (sockaddr *) &addr, &len) == -1) {
+		perror("listen");
+		exit(1);
+	}
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+int connect_loopback(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (connect(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+bool read_head(int fd, std::string & pending, std::string & head) {
+	char buf[16 << 10];
+	std::size_t end;
+	while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			return false;
+		}
+		pending.append(buf, n);
+	}
+	head = pending.substr(0, end + 4);
+	pending.erase(0, end + 4);
+	return true;
+}
+
+pid_t start_proxy(const std::string & binary, int port,
+		const std::string & host, const std::vector<std::string> & options) {
+	std::vector<std::string> args { binary, "--resolve=" + host
+			+ "=127.0.0.1" };
+	args.insert(args.end(), options.begin(), options.end());
+	args.push_back(std::to_string(port));
+	std::vector<char *> argv;
+	for (auto & a : args) {
+		argv.push_back(&a[0]);
+	}
+	argv.push_back(nullptr);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, 1);
+		dup2(null_fd, 2);
+		execv(binary.c_str(), argv.data());
+		_exit(127);
+	}
+	for (int i = 0; i < 500; i++) {
+		int fd = connect_loopback(port);
+		if (fd != -1) {
+			close(fd);
+			return pid;
+		}
+		if (waitpid(pid, nullptr, WNOHANG) == pid) {
+			break;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "proxy %s did not start\n", binary.c_str());
+	exit(1);
+}
+
+void stop_proxy(pid_t pid) {
+	kill(pid, SIGINT);
+	waitpid(pid, nullptr, 0);
+}
+
+double cpu_seconds(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	char line[1024];
+	double total = 0;
+	if (fgets(line, sizeof(line), f)) {
+		// the fields after the parenthesised command name
+		const char * p = strrchr(line, ')');
+		unsigned long utime = 0, stime = 0;
+		if (p
+				&& sscanf(p + 2,
+						"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+						&utime, &stime) == 2) {
+			total = double(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+long peak_rss_kb(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	char line[256];
+	long kb = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+std::uint32_t percentile(const std::vector<std::uint32_t> & sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size() - 1, std::size_t(p * sorted.size()))];
+}
+
+}
@@ -0,0 +1,47 @@
+/*
+ * harness.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef BENCH_HARNESS_H_
+#define BENCH_HARNESS_H_
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Pieces shared by the end to end benchmarks: loopback sockets, blocking
+// HTTP framing and running the proxy under test as a child process.
+namespace harness {
+
+bool write_all(int fd, const char * data, std::size_t length);
+// listens on an ephemeral loopback port, exits if it can't
+int listen_loopback(int & port);
+// -1 if nothing listens on port
+int connect_loopback(int port);
+// reads up to and including the empty line, keeps whatever came after it in
+// pending
+bool read_head(int fd, std::string & pending, std::string & head);
+
+// Runs the proxy binary on port with host pinned to 127.0.0.1 and waits until
+// it accepts connections, exits if it never does. Its output goes to
+// /dev/null.
+pid_t start_proxy(const std::string & binary, int port,
+		const std::string & host, const std::vector<std::string> & options);
+// stops it with SIGINT
+void stop_proxy(pid_t pid);
+
+// user plus system time of pid in seconds
+double cpu_seconds(pid_t pid);
+long peak_rss_kb(pid_t pid);
+
+// p in [0, 1] of sorted values, 0 if there are none
+std::uint32_t percentile(const std::vector<std::uint32_t> & sorted, double p);
+
+}
+
+#endif /* BENCH_HARNESS_H_ */
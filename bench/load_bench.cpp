@@ -0,0 +1,309 @@
+/*
+ * load_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "harness.h"
+
+// End to end load over loopback. Starts an origin server in this process,
+// runs the proxy binary given on the command line with the origin's name
+// pinned by --resolve, so no resolver is ever asked, and drives it with
+// client threads. Every scenario prints one line of key=value pairs:
+//
+//   load_bench PROXY [THREADS [SECONDS [PROXY_OPTION]...]]
+//
+// The origin serves
+//   /static/N   N bytes with Content-Length, cacheable
+//   /chunked/N  N bytes in 16K chunks, cacheable
+// and keeps connections alive unless asked to close. Miss scenarios send
+// Cache-Control: no-store so every request goes through to the origin.
+
+using namespace harness;
+using clock_type = std::chrono::steady_clock;
+
+constexpr char ORIGIN_HOST[] = "origin.bench";
+constexpr std::size_t MAX_OBJECT = 8 << 20;
+constexpr std::size_t CHUNK = 16 << 10;
+
+static std::string body_bytes;
+
+static bool has_header(const std::string & head, const char * line) {
+	return strcasestr(head.c_str(), line) != nullptr;
+}
+
+static void respond(int fd, const std::string & head) {
+	std::size_t sp = head.find(' ');
+	std::string path = head.substr(sp + 1, head.find(' ', sp + 1) - sp - 1);
+	// absolute form when the client talks to the origin through a proxy
+	if (path.compare(0, 7, "http://") == 0) {
+		std::size_t slash = path.find('/', 7);
+		path = slash == std::string::npos ? "/" : path.substr(slash);
+	}
+	std::size_t slash = path.rfind('/');
+	std::size_t size = std::min<std::size_t>(
+			strtoul(path.c_str() + slash + 1, nullptr, 10), MAX_OBJECT);
+	bool chunked = path.compare(0, 9, "/chunked/") == 0;
+	char reply[256];
+	int len;
+	if (!chunked) {
+		len = snprintf(reply, sizeof(reply),
+				"HTTP/1.1 200 OK\r\nCache-Control: max-age=600\r\n"
+						"Content-Length: %zu\r\n\r\n", size);
+		write_all(fd, reply, len);
+		write_all(fd, body_bytes.data(), size);
+		return;
+	}
+	len = snprintf(reply, sizeof(reply),
+			"HTTP/1.1 200 OK\r\nCache-Control: max-age=600\r\n"
+					"Transfer-Encoding: chunked\r\n\r\n");
+	write_all(fd, reply, len);
+	for (std::size_t off = 0; off < size; off += CHUNK) {
+		std::size_t n = std::min(CHUNK, size - off);
+		len = snprintf(reply, sizeof(reply), "%zx\r\n", n);
+		write_all(fd, reply, len);
+		write_all(fd, body_bytes.data() + off, n);
+		write_all(fd, "\r\n", 2);
+	}
+	write_all(fd, "0\r\n\r\n", 5);
+}
+
+static void serve_origin_client(int fd) {
+	std::string pending, head;
+	while (read_head(fd, pending, head)) {
+		respond(fd, head);
+		if (has_header(head, "\nConnection: close")) {
+			break;
+		}
+	}
+	close(fd);
+}
+
+static void run_origin(int listen_fd) {
+	for (;;) {
+		int fd = accept(listen_fd, nullptr, nullptr);
+		if (fd == -1) {
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		std::thread(serve_origin_client, fd).detach();
+	}
+}
+
+struct worker_result {
+	std::vector<std::uint32_t> latency_us;
+	std::uint64_t body_bytes = 0, errors = 0;
+};
+
+// reads a response to the end of its body, returns the body length or -1
+static long read_response(int fd, std::string & pending, bool until_close) {
+	std::string head;
+	if (!read_head(fd, pending, head) || head.compare(0, 12, "HTTP/1.1 200")) {
+		return -1;
+	}
+	char buf[64 << 10];
+	long body = pending.size();
+	const char * cl = strcasestr(head.c_str(), "\nContent-Length:");
+	if (!until_close && cl) {
+		long want = atol(cl + 16);
+		while (body < want) {
+			ssize_t n = read(fd, buf, std::min<long>(sizeof(buf), want - body));
+			if (n <= 0) {
+				return -1;
+			}
+			body += n;
+		}
+		pending.clear();
+		return want;
+	}
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			return body;
+		}
+		body += n;
+	}
+}
+
+// one request per connection, the proxy closes after every response
+static void http_worker(int proxy_port, const std::string & request,
+		clock_type::time_point until, worker_result & r) {
+	std::string pending;
+	while (clock_type::now() < until) {
+		auto started = clock_type::now();
+		int fd = connect_loopback(proxy_port);
+		long got = -1;
+		if (fd != -1 && write_all(fd, request.data(), request.size())) {
+			pending.clear();
+			got = read_response(fd, pending, true);
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+		if (got < 0) {
+			r.errors++;
+			continue;
+		}
+		r.body_bytes += got;
+		r.latency_us.push_back(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+						clock_type::now() - started).count());
+	}
+}
+
+// keep-alive requests to the origin through one CONNECT tunnel
+static void tunnel_worker(int proxy_port, int origin_port,
+		const std::string & path, clock_type::time_point until,
+		worker_result & r) {
+	int fd = connect_loopback(proxy_port);
+	std::string target = std::string(ORIGIN_HOST) + ":"
+			+ std::to_string(origin_port);
+	std::string connect_req = "CONNECT " + target + " HTTP/1.1\r\nHost: "
+			+ target + "\r\n\r\n";
+	std::string pending, head;
+	if (fd == -1 || !write_all(fd, connect_req.data(), connect_req.size())
+			|| !read_head(fd, pending, head)
+			|| head.compare(0, 12, "HTTP/1.1 200")) {
+		r.errors++;
+		if (fd != -1) {
+			close(fd);
+		}
+		return;
+	}
+	std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + target
+			+ "\r\n\r\n";
+	while (clock_type::now() < until) {
+		auto started = clock_type::now();
+		long got = -1;
+		if (write_all(fd, request.data(), request.size())) {
+			got = read_response(fd, pending, false);
+		}
+		if (got < 0) {
+			r.errors++;
+			break;
+		}
+		r.body_bytes += got;
+		r.latency_us.push_back(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+						clock_type::now() - started).count());
+	}
+	close(fd);
+}
+
+struct scenario {
+	const char * name;
+	const char * path;
+	bool tunnel;
+	bool no_store;
+};
+
+static void run(const scenario & s, pid_t proxy, int proxy_port,
+		int origin_port, int threads, double seconds) {
+	std::string target = std::string(ORIGIN_HOST) + ":"
+			+ std::to_string(origin_port);
+	std::string request = "GET http://" + target + s.path
+			+ " HTTP/1.1\r\nHost: " + target + "\r\n"
+			+ (s.no_store ? "Cache-Control: no-store\r\n" : "") + "\r\n";
+	std::vector<worker_result> results(threads);
+	std::vector<std::thread> workers;
+	double cpu_before = cpu_seconds(proxy);
+	auto started = clock_type::now();
+	auto until = started
+			+ std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double>(seconds));
+	for (int i = 0; i < threads; i++) {
+		if (s.tunnel) {
+			workers.emplace_back(tunnel_worker, proxy_port, origin_port,
+					std::string(s.path), until, std::ref(results[i]));
+		} else {
+			workers.emplace_back(http_worker, proxy_port, request, until,
+					std::ref(results[i]));
+		}
+	}
+	for (auto & t : workers) {
+		t.join();
+	}
+	double wall = std::chrono::duration<double>(clock_type::now() - started)
+			.count();
+	double cpu = cpu_seconds(proxy) - cpu_before;
+
+	std::vector<std::uint32_t> latency;
+	std::uint64_t bytes = 0, errors = 0;
+	for (auto & r : results) {
+		latency.insert(latency.end(), r.latency_us.begin(), r.latency_us.end());
+		bytes += r.body_bytes;
+		errors += r.errors;
+	}
+	std::sort(latency.begin(), latency.end());
+	std::size_t requests = latency.size();
+	printf("scenario=%s threads=%d requests=%zu errors=%llu rps=%.0f "
+			"p50_us=%u p99_us=%u p999_us=%u gbps=%.2f cpu_us_per_req=%.1f "
+			"peak_rss_kb=%ld\n", s.name, threads, requests,
+			(unsigned long long) errors, requests / wall, percentile(latency, 0.5),
+			percentile(latency, 0.99), percentile(latency, 0.999), bytes * 8 / wall / 1e9,
+			requests ? cpu * 1e6 / requests : 0.0, peak_rss_kb(proxy));
+	fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: load_bench PROXY [THREADS [SECONDS "
+				"[PROXY_OPTION]...]]\n");
+		return 1;
+	}
+	int threads = argc > 2 ? atoi(argv[2]) : 16;
+	double seconds = argc > 3 ? atof(argv[3]) : 3;
+	if (threads < 1 || seconds <= 0) {
+		fprintf(stderr, "Invalid threads or seconds\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	body_bytes.resize(MAX_OBJECT);
+	for (std::size_t i = 0; i < MAX_OBJECT; i++) {
+		body_bytes[i] = "0123456789abcdef"[i & 15];
+	}
+
+	int origin_port;
+	int origin_fd = listen_loopback(origin_port);
+	std::thread(run_origin, origin_fd).detach();
+
+	// the port is free again once this socket is closed
+	int proxy_port;
+	close(listen_loopback(proxy_port));
+	pid_t proxy = start_proxy(argv[1], proxy_port, ORIGIN_HOST,
+			std::vector<std::string>(argv + std::min(argc, 4), argv + argc));
+
+	const scenario scenarios[] = {
+			{ "cache_hit_1k", "/static/1024", false, false },
+			{ "origin_1k", "/static/1024", false, true },
+			{ "origin_64k", "/static/65536", false, true },
+			{ "origin_chunked_64k", "/chunked/65536", false, true },
+			{ "origin_1m", "/static/1048576", false, true },
+			{ "tunnel_1k", "/static/1024", true, false },
+			{ "tunnel_1m", "/static/1048576", true, false } };
+	for (auto & s : scenarios) {
+		run(s, proxy, proxy_port, origin_port, threads, seconds);
+	}
+
+	stop_proxy(proxy);
+	_exit(0);
+}
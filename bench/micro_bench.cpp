@@ -0,0 +1,386 @@
+/*
+ * micro_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "alloc_counter.h"
+#include "chunked.h"
+#include "dispatch.h"
+#include "http.h"
+#include "loaders.h"
+#include "relay.h"
+
+// Component level numbers for the hot paths: header parsing and assembly,
+// chunked decoding, the loaders, arm_manual, event churn and the copy relay.
+// Every case prints one line of key=value pairs with the time and the heap
+// allocations per operation. Cases that need a dispatcher run in a child
+// process of their own, since SIGINT ends every loop for good.
+//
+//   micro_bench [SCALE]
+
+using clock_type = std::chrono::steady_clock;
+
+static const std::string request_head =
+		"GET /assets/js/app.3f9a1c.js?v=20261019 HTTP/1.1\r\n"
+				"Host: www.example.com\r\n"
+				"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:131.0) "
+				"Gecko/20100101 Firefox/131.0\r\n"
+				"Accept: */*\r\n"
+				"Accept-Language: en-US,en;q=0.5\r\n"
+				"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+				"Referer: https://www.example.com/products/list?page=2\r\n"
+				"Cookie: session=7b1d5e0c9a2f4e8b; theme=dark; consent=1\r\n"
+				"If-None-Match: \"5f2a-63c1e0b2\"\r\n"
+				"Connection: keep-alive\r\n\r\n";
+
+static const std::string response_head = "HTTP/1.1 200 OK\r\n"
+		"Date: Mon, 19 Oct 2026 10:00:00 GMT\r\n"
+		"Server: nginx/1.26.2\r\n"
+		"Content-Type: application/javascript; charset=utf-8\r\n"
+		"Content-Length: 48213\r\n"
+		"Last-Modified: Fri, 16 Oct 2026 08:12:44 GMT\r\n"
+		"ETag: \"5f2a-63c1e0b2\"\r\n"
+		"Cache-Control: public, max-age=3600\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Connection: keep-alive\r\n\r\n";
+
+struct timer {
+	clock_type::time_point started = clock_type::now();
+	std::uint64_t allocs_at_start = alloc_counter::allocations();
+
+	void report(const char * name, long ops, const char * extra = "") const {
+		double ns = std::chrono::duration<double, std::nano>(
+				clock_type::now() - started).count();
+		printf("bench=%s ops=%ld ns_per_op=%.1f allocs_per_op=%.2f%s\n", name,
+				ops, ns / ops,
+				double(alloc_counter::allocations() - allocs_at_start) / ops,
+				extra);
+		fflush(stdout);
+	}
+};
+
+// Runs op in growing batches until a batch takes long enough to trust
+template<class F>
+static void measure(const char * name, F && op) {
+	op();
+	for (long n = 16;; n *= 4) {
+		timer t;
+		for (long i = 0; i < n; i++) {
+			op();
+		}
+		if (clock_type::now() - t.started > std::chrono::milliseconds(200)
+				|| n > (1L << 30)) {
+			t.report(name, n);
+			return;
+		}
+	}
+}
+
+template<class F>
+static int in_child(F && body) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (!freopen("/dev/null", "w", stderr)) {
+			_exit(1);
+		}
+		sigset_t sigmask;
+		sigemptyset(&sigmask);
+		sigaddset(&sigmask, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &sigmask, nullptr);
+		body();
+		dispatch::run_dispatcher_in_current_thread();
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static void stop_loops() {
+	kill(getpid(), SIGINT);
+}
+
+static bool write_all(int fd, const char * data, std::size_t length) {
+	while (length) {
+		ssize_t wr = write(fd, data, length);
+		if (wr <= 0) {
+			return false;
+		}
+		data += wr;
+		length -= wr;
+	}
+	return true;
+}
+
+static void bench_headers() {
+	measure("parse_request_head", [] {
+		header_parser hp;
+		hp.set_string(request_head);
+	});
+	measure("parse_response_head", [] {
+		header_parser hp;
+		hp.set_string(response_head);
+	});
+	header_parser request, response;
+	request.set_string(request_head);
+	response.set_string(response_head);
+	measure("assemble_request_head", [&request] {
+		std::string head = request.assemble_head();
+	});
+	measure("assemble_response_head", [&response] {
+		std::string head = response.assemble_head();
+	});
+}
+
+// a chunked body of payload bytes in chunks of [min_chunk, max_chunk], with an
+// extension on every fourth
+static std::string chunked_body(std::size_t payload, int min_chunk,
+		int max_chunk) {
+	std::mt19937 rnd(42);
+	std::uniform_int_distribution<int> len(min_chunk, max_chunk);
+	std::string res;
+	char hdr[64];
+	int n = 0;
+	for (std::size_t pos = 0; pos < payload; n++) {
+		std::size_t sz = std::min<std::size_t>(len(rnd), payload - pos);
+		snprintf(hdr, sizeof(hdr), n % 4 ? "%zx\r\n" : "%zx;ext=\"v\"\r\n", sz);
+		res += hdr;
+		res.append(sz, 'x');
+		res += "\r\n";
+		pos += sz;
+	}
+	return res + "0\r\nX-Checksum: 1234\r\n\r\n";
+}
+
+static void bench_chunked() {
+	struct {
+		const char * name;
+		int min_chunk, max_chunk;
+	} patterns[] = { { "tiny", 1, 16 }, { "small", 64, 512 }, { "large", 16
+			<< 10, 16 << 10 }, { "mixed", 1, 32 << 10 } };
+	for (auto & p : patterns) {
+		std::string body = chunked_body(64 << 10, p.min_chunk, p.max_chunk);
+		for (auto md : { chunked_decoder::mode::validate,
+				chunked_decoder::mode::dechunk }) {
+			std::string name = std::string("chunked_")
+					+ (md == chunked_decoder::mode::validate ?
+							"validate_" : "dechunk_") + p.name + "_64k";
+			std::string buf;
+			buf.reserve(body.size());
+			measure(name.c_str(), [&] {
+				buf = body;
+				chunked_decoder dec(0, md);
+				if (dec.feed(buf) != chunked_decoder::status::done) {
+					printf("%s: decoding failed\n", name.c_str());
+					exit(1);
+				}
+			});
+		}
+	}
+}
+
+enum class loader {
+	fixed, headers, chunked
+};
+
+// One op writes message into a socketpair and runs the loader until it
+// finishes, so it covers the dispatcher wakeup as well as the reads.
+static int bench_loader(const char * name, loader kind,
+		const std::string & message, long ops) {
+	return in_child([=] {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			perror("socketpair");
+			_exit(1);
+		}
+		auto sock = std::make_shared<dispatch::fd_ref>(sv[0],
+				EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		auto buf = std::make_shared<std::string>();
+		auto fail = std::make_shared<dispatch::event_ref>([name] {
+			printf("bench=%s failed\n", name);
+			fflush(stdout);
+			_exit(1);
+		});
+		auto next = std::make_shared<dispatch::event_ref>();
+		auto t = std::make_shared<timer>();
+		auto left = std::make_shared<long>(ops);
+		*next = dispatch::event_ref([=] {
+			if ((*left)-- == 0) {
+				t->report(name, ops);
+				stop_loops();
+				return;
+			}
+			buf->clear();
+			switch (kind) {
+			case loader::fixed:
+				write_all(sv[1], message.data(), message.size());
+				async_load::fixed(*buf, *sock, message.size(), *next, *fail);
+				break;
+			case loader::headers:
+				write_all(sv[1], message.data(), message.size());
+				async_load::headers(*buf, *sock, *next, *fail);
+				break;
+			case loader::chunked:
+				*buf = response_head;
+				write_all(sv[1], message.data(), message.size());
+				async_load::chunked(*buf, *sock, *next, *fail);
+				break;
+			}
+		});
+		*t = timer();
+		dispatch::arm_manual(*next);
+	});
+}
+
+static int bench_arm_same_loop(long ops) {
+	return in_child([=] {
+		auto ev = std::make_shared<dispatch::event_ref>();
+		auto t = std::make_shared<timer>();
+		auto left = std::make_shared<long>(ops);
+		*ev = dispatch::event_ref([=] {
+			if (--*left == 0) {
+				t->report("arm_manual_same_loop", ops);
+				stop_loops();
+			} else {
+				dispatch::arm_manual(*ev);
+			}
+		});
+		*t = timer();
+		dispatch::arm_manual(*ev);
+	});
+}
+
+// the way resolver threads wake a connection
+static int bench_arm_cross_thread(long ops) {
+	return in_child([=] {
+		auto ran = std::make_shared<std::atomic<bool>>(false);
+		auto ev = std::make_shared<dispatch::event_ref>([ran] {
+			ran->store(true, std::memory_order_release);
+		});
+		std::thread([=] {
+			timer t;
+			for (long i = 0; i < ops; i++) {
+				ran->store(false, std::memory_order_relaxed);
+				dispatch::arm_manual(*ev);
+				while (!ran->load(std::memory_order_acquire)) {
+				}
+			}
+			t.report("arm_manual_cross_thread", ops);
+			stop_loops();
+		}).detach();
+	});
+}
+
+// made and recycled the way connections bind their steps
+static int bench_event_churn(long ops) {
+	return in_child([=] {
+		auto owner = std::make_shared<int>(0);
+		auto ev = std::make_shared<dispatch::event_ref>();
+		// the event keeps itself until the loop stops
+		*ev = dispatch::event_ref([=] {
+			auto keep = ev;
+			timer t;
+			for (long i = 0; i < ops; i++) {
+				dispatch::event_ref churn([owner] {
+					(*owner)++;
+				});
+			}
+			t.report("event_ref_churn", ops);
+			stop_loops();
+		});
+		dispatch::arm_manual(*ev);
+	});
+}
+
+// one op is one message through a copy relay between two socketpairs
+static int bench_relay(std::size_t message, long ops) {
+	return in_child([=] {
+		int a[2], b[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) == -1
+				|| socketpair(AF_UNIX, SOCK_STREAM, 0, b) == -1) {
+			perror("socketpair");
+			_exit(1);
+		}
+		auto in = std::make_shared<dispatch::fd_ref>(a[1],
+				EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		auto out = std::make_shared<dispatch::fd_ref>(b[0],
+				EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		make_relay(*in, *out, "", [] {
+		});
+		std::thread([=] {
+			std::string msg(message, 'x');
+			for (long i = 0; i < ops; i++) {
+				write_all(a[0], msg.data(), msg.size());
+			}
+		}).detach();
+		// the relay holds on to the descriptors by reference
+		std::thread([=] {
+			auto keep = std::make_pair(in, out);
+			timer t;
+			std::string got(1 << 16, 0);
+			std::size_t left = message * ops;
+			while (left) {
+				ssize_t rd = read(b[1], &got[0],
+						std::min(left, got.size()));
+				if (rd <= 0) {
+					_exit(1);
+				}
+				left -= rd;
+			}
+			double sec = std::chrono::duration<double>(
+					clock_type::now() - t.started).count();
+			char extra[64];
+			snprintf(extra, sizeof(extra), " mb_per_s=%.0f",
+					message * ops / sec / 1e6);
+			t.report(
+					message == 1024 ?
+							"relay_loop_once_1k" : "relay_loop_once_16k", ops,
+					extra);
+			stop_loops();
+		}).detach();
+	});
+}
+
+int main(int argc, char ** argv) {
+	long scale = argc > 1 ? atol(argv[1]) : 1;
+	if (scale < 1) {
+		fprintf(stderr, "Usage: micro_bench [SCALE]\n");
+		return 1;
+	}
+	bench_headers();
+	bench_chunked();
+
+	std::string fixed_body(4 << 10, 'x');
+	std::string chunked = chunked_body(16 << 10, 64, 512);
+	int res = 0;
+	res |= bench_loader("load_fixed_4k", loader::fixed, fixed_body,
+			100000 * scale);
+	res |= bench_loader("load_headers", loader::headers, request_head,
+			100000 * scale);
+	res |= bench_loader("load_chunked_16k", loader::chunked, chunked,
+			50000 * scale);
+	res |= bench_arm_same_loop(500000 * scale);
+	res |= bench_arm_cross_thread(100000 * scale);
+	res |= bench_event_churn(500000 * scale);
+	res |= bench_relay(1024, 200000 * scale);
+	res |= bench_relay(16 << 10, 100000 * scale);
+	return res;
+}
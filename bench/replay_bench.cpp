@@ -0,0 +1,496 @@
+/*
+ * replay_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "capture.h"
+#include "harness.h"
+
+// Replays the shape of captured traffic through one or two proxy builds and
+// compares their latencies. Captures taken with --capture-flow-kb=0 carry no
+// payload, only when each flow started and how many bytes went which way
+// when, and that is all the replay uses:
+//
+//   replay_bench [--speed=X] [--concurrency=N] [--proxy-option=OPT]...
+//                CAPTURE PROXY [PROXY]
+//
+// CAPTURE is a capture file or a directory of them. Every flow starts at its
+// recorded offset divided by the speed. HTTP flows send a request of the
+// recorded size, and the local origin waits as long as the recorded response
+// took before answering with the recorded size. Tunnel flows open a CONNECT
+// tunnel to the origin and both ends send their recorded reads at their
+// recorded times. All flows go to one origin, every request is marked
+// no-store so it reaches it.
+
+using namespace harness;
+using clock_type = std::chrono::steady_clock;
+
+constexpr char ORIGIN_HOST[] = "replay.origin";
+constexpr std::size_t MAX_PAD = 8 << 10; // request bytes sent as a header
+constexpr int STALL_MS = 10000;
+
+struct shape_event {
+	std::uint64_t at_ns; // since the flow opened
+	capture::direction dir;
+	std::uint32_t length;
+};
+
+struct recorded_flow {
+	std::uint64_t start_ns; // since the first flow opened
+	bool tunnel;
+	std::vector<shape_event> events;
+	// HTTP only
+	std::uint64_t request_bytes = 0, response_bytes = 0, think_ns = 0;
+};
+
+struct result {
+	std::vector<std::uint32_t> http_us, tunnel_us, lag_us;
+	std::uint64_t errors = 0;
+	std::mutex mut;
+};
+
+static std::vector<recorded_flow> flows;
+static double speed = 1;
+static int origin_port;
+static char zeros[64 << 10];
+
+static std::vector<std::string> capture_files(const std::string & path) {
+	std::vector<std::string> files;
+	DIR * dir = opendir(path.c_str());
+	if (!dir) {
+		files.push_back(path);
+		return files;
+	}
+	while (dirent * e = readdir(dir)) {
+		std::string name = e->d_name;
+		if (name.size() > 6
+				&& name.compare(name.size() - 6, 6, ".pxcap") == 0) {
+			files.push_back(path + "/" + name);
+		}
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+static void load(const std::string & path) {
+	std::unordered_map<std::uint32_t, std::size_t> open_flows;
+	std::unordered_map<std::uint32_t, std::uint64_t> opened_at;
+	std::uint64_t first_ns = UINT64_MAX;
+	for (auto & name : capture_files(path)) {
+		FILE * f = fopen(name.c_str(), "rb");
+		char magic[sizeof(capture::FILE_MAGIC) - 1];
+		if (!f || fread(magic, sizeof(magic), 1, f) != 1
+				|| memcmp(magic, capture::FILE_MAGIC, sizeof(magic))) {
+			fprintf(stderr, "%s is not a capture file\n", name.c_str());
+			exit(1);
+		}
+		capture::record_header hdr;
+		while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+			fseek(f, hdr.captured_length, SEEK_CUR);
+			if (hdr.type == capture::record_type::FLOW_OPEN) {
+				// flow ids start over with every proxy run
+				open_flows[hdr.flow] = flows.size();
+				opened_at[hdr.flow] = hdr.timestamp_ns;
+				first_ns = std::min(first_ns, hdr.timestamp_ns);
+				recorded_flow rf;
+				rf.start_ns = hdr.timestamp_ns;
+				rf.tunnel = hdr.flags & capture::FLOW_TUNNEL;
+				flows.push_back(rf);
+			} else if (hdr.type == capture::record_type::DATA
+					&& open_flows.count(hdr.flow)) {
+				flows[open_flows[hdr.flow]].events.push_back( {
+						hdr.timestamp_ns - opened_at[hdr.flow], hdr.dir,
+						hdr.original_length });
+			} else if (hdr.type == capture::record_type::FLOW_CLOSE) {
+				open_flows.erase(hdr.flow);
+			}
+		}
+		fclose(f);
+	}
+
+	std::vector<recorded_flow> usable;
+	for (auto & rf : flows) {
+		rf.start_ns -= first_ns;
+		if (rf.tunnel) {
+			// the first answer is the proxy's own 200
+			auto own = std::find_if(rf.events.begin(), rf.events.end(),
+					[](const shape_event & e) {
+						return e.dir == capture::direction::to_client;
+					});
+			if (own != rf.events.end()) {
+				rf.events.erase(own);
+			}
+			usable.push_back(rf);
+			continue;
+		}
+		std::uint64_t sent_at = 0, answered_at = 0;
+		for (auto & e : rf.events) {
+			if (e.dir == capture::direction::to_server) {
+				rf.request_bytes += e.length;
+				sent_at = e.at_ns;
+			} else {
+				rf.response_bytes += e.length;
+				answered_at = answered_at ? answered_at : e.at_ns;
+			}
+		}
+		// cache hits and failed requests never reached an origin
+		if (rf.request_bytes && rf.response_bytes) {
+			rf.think_ns = answered_at > sent_at ? answered_at - sent_at : 0;
+			usable.push_back(rf);
+		}
+	}
+	fprintf(stderr, "%zu flows recorded, %zu replayable\n", flows.size(),
+			usable.size());
+	flows = std::move(usable);
+	std::stable_sort(flows.begin(), flows.end(),
+			[](const recorded_flow & a, const recorded_flow & b) {
+				return a.start_ns < b.start_ns;
+			});
+}
+
+static clock_type::duration scaled(std::uint64_t ns) {
+	return std::chrono::nanoseconds(std::uint64_t(ns / speed));
+}
+
+// Sends this end's events of a tunnel at their times and reads until the
+// other end's bytes all came in, received counts what already did
+static bool play(int fd, const std::vector<shape_event> & events,
+		capture::direction out, std::uint64_t received,
+		clock_type::time_point start) {
+	std::uint64_t expected = 0;
+	for (auto & e : events) {
+		expected += e.dir != out ? e.length : 0;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	std::size_t next = 0;
+	std::uint64_t unsent = 0;
+	char buf[64 << 10];
+	auto progress = clock_type::now();
+	for (;;) {
+		auto now = clock_type::now();
+		for (;
+				next < events.size()
+						&& start + scaled(events[next].at_ns) <= now; next++) {
+			unsent += events[next].dir == out ? events[next].length : 0;
+		}
+		while (unsent) {
+			ssize_t n = write(fd, zeros, std::min<std::uint64_t>(unsent,
+					sizeof(zeros)));
+			if (n <= 0) {
+				break;
+			}
+			unsent -= n;
+			progress = now;
+		}
+		if (next == events.size() && !unsent && received >= expected) {
+			return true;
+		}
+		int timeout = -1;
+		if (next < events.size()) {
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+					start + scaled(events[next].at_ns) - now).count() + 1;
+		}
+		// gaps in the recording are not stalls
+		if (next == events.size()
+				&& now - progress > std::chrono::milliseconds(STALL_MS)) {
+			return false;
+		}
+		if (timeout < 0 || timeout > STALL_MS) {
+			timeout = STALL_MS;
+		}
+		pollfd pfd { fd, short(POLLIN | (unsent ? POLLOUT : 0)), 0 };
+		poll(&pfd, 1, timeout);
+		for (;;) {
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n == 0 && received < expected) {
+				return false;
+			}
+			if (n <= 0) {
+				break;
+			}
+			received += n;
+			progress = clock_type::now();
+		}
+	}
+}
+
+static void serve_http(int fd, std::string & pending) {
+	std::string head;
+	if (!read_head(fd, pending, head)) {
+		return;
+	}
+	std::size_t at = head.find("/replay/");
+	std::size_t id = at == std::string::npos ?
+			flows.size() : strtoul(head.c_str() + at + 8, nullptr, 10);
+	const char * cl = strcasestr(head.c_str(), "\nContent-Length:");
+	std::size_t body = cl ? strtoul(cl + 16, nullptr, 10) : 0;
+	char buf[64 << 10];
+	while (pending.size() < body) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			return;
+		}
+		pending.append(buf, n);
+	}
+	if (id >= flows.size()) {
+		static const char missing[] =
+				"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		write_all(fd, missing, sizeof(missing) - 1);
+		return;
+	}
+	const recorded_flow & rf = flows[id];
+	std::this_thread::sleep_for(scaled(rf.think_ns));
+	// the recorded size includes the head
+	const char * fmt = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\n"
+			"Content-Length: %llu\r\n\r\n";
+	char reply[128];
+	int len = snprintf(reply, sizeof(reply), fmt,
+			(unsigned long long) rf.response_bytes);
+	std::uint64_t left = rf.response_bytes > std::uint64_t(len) ?
+			rf.response_bytes - len : 0;
+	len = snprintf(reply, sizeof(reply), fmt, (unsigned long long) left);
+	write_all(fd, reply, len);
+	while (left) {
+		std::size_t n = std::min<std::uint64_t>(left, sizeof(zeros));
+		if (!write_all(fd, zeros, n)) {
+			return;
+		}
+		left -= n;
+	}
+}
+
+// Tunnels start with "replay ID\n", anything else is an HTTP request
+static void serve_origin_client(int fd) {
+	std::string pending;
+	char buf[4096];
+	while (pending.find('\n') == std::string::npos) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			close(fd);
+			return;
+		}
+		pending.append(buf, n);
+	}
+	if (pending.compare(0, 7, "replay ") == 0) {
+		std::size_t id = strtoul(pending.c_str() + 7, nullptr, 10);
+		std::size_t rest = pending.size() - pending.find('\n') - 1;
+		if (id < flows.size()) {
+			play(fd, flows[id].events, capture::direction::to_client, rest,
+					clock_type::now());
+		}
+	} else {
+		serve_http(fd, pending);
+	}
+	shutdown(fd, SHUT_WR);
+	close(fd);
+}
+
+static void run_origin(int listen_fd) {
+	for (;;) {
+		int fd = accept(listen_fd, nullptr, nullptr);
+		if (fd != -1) {
+			std::thread(serve_origin_client, fd).detach();
+		}
+	}
+}
+
+static std::string target() {
+	return std::string(ORIGIN_HOST) + ":" + std::to_string(origin_port);
+}
+
+static bool replay_http(int fd, std::size_t id) {
+	const recorded_flow & rf = flows[id];
+	std::string head = "GET http://" + target() + "/replay/"
+			+ std::to_string(id) + " HTTP/1.1\r\nHost: " + target()
+			+ "\r\nCache-Control: no-store\r\n";
+	std::uint64_t left = rf.request_bytes > head.size() + 2 ?
+			rf.request_bytes - head.size() - 2 : 0;
+	std::string body;
+	if (left > MAX_PAD) {
+		head.replace(0, 3, "POST");
+		head += "Content-Length: " + std::to_string(left) + "\r\n";
+		body.assign(left, 'x');
+	} else if (left > 10) {
+		head += "X-Pad: " + std::string(left - 9, 'x') + "\r\n";
+	}
+	head += "\r\n";
+	if (!write_all(fd, head.data(), head.size())
+			|| !write_all(fd, body.data(), body.size())) {
+		return false;
+	}
+	std::string pending, response;
+	if (!read_head(fd, pending, response)
+			|| response.compare(0, 12, "HTTP/1.1 200")) {
+		return false;
+	}
+	char buf[64 << 10];
+	while (read(fd, buf, sizeof(buf)) > 0) {
+	}
+	return true;
+}
+
+static bool replay_tunnel(int fd, std::size_t id) {
+	std::string req = "CONNECT " + target() + " HTTP/1.1\r\nHost: " + target()
+			+ "\r\n\r\n";
+	std::string pending, head;
+	if (!write_all(fd, req.data(), req.size()) || !read_head(fd, pending, head)
+			|| head.compare(0, 12, "HTTP/1.1 200")) {
+		return false;
+	}
+	std::string hello = "replay " + std::to_string(id) + "\n";
+	return write_all(fd, hello.data(), hello.size())
+			&& play(fd, flows[id].events, capture::direction::to_server,
+					pending.size(), clock_type::now());
+}
+
+static void replay(int proxy_port, int concurrency, result & res) {
+	std::atomic<std::size_t> next { 0 };
+	auto started = clock_type::now();
+	auto worker = [&] {
+		for (std::size_t id; (id = next++) < flows.size();) {
+			auto due = started + scaled(flows[id].start_ns);
+			std::this_thread::sleep_until(due);
+			auto begun = clock_type::now();
+			int fd = connect_loopback(proxy_port);
+			bool ok = fd != -1
+					&& (flows[id].tunnel ?
+							replay_tunnel(fd, id) : replay_http(fd, id));
+			if (fd != -1) {
+				close(fd);
+			}
+			auto took = std::chrono::duration_cast<std::chrono::microseconds>(
+					clock_type::now() - begun).count();
+			auto lag = std::chrono::duration_cast<std::chrono::microseconds>(
+					begun - due).count();
+			std::lock_guard<std::mutex> lg(res.mut);
+			if (!ok) {
+				res.errors++;
+				continue;
+			}
+			(flows[id].tunnel ? res.tunnel_us : res.http_us).push_back(took);
+			res.lag_us.push_back(std::max<long long>(lag, 0));
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int i = 0; i < concurrency; i++) {
+		workers.emplace_back(worker);
+	}
+	for (auto & t : workers) {
+		t.join();
+	}
+	std::sort(res.http_us.begin(), res.http_us.end());
+	std::sort(res.tunnel_us.begin(), res.tunnel_us.end());
+	std::sort(res.lag_us.begin(), res.lag_us.end());
+}
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char * const quantile_names[] = { "p50", "p90", "p99", "p999" };
+
+static void report(const char * build, const char * kind,
+		const std::vector<std::uint32_t> & us) {
+	printf("build=%s kind=%s flows=%zu", build, kind, us.size());
+	for (int q = 0; q < 4; q++) {
+		printf(" %s_us=%u", quantile_names[q], percentile(us, quantiles[q]));
+	}
+	printf(" max_us=%u\n", us.empty() ? 0 : us.back());
+}
+
+static void report_diff(const char * kind, const std::vector<std::uint32_t> & a,
+		const std::vector<std::uint32_t> & b) {
+	if (a.empty() || b.empty()) {
+		return;
+	}
+	printf("diff kind=%s", kind);
+	for (int q = 0; q < 4; q++) {
+		double pa = percentile(a, quantiles[q]), pb = percentile(b, quantiles[q]);
+		printf(" %s_pct=%+.1f", quantile_names[q],
+				pa ? (pb - pa) * 100 / pa : 0.0);
+	}
+	printf("\n");
+}
+
+static const option long_options[] = {
+		{ "speed", required_argument, nullptr, 's' },
+		{ "concurrency", required_argument, nullptr, 'c' },
+		{ "proxy-option", required_argument, nullptr, 'o' },
+		{ nullptr, 0, nullptr, 0 } };
+
+int main(int argc, char ** argv) {
+	int concurrency = 256;
+	std::vector<std::string> proxy_options;
+	for (int opt; (opt = getopt_long(argc, argv, "", long_options, nullptr))
+			!= -1;) {
+		switch (opt) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'o':
+			proxy_options.push_back(optarg);
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (argc - optind < 2 || argc - optind > 3 || speed <= 0
+			|| concurrency < 1) {
+		fprintf(stderr, "Usage: replay_bench [--speed=X] [--concurrency=N] "
+				"[--proxy-option=OPT]...\n"
+				"                    CAPTURE PROXY [PROXY]\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	load(argv[optind]);
+	int origin_fd = listen_loopback(origin_port);
+	std::thread(run_origin, origin_fd).detach();
+
+	std::vector<std::unique_ptr<result>> results;
+	for (int i = optind + 1; i < argc; i++) {
+		int proxy_port;
+		close(listen_loopback(proxy_port));
+		pid_t proxy = start_proxy(argv[i], proxy_port, ORIGIN_HOST,
+				proxy_options);
+		results.emplace_back(new result());
+		result & res = *results.back();
+		replay(proxy_port, concurrency, res);
+		printf("build=%s errors=%llu lag_p99_us=%u cpu_s=%.2f "
+				"peak_rss_kb=%ld\n", argv[i], (unsigned long long) res.errors,
+				percentile(res.lag_us, 0.99), cpu_seconds(proxy),
+				peak_rss_kb(proxy));
+		report(argv[i], "http", res.http_us);
+		report(argv[i], "tunnel", res.tunnel_us);
+		fflush(stdout);
+		stop_proxy(proxy);
+	}
+	if (results.size() == 2) {
+		report_diff("http", results[0]->http_us, results[1]->http_us);
+		report_diff("tunnel", results[0]->tunnel_us, results[1]->tunnel_us);
+	}
+	fflush(stdout);
+	_exit(0);
+}
@@ -0,0 +1,131 @@
+/*
+ * tunnel_bench.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "dispatch.h"
+#include "relay.h"
+
+// Pushes bytes through one relay direction over loopback TCP and reports
+// throughput and dispatcher CPU time for the copy and splice relays.
+
+static void connected_pair(int & a, int & b) {
+	int lst = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(lst, (sockaddr *) &addr, len) == -1 || listen(lst, 1) == -1
+			|| getsockname(lst, (sockaddr *) &addr, &len) == -1) {
+		perror("listen");
+		exit(1);
+	}
+	a = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(a, (sockaddr *) &addr, len) == -1) {
+		perror("connect");
+		exit(1);
+	}
+	b = accept(lst, nullptr, nullptr);
+	close(lst);
+}
+
+static double thread_cpu_seconds() {
+	rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+			+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void run(bool use_splice, long long total) {
+	if (!freopen("/dev/null", "w", stderr)) {
+		exit(1);
+	}
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigmask, nullptr);
+
+	int src, relay_in, relay_out, sink;
+	connected_pair(src, relay_in);
+	connected_pair(relay_out, sink);
+
+	std::thread writer([src, total] {
+		std::vector<char> chunk(1 << 16, 'x');
+		for (long long sent = 0; sent < total;) {
+			ssize_t wr = write(src, chunk.data(),
+					std::min<long long>(chunk.size(), total - sent));
+			if (wr <= 0) {
+				break;
+			}
+			sent += wr;
+		}
+		close(src);
+	});
+	long long received = 0;
+	std::thread reader([sink, &received] {
+		std::vector<char> chunk(1 << 16);
+		for (ssize_t rd; (rd = read(sink, chunk.data(), chunk.size())) > 0;) {
+			received += rd;
+		}
+	});
+
+	auto start = std::chrono::steady_clock::now();
+	double cpu_start = thread_cpu_seconds();
+	{
+		dispatch::fd_ref in(relay_in, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		dispatch::fd_ref out(relay_out,
+				EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		auto fin = [relay_out] {
+			shutdown(relay_out, SHUT_WR);
+			kill(getpid(), SIGINT);
+		};
+		if (use_splice) {
+			make_splice_relay(in, out, "", fin);
+		} else {
+			make_relay(in, out, "", fin);
+		}
+		dispatch::run_dispatcher_in_current_thread();
+	}
+	double cpu = thread_cpu_seconds() - cpu_start;
+	writer.join();
+	reader.join();
+	double wall = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	double gbits = received * 8 / 1e9;
+	printf("mode=%s bytes=%lld wall_s=%.3f gbps=%.2f dispatcher_cpu_s=%.3f "
+			"cpu_s_per_gbit=%.4f\n", use_splice ? "splice" : "copy", received,
+			wall, gbits / wall, cpu, cpu / gbits);
+	fflush(stdout);
+	_exit(received == total ? 0 : 1);
+}
+
+int main(int argc, char ** argv) {
+	long long total = (argc > 1 ? atoll(argv[1]) : 256) << 20;
+	int res = 0;
+	for (bool use_splice : { false, true }) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			run(use_splice, total);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		res |= !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+	return res;
+}
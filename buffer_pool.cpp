@@ -0,0 +1,197 @@
+/*
+ * buffer_pool.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "topology.h"
+
+namespace buffer_pool {
+
+constexpr int CLASS_COUNT = 4; // 4K, 16K, 64K, 256K
+constexpr int HUGE_CLASS = CLASS_COUNT;
+// keeps the data cache line aligned
+constexpr std::size_t HEADER_SIZE = 64;
+
+struct slab {
+	std::atomic<long> refs { 1 };
+	std::size_t capacity;
+	int cls;
+	int node; // NUMA node of the thread that allocated it
+};
+
+static_assert(sizeof(slab) <= HEADER_SIZE, "slab header fits");
+
+static std::atomic<std::size_t> cache_limit { 8 << 20 };
+static std::atomic<std::uint64_t> heap_allocations { 0 }, reuses { 0 };
+static std::atomic<std::size_t> bytes_in_use { 0 }, bytes_cached { 0 };
+
+static void free_slab(slab * s) {
+	s->~slab();
+	::operator delete(s);
+}
+
+// buffers can outlive the cache of their thread when they are held by
+// static objects, those go straight back to the heap
+static thread_local bool cache_gone = false;
+
+// Fresh slabs get their pages on the node of the thread that first writes
+// them, which is the allocating one. Each thread only caches slabs of its own
+// node, so a buffer released far from where it came from goes back to the
+// heap instead of serving remote memory to the next reader.
+struct thread_cache {
+	std::vector<slab *> lists[CLASS_COUNT];
+	std::size_t cached[CLASS_COUNT] = { };
+	// taken when the thread first uses the pool, dispatcher threads are
+	// pinned by then
+	const int node = topology::current_node();
+	~thread_cache() {
+		cache_gone = true;
+		for (int i = 0; i < CLASS_COUNT; i++) {
+			bytes_cached -= cached[i];
+			for (slab * s : lists[i]) {
+				free_slab(s);
+			}
+		}
+	}
+};
+
+static thread_local thread_cache cache;
+
+static int class_for(std::size_t size) {
+	int cls = 0;
+	for (std::size_t c = MIN_CLASS_SIZE; c < size; c <<= 2) {
+		cls++;
+	}
+	return cls < CLASS_COUNT ? cls : HUGE_CLASS;
+}
+
+static slab * acquire(std::size_t min_capacity) {
+	int cls = class_for(min_capacity);
+	std::size_t capacity =
+			cls == HUGE_CLASS ? min_capacity : MIN_CLASS_SIZE << (2 * cls);
+	slab * s;
+	if (cls != HUGE_CLASS && !cache_gone && cache.lists[cls].size()) {
+		s = cache.lists[cls].back();
+		cache.lists[cls].pop_back();
+		cache.cached[cls] -= capacity;
+		bytes_cached.fetch_sub(capacity, std::memory_order_relaxed);
+		s->refs.store(1, std::memory_order_relaxed);
+		reuses.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		s = new (::operator new(HEADER_SIZE + capacity)) slab;
+		s->capacity = capacity;
+		s->cls = cls;
+		s->node = cache_gone ? -1 : cache.node;
+		heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+	bytes_in_use.fetch_add(capacity, std::memory_order_relaxed);
+	return s;
+}
+
+static void release(slab * s) {
+	if (s->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+		return;
+	}
+	bytes_in_use.fetch_sub(s->capacity, std::memory_order_relaxed);
+	int cls = s->cls;
+	if (cls == HUGE_CLASS || cache_gone || s->node != cache.node
+			|| cache.cached[cls] + s->capacity
+					> cache_limit.load(std::memory_order_relaxed)) {
+		free_slab(s);
+		return;
+	}
+	cache.lists[cls].push_back(s);
+	cache.cached[cls] += s->capacity;
+	bytes_cached.fetch_add(s->capacity, std::memory_order_relaxed);
+}
+
+pooled_buffer::pooled_buffer(std::size_t min_capacity) :
+		s(acquire(min_capacity)) {
+}
+
+pooled_buffer::pooled_buffer(const pooled_buffer & other) :
+		s(other.s) {
+	if (s) {
+		s->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+pooled_buffer::pooled_buffer(pooled_buffer && other) :
+		s(other.s) {
+	other.s = nullptr;
+}
+
+pooled_buffer & pooled_buffer::operator =(pooled_buffer other) {
+	std::swap(s, other.s);
+	return *this;
+}
+
+pooled_buffer::~pooled_buffer() {
+	reset();
+}
+
+char * pooled_buffer::data() const {
+	return s ? reinterpret_cast<char *>(s) + HEADER_SIZE : nullptr;
+}
+
+std::size_t pooled_buffer::capacity() const {
+	return s ? s->capacity : 0;
+}
+
+long pooled_buffer::use_count() const {
+	return s ? s->refs.load(std::memory_order_relaxed) : 0;
+}
+
+pooled_buffer::operator bool() const {
+	return s;
+}
+
+void pooled_buffer::reset() {
+	if (s) {
+		release(s);
+		s = nullptr;
+	}
+}
+
+read_sizer::read_sizer(std::size_t initial) :
+		cur(std::max(MIN_CLASS_SIZE, std::min(initial, MAX_CLASS_SIZE))) {
+}
+
+std::size_t read_sizer::size() const {
+	return cur;
+}
+
+void read_sizer::update(std::size_t got, std::size_t space) {
+	if (got >= space) {
+		cur = std::min(cur * 4, MAX_CLASS_SIZE);
+		small_reads = 0;
+	} else if (got < cur / 8) {
+		if (++small_reads == 4) {
+			cur = std::max(cur / 4, MIN_CLASS_SIZE);
+			small_reads = 0;
+		}
+	} else {
+		small_reads = 0;
+	}
+}
+
+void set_cache_limit(std::size_t bytes_per_class) {
+	cache_limit = bytes_per_class;
+}
+
+stats_t stats() {
+	return {heap_allocations.load(), reuses.load(), bytes_in_use.load(),
+		bytes_cached.load()};
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+ * buffer_pool.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// I/O buffers in a few power of two size classes.
+// Released buffers are kept on a free list of the releasing thread and handed
+// out again from there, so a dispatcher thread serving many short bursts
+// doesn't go to the heap for every one of them. Requests over the largest
+// class are allocated and freed directly.
+namespace buffer_pool {
+
+constexpr std::size_t MIN_CLASS_SIZE = 1 << 12;
+constexpr std::size_t MAX_CLASS_SIZE = 1 << 18;
+
+struct slab;
+
+// Refcounted handle to a buffer, copies share the same memory
+class pooled_buffer {
+	slab * s = nullptr;
+public:
+	pooled_buffer() = default;
+	// at least min_capacity bytes
+	explicit pooled_buffer(std::size_t min_capacity);
+
+	pooled_buffer(const pooled_buffer &);
+	pooled_buffer(pooled_buffer &&);
+	pooled_buffer & operator =(pooled_buffer);
+	~pooled_buffer();
+
+	char * data() const;
+	std::size_t capacity() const;
+	long use_count() const;
+	explicit operator bool() const;
+
+	// drop the reference now
+	void reset();
+};
+
+// Picks the size of the next read buffer of a stream, in steps of the size
+// classes: grows while reads keep filling it, shrinks back once a run of
+// small reads says the flow is interactive.
+class read_sizer {
+	std::size_t cur;
+	unsigned small_reads = 0;
+public:
+	explicit read_sizer(std::size_t initial = 16 << 10);
+	std::size_t size() const;
+	// a read returned got bytes into space bytes of buffer
+	void update(std::size_t got, std::size_t space);
+};
+
+struct stats_t {
+	std::uint64_t heap_allocations, reuses;
+	std::size_t bytes_in_use, bytes_cached;
+};
+
+// Bytes each thread may keep cached per size class, 0 disables caching
+void set_cache_limit(std::size_t bytes_per_class);
+stats_t stats();
+
+}
+
+#endif /* BUFFER_POOL_H_ */
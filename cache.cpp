@@ -0,0 +1,324 @@
+/*
+ * cache.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "cache.h"
+
+#include <strings.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+
+#include "util.h"
+
+static std::string lowercase(std::string s) {
+	for (auto & c : s) {
+		c = std::tolower(c);
+	}
+	return s;
+}
+
+static std::string trim(const std::string & s) {
+	std::size_t b = s.find_first_not_of(" \t");
+	if (b == std::string::npos) {
+		return std::string();
+	}
+	std::size_t e = s.find_last_not_of(" \t");
+	return s.substr(b, e - b + 1);
+}
+
+static std::vector<std::string> split_list(const std::string & s) {
+	std::vector<std::string> res;
+	std::size_t pos = 0;
+	while (pos <= s.size()) {
+		std::size_t comma = std::min(s.find(',', pos), s.size());
+		std::string item = trim(s.substr(pos, comma - pos));
+		if (!item.empty()) {
+			res.push_back(item);
+		}
+		pos = comma + 1;
+	}
+	return res;
+}
+
+// directive name (lowercase) -> value without quotes
+static std::unordered_map<std::string, std::string> cache_control(
+		header_parser & hp) {
+	std::unordered_map<std::string, std::string> res;
+	std::string * cc = hp.find_header("Cache-Control");
+	if (cc == nullptr) {
+		return res;
+	}
+	for (auto & item : split_list(*cc)) {
+		std::size_t eq = item.find('=');
+		std::string val;
+		if (eq != std::string::npos) {
+			val = trim(item.substr(eq + 1));
+			if (val.size() >= 2 && val.front() == '"') {
+				val = val.substr(1, val.size() - 2);
+			}
+		}
+		res[lowercase(trim(item.substr(0, eq)))] = val;
+	}
+	return res;
+}
+
+static bool parse_http_date(const std::string * s, time_t & to) {
+	if (s == nullptr) {
+		return false;
+	}
+	tm t { };
+	if (strptime(s->c_str(), "%a, %d %b %Y %H:%M:%S GMT", &t) == nullptr) {
+		return false;
+	}
+	to = timegm(&t);
+	return true;
+}
+
+static long header_seconds(const std::string & value) {
+	char * end;
+	long res = std::strtol(value.c_str(), &end, 10);
+	return end == value.c_str() || res < 0 ? -1 : res;
+}
+
+std::size_t response_cache::entry::size() const {
+	return key.size() + head.size() + body.size() + sizeof(entry) + 64;
+}
+
+response_cache::response_cache(std::size_t budget_bytes) :
+		budget(budget_bytes), protected_budget(budget_bytes / 5 * 4), max_object(
+				budget_bytes / 8) {
+}
+
+std::string cache_policy::key_for(header_parser& request,
+		const std::string& host, const std::string& port) {
+	const std::string & line = request.request();
+	std::size_t sp1 = line.find(' ');
+	std::size_t sp2 = line.find(' ', sp1 + 1);
+	if (sp1 == std::string::npos || line.compare(0, sp1, "GET") != 0) {
+		return std::string();
+	}
+	if (request.find_header("Authorization")
+			|| cache_control(request).count("no-store")) {
+		return std::string();
+	}
+	return line.substr(0, sp1) + " " + host + ":" + port + " "
+			+ line.substr(sp1 + 1, sp2 - sp1 - 1);
+}
+
+std::string response_cache::variant_key(const std::string& key,
+		header_parser& request) {
+	auto names = vary.find(key);
+	if (names == vary.end()) {
+		return key;
+	}
+	return key + cache_policy::vary_spec(names->second, request);
+}
+
+bool response_cache::lookup(const std::string& key, header_parser& request,
+		std::string& response) {
+	if (cache_policy::bypasses_stored(request)) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	std::lock_guard<std::mutex> lg(mut);
+	auto found = index.find(variant_key(key, request));
+	auto now = clock::now();
+	if (found == index.end() || found->second->expires <= now) {
+		if (found != index.end()) {
+			unlink_entry(found->second);
+		}
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	auto it = found->second;
+	if (it->seg == PROBATION) {
+		it->seg = PROTECTED;
+		probation_used -= it->size();
+		protected_used += it->size();
+		protect.splice(protect.begin(), probation, it);
+		while (protected_used > protected_budget && protect.size() > 1) {
+			auto last = std::prev(protect.end());
+			last->seg = PROBATION;
+			protected_used -= last->size();
+			probation_used += last->size();
+			probation.splice(probation.begin(), protect, last);
+		}
+	} else {
+		protect.splice(protect.begin(), protect, it);
+	}
+	long age = std::chrono::duration_cast<std::chrono::seconds>(
+			now - it->stored).count();
+	response.clear();
+	response.reserve(it->head.size() + it->body.size() + 32);
+	response += it->head;
+	response += cache_policy::age_line(age);
+	response += it->body;
+	hits.fetch_add(1, std::memory_order_relaxed);
+	bytes_saved.fetch_add(response.size(), std::memory_order_relaxed);
+	return true;
+}
+
+cache_policy cache_policy::evaluate(const std::string& response) {
+	cache_policy res;
+	std::size_t head_end = response.find("\r\n\r\n");
+	if (head_end == std::string::npos) {
+		return res;
+	}
+	header_parser hp;
+	if (!hp.set_string(response.substr(0, head_end + 4))) {
+		return res;
+	}
+	std::size_t sp = hp.request().find(' ');
+	int status = sp == std::string::npos ? 0 : atoi(hp.request().c_str() + sp);
+	switch (status) {
+	case 200:
+	case 203:
+	case 204:
+	case 300:
+	case 301:
+	case 404:
+	case 410:
+		break;
+	default:
+		return res;
+	}
+	auto cc = cache_control(hp);
+	if (cc.count("no-store") || cc.count("no-cache") || cc.count("private")
+			|| hp.find_header("Set-Cookie")) {
+		return res;
+	}
+
+	time_t wall_now = time(nullptr), date = wall_now, expires;
+	parse_http_date(hp.find_header("Date"), date);
+	long lifetime = -1;
+	if (cc.count("s-maxage")) {
+		lifetime = header_seconds(cc["s-maxage"]);
+	} else if (cc.count("max-age")) {
+		lifetime = header_seconds(cc["max-age"]);
+	} else if (parse_http_date(hp.find_header("Expires"), expires)) {
+		lifetime = expires - date;
+	}
+	long age = std::max<long>(0, wall_now - date);
+	if (std::string * age_hdr = hp.find_header("Age")) {
+		age = std::max(age, header_seconds(*age_hdr));
+	}
+	if (lifetime <= age) {
+		return res;
+	}
+
+	if (std::string * v = hp.find_header("Vary")) {
+		for (auto & name : split_list(*v)) {
+			if (name == "*") {
+				return res;
+			}
+			res.vary.push_back(lowercase(name));
+		}
+	}
+	for (auto it = hp.headers().begin(); it != hp.headers().end(); it++) {
+		if (strcasecmp(it->first.c_str(), "Age") == 0) {
+			hp.headers().erase(it);
+			break;
+		}
+	}
+	res.head = hp.assemble_head();
+	res.head.resize(res.head.size() - 2);
+	res.body_offset = head_end + 4;
+	res.lifetime = lifetime;
+	res.age = age;
+	res.storable = true;
+	return res;
+}
+
+bool cache_policy::bypasses_stored(header_parser& request) {
+	auto cc = cache_control(request);
+	std::string * pragma = request.find_header("Pragma");
+	return cc.count("no-cache") || (cc.count("max-age") && cc["max-age"] == "0")
+			|| (pragma && pragma->find("no-cache") != std::string::npos);
+}
+
+std::string cache_policy::vary_spec(const std::vector<std::string>& names,
+		header_parser& request) {
+	std::string res;
+	for (auto & name : names) {
+		std::string * val = request.find_header(name);
+		res += "\n" + name + ":" + (val ? *val : std::string());
+	}
+	return res;
+}
+
+std::string cache_policy::age_line(long age) {
+	return "Age: " + std::to_string(age) + "\r\n\r\n";
+}
+
+bool response_cache::store(const std::string& key, header_parser& request,
+		const cache_policy & policy, const std::string& response) {
+	if (key.empty() || !policy.storable) {
+		return true;
+	}
+	entry e;
+	e.head = policy.head;
+	e.body = response.substr(policy.body_offset);
+	auto now = clock::now();
+	e.stored = now - std::chrono::seconds(policy.age);
+	e.expires = e.stored + std::chrono::seconds(policy.lifetime);
+	e.seg = PROBATION;
+	e.key = key + cache_policy::vary_spec(policy.vary, request);
+	if (e.size() > max_object) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lg(mut);
+	if (policy.vary.empty()) {
+		vary.erase(key);
+	} else {
+		vary[key] = policy.vary;
+	}
+	auto old = index.find(e.key);
+	if (old != index.end()) {
+		unlink_entry(old->second);
+	}
+	probation_used += e.size();
+	probation.push_front(std::move(e));
+	index[probation.front().key] = probation.begin();
+	stores.fetch_add(1, std::memory_order_relaxed);
+	evict();
+	return true;
+}
+
+void response_cache::unlink_entry(entry_list::iterator it) {
+	index.erase(it->key);
+	if (it->seg == PROBATION) {
+		probation_used -= it->size();
+		probation.erase(it);
+	} else {
+		protected_used -= it->size();
+		protect.erase(it);
+	}
+}
+
+void response_cache::evict() {
+	while (probation_used + protected_used > budget) {
+		entry_list & from = probation.empty() ? protect : probation;
+		if (from.empty()) {
+			return;
+		}
+		util::debug() << "Cache evicts " << from.back().key;
+		unlink_entry(std::prev(from.end()));
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+response_cache::stats_t response_cache::stats() const {
+	std::lock_guard<std::mutex> lg(mut);
+	return {hits.load(std::memory_order_relaxed),
+		misses.load(std::memory_order_relaxed),
+		stores.load(std::memory_order_relaxed),
+		evictions.load(std::memory_order_relaxed),
+		bytes_saved.load(std::memory_order_relaxed),
+		index.size(), probation_used + protected_used, budget};
+}
@@ -0,0 +1,104 @@
+/*
+ * cache.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "http.h"
+
+// What caching rules allow for a complete origin response.
+// Shared by all cache tiers, so they agree on freshness and variants.
+struct cache_policy {
+	bool storable = false;
+	long lifetime = 0; // seconds
+	long age = 0; // seconds at the time of evaluation
+	std::vector<std::string> vary; // lowercase request header names
+	std::string head; // without Age and the final empty line
+	std::size_t body_offset = 0;
+
+	static cache_policy evaluate(const std::string & response);
+	// Request head must be parsed already. Returns the key to store the
+	// response under or an empty string if the request can't use a cache.
+	static std::string key_for(header_parser & request,
+			const std::string & host, const std::string & port);
+	// the request wants the origin's answer (no-cache, max-age=0 or
+	// Pragma: no-cache), no tier may serve it a stored one
+	static bool bypasses_stored(header_parser & request);
+	// request header values selected by vary, used to tell variants apart
+	static std::string vary_spec(const std::vector<std::string> & names,
+			header_parser & request);
+	static std::string age_line(long age);
+};
+
+// Shared cache of complete origin responses, keyed on method, host and
+// request target (plus the request headers named by Vary).
+// Memory is bounded by a byte budget; eviction is segmented LRU, new objects
+// land in the probation segment and move to the protected one on their
+// second hit, so one-shot downloads can't flush the popular objects.
+class response_cache {
+public:
+	struct stats_t {
+		std::uint64_t hits, misses, stores, evictions, bytes_saved;
+		std::size_t objects, bytes_used, bytes_budget;
+	};
+
+	response_cache(std::size_t budget_bytes);
+
+	// On hit fills response with a full response (head with a fresh Age
+	// header followed by the body) and returns true
+	bool lookup(const std::string & key, header_parser & request,
+			std::string & response);
+	// Returns false if the response is too big for this cache
+	bool store(const std::string & key, header_parser & request,
+			const cache_policy & policy, const std::string & response);
+
+	stats_t stats() const;
+
+private:
+	enum segment {
+		PROBATION, PROTECTED
+	};
+	using clock = std::chrono::steady_clock;
+	struct entry {
+		std::string key;
+		std::string head; // without Age and the final empty line
+		std::string body;
+		clock::time_point stored;
+		clock::time_point expires;
+		segment seg;
+		std::size_t size() const;
+	};
+	using entry_list = std::list<entry>;
+
+	std::string variant_key(const std::string & key, header_parser & request);
+	void unlink_entry(entry_list::iterator it);
+	void evict();
+
+	std::size_t budget;
+	std::size_t protected_budget;
+	std::size_t max_object;
+	std::size_t probation_used = 0, protected_used = 0;
+	entry_list probation, protect;
+	std::unordered_map<std::string, entry_list::iterator> index;
+	std::unordered_map<std::string, std::vector<std::string>> vary;
+	mutable std::mutex mut;
+
+	std::atomic<std::uint64_t> hits { 0 }, misses { 0 }, stores { 0 },
+			evictions { 0 }, bytes_saved { 0 };
+};
+
+#endif /* CACHE_H_ */
@@ -0,0 +1,193 @@
+/*
+ * capture.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "capture.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "spsc_ring.h"
+#include "util.h"
+
+namespace capture {
+
+// cfg stays put while capture runs, the file is the writer thread's
+struct capture_state {
+	config cfg;
+	int fd = -1;
+	std::size_t file_size = 0;
+	unsigned file_no = 0;
+};
+
+static capture_state state;
+static std::unique_ptr<ring_writer> writer;
+static std::atomic<bool> running { false };
+static std::atomic<std::uint32_t> next_flow { 1 };
+static std::atomic<std::uint64_t> flows_seen { 0 };
+static std::atomic<std::uint64_t> flows { 0 }, records { 0 }, bytes { 0 },
+		dropped { 0 }, files { 0 };
+
+static std::uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void push(record_type type, std::uint32_t id, direction dir,
+		const iovec * iov, int iovcnt, std::size_t captured,
+		std::size_t original, std::uint16_t flags = 0) {
+	if (!running.load(std::memory_order_relaxed)) {
+		return;
+	}
+	record_header hdr { now_ns(), id, std::uint32_t(captured),
+			std::uint32_t(std::min<std::size_t>(original, UINT32_MAX)), type,
+			dir, flags };
+	if (writer->push(&hdr, sizeof(hdr), iov, iovcnt, captured)) {
+		records.fetch_add(1, std::memory_order_relaxed);
+		bytes.fetch_add(captured, std::memory_order_relaxed);
+	} else {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+static void open_file(capture_state & w) {
+	if (w.fd != -1) {
+		close(w.fd);
+	}
+	char stamp[32];
+	std::time_t t = std::time(nullptr);
+	std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&t));
+	std::string path = w.cfg.dir + "/capture-" + stamp + "-"
+			+ std::to_string(w.file_no++) + ".pxcap";
+	w.fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w.fd == -1) {
+		util::log() << "Unable to open capture file " << path << ": "
+				<< util::error();
+		return;
+	}
+	iovec magic { const_cast<char *>(FILE_MAGIC), sizeof(FILE_MAGIC) - 1 };
+	util::write_all(w.fd, &magic, 1);
+	w.file_size = magic.iov_len;
+	files.fetch_add(1, std::memory_order_relaxed);
+	util::log() << "Capturing to " << path;
+}
+
+// Rotation happens between batches, so a file may overshoot file_bytes by
+// one batch
+static void write_records(iovec * iov, int iovcnt, std::size_t length) {
+	capture_state & w = state;
+	if (w.fd == -1 || w.file_size >= w.cfg.file_bytes) {
+		open_file(w);
+	}
+	if (w.fd != -1 && !util::write_all(w.fd, iov, iovcnt)) {
+		util::log() << "Capture write failed: " << util::error();
+	}
+	w.file_size += length;
+}
+
+void start(const config & cfg) {
+	if (mkdir(cfg.dir.c_str(), 0755) == -1 && errno != EEXIST) {
+		throw std::runtime_error("Unable to create capture directory " + cfg.dir);
+	}
+	errno = 0;
+	state = capture_state();
+	state.cfg = cfg;
+	state.cfg.sample_one_in = std::max(1u, cfg.sample_one_in);
+	writer = std::make_unique<ring_writer>(state.cfg.ring_bytes,
+			std::chrono::milliseconds(20), write_records);
+	running = true;
+}
+
+void stop() {
+	if (!running) {
+		return;
+	}
+	running = false;
+	writer->stop();
+	if (state.fd != -1) {
+		close(state.fd);
+		state.fd = -1;
+	}
+}
+
+static bool host_matches(const std::string & host,
+		const std::vector<std::string> & filter) {
+	if (filter.empty()) {
+		return true;
+	}
+	for (auto & f : filter) {
+		if (f.size() && f[0] == '.') {
+			if (host.size() >= f.size()
+					&& host.compare(host.size() - f.size(), f.size(), f) == 0) {
+				return true;
+			}
+			if (host.compare(0, std::string::npos, f, 1, std::string::npos)
+					== 0) {
+				return true;
+			}
+		} else if (host == f) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::shared_ptr<flow> open(const std::string & host, const std::string & port,
+		bool tunnel) {
+	if (!running.load(std::memory_order_relaxed)
+			|| !host_matches(host, state.cfg.hosts)
+			|| flows_seen.fetch_add(1, std::memory_order_relaxed)
+					% state.cfg.sample_one_in) {
+		return nullptr;
+	}
+	flows.fetch_add(1, std::memory_order_relaxed);
+	return std::make_shared<flow>(
+			next_flow.fetch_add(1, std::memory_order_relaxed),
+			state.cfg.flow_bytes, host + ":" + port,
+			tunnel ? FLOW_TUNNEL : 0);
+}
+
+flow::flow(std::uint32_t id, std::size_t byte_cap, const std::string & name,
+		std::uint16_t flags) :
+		id(id), remaining(byte_cap) {
+	iovec iov { const_cast<char *>(name.data()), name.size() };
+	push(record_type::FLOW_OPEN, id, direction::to_server, &iov, 1,
+			name.size(), name.size(), flags);
+}
+
+void flow::record(direction dir, const char * data, std::size_t length) {
+	iovec iov { const_cast<char *>(data), length };
+	record(dir, &iov, 1, length);
+}
+
+void flow::record(direction dir, const iovec * iov, int iovcnt,
+		std::size_t length) {
+	if (length == 0) {
+		return;
+	}
+	std::size_t captured = std::min(length, remaining);
+	remaining -= captured;
+	push(record_type::DATA, id, dir, iov, iovcnt, captured, length);
+}
+
+flow::~flow() {
+	push(record_type::FLOW_CLOSE, id, direction::to_server, nullptr, 0, 0, 0);
+}
+
+stats_t stats() {
+	return {flows.load(), records.load(), bytes.load(), dropped.load(),
+		files.load()};
+}
+
+}
@@ -0,0 +1,102 @@
+/*
+ * capture.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Optional traffic capture, off the data path.
+// Connections copy the bytes they relay into a lock-free ring owned by their
+// thread; a background writer drains all rings in batches into capture files.
+// Nothing is ever waited for: when a ring is full the record is dropped and
+// counted. While capture is disabled open() returns nullptr and callers skip
+// all of it.
+//
+// File format, all integers little endian:
+//   file header: "PXCAP001"
+//   records: record_header followed by captured_length payload bytes
+// A FLOW_OPEN record carries "host:port" of the flow and FLOW_TUNNEL in
+// flags for CONNECT tunnels, DATA records carry the relayed bytes and
+// FLOW_CLOSE ends the flow. Past the per-flow cap DATA records keep coming
+// without payload, original_length always has the real size, so a cap of 0
+// records just the timing and sizes of the traffic (see bench/replay_bench).
+// HTTP flows have one DATA record per request and one per response, tunnels
+// one per relayed read, the first to_client one being the proxy's own
+// "200 Connection established".
+namespace capture {
+
+enum class direction : std::uint8_t {
+	to_server, to_client
+};
+
+enum class record_type : std::uint8_t {
+	FLOW_OPEN, DATA, FLOW_CLOSE
+};
+
+struct record_header {
+	std::uint64_t timestamp_ns; // wall clock
+	std::uint32_t flow;
+	std::uint32_t captured_length;
+	std::uint32_t original_length;
+	record_type type;
+	direction dir;
+	std::uint16_t flags;
+};
+
+constexpr std::uint16_t FLOW_TUNNEL = 1;
+
+static_assert(sizeof(record_header) == 24, "capture record header is packed");
+
+constexpr char FILE_MAGIC[] = "PXCAP001";
+
+struct config {
+	std::string dir;
+	// capture only these hosts; ".example.com" also matches subdomains
+	std::vector<std::string> hosts;
+	unsigned sample_one_in = 1; // flows
+	std::size_t flow_bytes = 1 << 20;
+	std::size_t file_bytes = 64 << 20; // rotate after that
+	std::size_t ring_bytes = 4 << 20; // per producing thread
+};
+
+struct stats_t {
+	std::uint64_t flows, records, bytes, dropped, files;
+};
+
+// One captured connection. Used from the connection's dispatcher thread only.
+class flow {
+	std::uint32_t id;
+	std::size_t remaining;
+public:
+	flow(std::uint32_t id, std::size_t byte_cap, const std::string & name,
+			std::uint16_t flags);
+	void record(direction dir, const char * data, std::size_t length);
+	void record(direction dir, const iovec * iov, int iovcnt,
+			std::size_t length);
+	~flow();
+};
+
+// Starts the writer thread, capture files go to cfg.dir
+void start(const config & cfg);
+// Flushes everything recorded so far and stops the writer
+void stop();
+
+// nullptr unless capture is running and the flow passes filter and sampling
+std::shared_ptr<flow> open(const std::string & host, const std::string & port,
+		bool tunnel);
+
+stats_t stats();
+
+}
+
+#endif /* CAPTURE_H_ */
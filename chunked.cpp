@@ -0,0 +1,211 @@
+/*
+ * chunked.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "chunked.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const char * find_line_feed(const char * from, const char * to) {
+#if defined(__AVX2__)
+	const __m256i lf = _mm256_set1_epi8('\n');
+	for (; to - from >= 32; from += 32) {
+		__m256i block = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i *>(from));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+		if (mask) {
+			return from + __builtin_ctz(mask);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lf16 = _mm_set1_epi8('\n');
+	for (; to - from >= 16; from += 16) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf16));
+		if (mask) {
+			return from + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while (from < to && *from != '\n') {
+		from++;
+	}
+	return from;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+chunked_decoder::chunked_decoder(std::size_t start, mode m) :
+		md(m), in_pos(start), out_pos(start) {
+}
+
+chunked_decoder::status chunked_decoder::fail(const char * why) {
+	st = FAILED;
+	err = why;
+	return status::error;
+}
+
+chunked_decoder::status chunked_decoder::feed(std::string& buf) {
+	std::size_t length = buf.size();
+	status res = feed(&buf[0], length);
+	if (md == mode::dechunk) {
+		buf.resize(length);
+	}
+	return res;
+}
+
+// Framing lines may be split between reads and in dechunk mode consumed bytes
+// are dropped, so only the length of the current line and whether its last
+// byte was '\r' are remembered.
+chunked_decoder::status chunked_decoder::feed(char * data,
+		std::size_t & length) {
+	if (st == FAILED) {
+		return status::error;
+	}
+	if (in_pos > length) {
+		return status::more;
+	}
+	while (in_pos < length && st != DONE) {
+		switch (st) {
+		case SIZE: {
+			int v = hex_value(data[in_pos]);
+			if (v >= 0) {
+				if (++size_digits > 15) {
+					return fail("chunk size too large");
+				}
+				chunk_left = chunk_left * 16 + v;
+				in_pos++;
+				break;
+			}
+			char c = data[in_pos];
+			if (size_digits == 0 || (c != ';' && c != ' ' && c != '\t' && c != '\r')) {
+				return fail("invalid chunk size");
+			}
+			st = LINE_END;
+			line_len = 0;
+			line_cr = false;
+			break;
+		}
+		case LINE_END:
+		case TRAILER: {
+			const char * begin = data + in_pos;
+			const char * lf = find_line_feed(begin, data + length);
+			std::size_t n = lf - begin;
+			if (st == TRAILER && md == mode::dechunk) {
+				trailer_str.append(begin, lf == data + length ? n : n + 1);
+				if (trailer_str.size() > MAX_TRAILERS_LENGTH) {
+					return fail("trailer section too long");
+				}
+			}
+			if (lf == data + length) {
+				line_len += n;
+				if (n) {
+					line_cr = begin[n - 1] == '\r';
+				}
+				if (line_len > MAX_LINE_LENGTH) {
+					return fail("framing line too long");
+				}
+				in_pos = length;
+				break;
+			}
+			bool cr = n ? lf[-1] == '\r' : line_cr;
+			if (!cr) {
+				return fail("bare LF in framing");
+			}
+			line_len += n;
+			in_pos += n + 1;
+			if (st == LINE_END) {
+				chunks++;
+				st = chunk_left ? DATA : TRAILER;
+			} else if (line_len == 1) {
+				if (md == mode::dechunk) {
+					trailer_str.resize(trailer_str.size() - 2);
+				}
+				st = DONE;
+			}
+			line_len = 0;
+			line_cr = false;
+			break;
+		}
+		case DATA: {
+			std::size_t n = std::min<std::uint64_t>(chunk_left,
+					length - in_pos);
+			if (md == mode::dechunk && out_pos != in_pos) {
+				std::memmove(data + out_pos, data + in_pos, n);
+			}
+			out_pos += n;
+			in_pos += n;
+			chunk_left -= n;
+			body_len += n;
+			if (chunk_left == 0) {
+				st = DATA_CRLF;
+				line_len = 0;
+			}
+			break;
+		}
+		case DATA_CRLF:
+			if (data[in_pos] != (line_len == 0 ? '\r' : '\n')) {
+				return fail("missing CRLF after chunk data");
+			}
+			in_pos++;
+			if (++line_len == 2) {
+				st = SIZE;
+				size_digits = 0;
+				chunk_left = 0;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	if (md == mode::dechunk) {
+		// whatever follows the message is moved right after the decoded body
+		std::size_t rest = length - in_pos;
+		if (rest && out_pos != in_pos) {
+			std::memmove(data + out_pos, data + in_pos, rest);
+		}
+		length = out_pos + rest;
+		in_pos = out_pos;
+	}
+	return st == DONE ? status::done : status::more;
+}
+
+std::size_t chunked_decoder::position() const {
+	return md == mode::dechunk ? out_pos : in_pos;
+}
+
+std::size_t chunked_decoder::chunk_count() const {
+	return chunks;
+}
+
+std::uint64_t chunked_decoder::body_length() const {
+	return body_len;
+}
+
+const std::string& chunked_decoder::trailers() const {
+	return trailer_str;
+}
+
+const char * chunked_decoder::error() const {
+	return err;
+}
@@ -0,0 +1,69 @@
+/*
+ * chunked.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef CHUNKED_H_
+#define CHUNKED_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental decoder for "Transfer-Encoding: chunked" bodies.
+// It works directly on the connection buffer, starting at a given offset
+// (normally right after the head) and resuming where it stopped on every
+// feed() call.
+//
+// In validate mode the body is left untouched and position() tells how many
+// bytes of buf are well-framed. In dechunk mode chunk payload is compacted in
+// place, so after completion buf[start, position()) holds the decoded body and
+// trailer fields are available through trailers().
+class chunked_decoder {
+public:
+	enum class mode {
+		validate, dechunk
+	};
+	enum class status {
+		more, done, error
+	};
+
+	static constexpr std::size_t MAX_LINE_LENGTH = 1 << 12;
+	static constexpr std::size_t MAX_TRAILERS_LENGTH = 1 << 16;
+
+	chunked_decoder(std::size_t start, mode m = mode::validate);
+
+	status feed(std::string & buf);
+	status feed(char * data, std::size_t & length);
+
+	std::size_t position() const;
+	std::size_t chunk_count() const;
+	std::uint64_t body_length() const;
+	const std::string & trailers() const;
+	const char * error() const;
+
+private:
+	enum state {
+		SIZE, LINE_END, DATA, DATA_CRLF, TRAILER, DONE, FAILED
+	};
+	status fail(const char * why);
+
+	mode md;
+	state st = SIZE;
+	std::size_t in_pos, out_pos;
+	std::size_t line_len = 0;
+	bool line_cr = false;
+	std::uint64_t chunk_left = 0;
+	std::uint64_t body_len = 0;
+	std::size_t chunks = 0;
+	int size_digits = 0;
+	std::string trailer_str;
+	const char * err = nullptr;
+};
+
+// Returns the position of the first '\n' in [from, to) or to if none.
+const char * find_line_feed(const char * from, const char * to);
+
+#endif /* CHUNKED_H_ */
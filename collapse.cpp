@@ -0,0 +1,77 @@
+/*
+ * collapse.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "collapse.h"
+
+#include "util.h"
+
+bool request_collapser::inflight::matches(header_parser& request) const {
+	return response && cache_policy::vary_spec(vary, request) == vary_spec;
+}
+
+std::shared_ptr<request_collapser::inflight> request_collapser::attach(
+		const std::string& key, const dispatch::event_ref& wake) {
+	std::lock_guard<std::mutex> lg(mut);
+	auto it = pending.find(key);
+	if (it == pending.end()) {
+		pending.emplace(key, entry());
+		return nullptr;
+	}
+	it->second.waiters.push_back(std::cref(wake));
+	collapsed_count.fetch_add(1, std::memory_order_relaxed);
+	return it->second.result;
+}
+
+void request_collapser::complete(const std::string& key,
+		const std::shared_ptr<std::string>& response,
+		const cache_policy& policy, header_parser& request) {
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		auto it = pending.find(key);
+		if (it == pending.end()) {
+			return;
+		}
+		// uncacheable responses may be personalised, so they are not shared
+		if (policy.storable) {
+			inflight & res = *it->second.result;
+			res.response = response;
+			res.vary = policy.vary;
+			res.vary_spec = cache_policy::vary_spec(policy.vary, request);
+		}
+	}
+	wake(key);
+}
+
+void request_collapser::abandon(const std::string& key) {
+	wake(key);
+}
+
+void request_collapser::wake(const std::string& key) {
+	std::vector<std::reference_wrapper<const dispatch::event_ref>> waiters;
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		auto it = pending.find(key);
+		if (it == pending.end()) {
+			return;
+		}
+		waiters.swap(it->second.waiters);
+		pending.erase(it);
+	}
+	if (waiters.size()) {
+		util::debug() << "Waking " << waiters.size()
+				<< " collapsed requests for " << key;
+	}
+	// waiters may sit in other dispatcher loops, which run their events
+	// holding their own locks, so they are armed without holding ours
+	for (auto & w : waiters) {
+		dispatch::arm_manual(w.get());
+	}
+}
+
+std::uint64_t request_collapser::collapsed() const {
+	return collapsed_count.load(std::memory_order_relaxed);
+}
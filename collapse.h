@@ -0,0 +1,71 @@
+/*
+ * collapse.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef COLLAPSE_H_
+#define COLLAPSE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.h"
+#include "dispatch.h"
+#include "http.h"
+
+// Collapsed forwarding of identical cacheable requests.
+// The first connection asking for a cache key goes to the origin, the ones
+// arriving while it is in flight attach to it and are woken up when the
+// response is complete, sharing the same response buffer.
+// Responses are not streamed to the attached connections, they get nothing
+// before the leader has the whole body. So the leader only keeps them
+// waiting for a Content-Length of at most MAX_BODY and abandons the key for
+// bigger, chunked or unbounded bodies, sending them to the origin at once.
+class request_collapser {
+public:
+	static constexpr long MAX_BODY = 1 << 20;
+
+	struct inflight {
+		// nullptr if the response can't be shared and attached connections
+		// have to go to the origin themselves
+		std::shared_ptr<std::string> response;
+		std::vector<std::string> vary;
+		std::string vary_spec;
+
+		// true if response suits a request with these headers
+		bool matches(header_parser & request) const;
+	};
+
+	// Returns nullptr if the caller is the first one and has to fetch the
+	// object, complete() or abandon() must follow in that case.
+	// Otherwise wake is armed once the returned object is filled in.
+	std::shared_ptr<inflight> attach(const std::string & key,
+			const dispatch::event_ref & wake);
+	void complete(const std::string & key,
+			const std::shared_ptr<std::string> & response,
+			const cache_policy & policy, header_parser & request);
+	void abandon(const std::string & key);
+
+	std::uint64_t collapsed() const;
+
+private:
+	struct entry {
+		std::shared_ptr<inflight> result = std::make_shared<inflight>();
+		std::vector<std::reference_wrapper<const dispatch::event_ref>> waiters;
+	};
+	void wake(const std::string & key);
+
+	std::unordered_map<std::string, entry> pending;
+	std::mutex mut;
+	std::atomic<std::uint64_t> collapsed_count { 0 };
+};
+
+#endif /* COLLAPSE_H_ */
@@ -0,0 +1,357 @@
+/*
+ * coro.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "coro.h"
+
+#if defined(PROXY_COROUTINES)
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <exception>
+#include <new>
+
+#include "util.h"
+
+namespace coro {
+
+// Frames are kept by size in steps of FRAME_STEP, bigger ones come from the
+// heap every time
+constexpr std::size_t FRAME_STEP = 256;
+constexpr int FRAME_CLASSES = 16;
+// frames each thread keeps per class
+constexpr int MAX_CACHED_FRAMES = 1024;
+
+struct free_frame_node {
+	free_frame_node * next;
+};
+
+struct frame_cache {
+	free_frame_node * heads[FRAME_CLASSES] = { };
+	int counts[FRAME_CLASSES] = { };
+	~frame_cache() {
+		for (auto head : heads) {
+			while (head) {
+				free_frame_node * next = head->next;
+				::operator delete(head);
+				head = next;
+			}
+		}
+	}
+};
+
+static thread_local frame_cache frames;
+static thread_local task::promise_type * live_frames = nullptr;
+static std::atomic<std::uint64_t> heap_allocations { 0 }, reuses { 0 };
+
+void * allocate_frame(std::size_t size) {
+	std::size_t cls = (size - 1) / FRAME_STEP;
+	if (cls >= FRAME_CLASSES) {
+		heap_allocations.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new(size);
+	}
+	if (free_frame_node * f = frames.heads[cls]) {
+		frames.heads[cls] = f->next;
+		frames.counts[cls]--;
+		reuses.fetch_add(1, std::memory_order_relaxed);
+		return f;
+	}
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	return ::operator new((cls + 1) * FRAME_STEP);
+}
+
+void free_frame(void * frame, std::size_t size) {
+	std::size_t cls = (size - 1) / FRAME_STEP;
+	if (cls >= FRAME_CLASSES || frames.counts[cls] >= MAX_CACHED_FRAMES) {
+		::operator delete(frame);
+		return;
+	}
+	auto f = static_cast<free_frame_node *>(frame);
+	f->next = frames.heads[cls];
+	frames.heads[cls] = f;
+	frames.counts[cls]++;
+}
+
+frame_stats_t frame_stats() {
+	return {heap_allocations.load(std::memory_order_relaxed),
+		reuses.load(std::memory_order_relaxed)};
+}
+
+task::promise_type::promise_type() :
+		next(live_frames) {
+	if (next) {
+		next->prev = this;
+	}
+	live_frames = this;
+}
+
+task::promise_type::~promise_type() {
+	if (prev) {
+		prev->next = next;
+	} else {
+		live_frames = next;
+	}
+	if (next) {
+		next->prev = prev;
+	}
+}
+
+void destroy_suspended() {
+	while (live_frames) {
+		std::coroutine_handle<task::promise_type>::from_promise(*live_frames)
+				.destroy();
+	}
+}
+
+void task::promise_type::unhandled_exception() {
+	util::log() << "Exception escaped a coroutine";
+	std::terminate();
+}
+
+// wakes the waiter once it can go on
+static void poke(waiter *& w) {
+	if (w && w->ready()) {
+		waiter * woken = w;
+		w = nullptr;
+		woken->handle.resume();
+	}
+}
+
+transfer::transfer(socket & sock, bool reading) :
+		sock(sock), reading(reading) {
+}
+
+bool transfer::await_ready() {
+	return ready();
+}
+
+void transfer::await_suspend(std::coroutine_handle<> h) {
+	handle = h;
+	sock.park(this, reading);
+}
+
+bool transfer::await_resume() const {
+	return result == async_load::loader::progress::done;
+}
+
+bool transfer::ready() {
+	result = sock.io.step();
+	return result != async_load::loader::progress::wait;
+}
+
+edge::edge(socket & sock, bool reading) :
+		sock(sock), reading(reading) {
+}
+
+bool edge::await_ready() const {
+	return false;
+}
+
+void edge::await_suspend(std::coroutine_handle<> h) {
+	handle = h;
+	sock.park(this, reading);
+}
+
+void edge::await_resume() const {
+}
+
+bool edge::ready() {
+	return true;
+}
+
+socket::~socket() {
+	close();
+}
+
+void socket::open(int fd) {
+	sock = dispatch::fd_ref(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+	io = async_load::loader(fd);
+	io.charge_to(mem);
+	waiting = std::make_shared<parked>();
+	auto w = waiting;
+	readable_ev = dispatch::event_ref([w] {
+		poke(w->reader);
+	});
+	writable_ev = dispatch::event_ref([w] {
+		poke(w->writer);
+	});
+	dispatch::link(sock, EPOLLIN | EPOLLRDHUP | EPOLLHUP, readable_ev);
+	dispatch::link(sock, EPOLLOUT | EPOLLERR | EPOLLRDHUP | EPOLLHUP,
+			writable_ev);
+	linked = true;
+}
+
+int socket::fd() const {
+	return sock.fd();
+}
+
+dispatch::fd_ref & socket::ref() {
+	return sock;
+}
+
+void socket::detach() {
+	if (linked) {
+		dispatch::unlink(sock, readable_ev);
+		dispatch::unlink(sock, writable_ev);
+		linked = false;
+	}
+	if (waiting) {
+		waiting->reader = waiting->writer = nullptr;
+	}
+}
+
+void socket::close() {
+	detach();
+	readable_ev.recycle();
+	writable_ev.recycle();
+	if (sock.fd() != -1) {
+		int fd = sock.fd();
+		sock.recycle();
+		::close(fd);
+	}
+}
+
+void socket::charge_to(memory_budget::charge * mem) {
+	this->mem = mem;
+	io.charge_to(mem);
+}
+
+bool socket::over_budget() const {
+	return io.over_budget();
+}
+
+void socket::park(waiter * w, bool reading) {
+	(reading ? waiting->reader : waiting->writer) = w;
+}
+
+edge socket::readable() {
+	return edge(*this, true);
+}
+
+edge socket::writable() {
+	return edge(*this, false);
+}
+
+transfer socket::read_headers(std::string & buf,
+		std::chrono::steady_clock::time_point * first_byte) {
+	io.start_headers(buf, first_byte);
+	return transfer(*this, true);
+}
+
+transfer socket::read_fixed(std::string & buf, int length) {
+	io.start_fixed(buf, length);
+	return transfer(*this, true);
+}
+
+transfer socket::read_chunked(std::string & buf) {
+	io.start_chunked(buf);
+	return transfer(*this, true);
+}
+
+transfer socket::write_all(const std::string & buf) {
+	io.start_upload(buf);
+	return transfer(*this, false);
+}
+
+transfer socket::send_file(int file_fd, off_t offset, std::size_t length) {
+	io.start_file(file_fd, offset, length);
+	return transfer(*this, false);
+}
+
+signal::signal() :
+		ev([this] {
+			fired = true;
+			if (handle) {
+				auto h = handle;
+				handle = nullptr;
+				h.resume();
+			}
+		}) {
+}
+
+const dispatch::event_ref & signal::event() const {
+	return ev;
+}
+
+bool signal::await_ready() const {
+	return fired;
+}
+
+void signal::await_suspend(std::coroutine_handle<> h) {
+	handle = h;
+}
+
+void signal::await_resume() const {
+}
+
+connect::connect(const dns_pool & dns, const std::string & host,
+		const std::string & port, bool early_data, connect_times * times) :
+		dns(dns), host(host), port(port), early_data(early_data), times(times) {
+}
+
+bool connect::await_ready() const {
+	return false;
+}
+
+void connect::await_suspend(std::coroutine_handle<> h) {
+	// the resolver arms the event from its own thread, it runs on ours once
+	// we are suspended
+	fut = dns.connect_to_remote_server(host, port, done.event(), early_data,
+			times);
+	done.await_suspend(h);
+}
+
+int connect::await_resume() {
+	return fut.get();
+}
+
+sleep::sleep(int ms) :
+		ms(ms) {
+}
+
+sleep::~sleep() {
+	if (timer.fd() != -1) {
+		int fd = timer.fd();
+		dispatch::unlink(timer, ev);
+		timer.recycle();
+		::close(fd);
+	}
+}
+
+bool sleep::await_ready() const {
+	return ms <= 0;
+}
+
+bool sleep::await_suspend(std::coroutine_handle<> h) {
+	handle = h;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		util::log() << "No timer to sleep on: " << util::error();
+		return false;
+	}
+	itimerspec when { };
+	when.it_value.tv_sec = ms / 1000;
+	when.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	timerfd_settime(fd, 0, &when, nullptr);
+	timer = dispatch::fd_ref(fd, EPOLLIN | EPOLLET);
+	ev = dispatch::event_ref([this] {
+		if (handle) {
+			auto h = handle;
+			handle = nullptr;
+			h.resume();
+		}
+	});
+	dispatch::link(timer, EPOLLIN, ev);
+	return true;
+}
+
+void sleep::await_resume() const {
+}
+
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * coro.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef CORO_H_
+#define CORO_H_
+
+// C++20 coroutines on top of dispatch, built with -std=c++20
+// -DPROXY_COROUTINES (make coro). A coroutine runs on the loop of the thread
+// that started it and is resumed by events of that loop, so it may touch
+// everything the loop owns without locks. Its frame comes from a free list of
+// the loop's thread instead of the heap.
+//
+//   coro::task serve(...) {
+//       if (!co_await sock.read_headers(buf)) ...
+//       int fd = co_await coro::connect(dns, host, port);
+//       co_await coro::sleep(100);
+//   }
+#if defined(PROXY_COROUTINES)
+
+#if !defined(__cpp_impl_coroutine)
+#error "PROXY_COROUTINES needs a compiler with C++20 coroutines"
+#endif
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+
+#include "dispatch.h"
+#include "dns.h"
+#include "loaders.h"
+#include "memory_budget.h"
+
+namespace coro {
+
+void * allocate_frame(std::size_t size);
+void free_frame(void * frame, std::size_t size);
+
+// Coroutine nobody waits for: it starts right away and its frame goes away
+// once it returns
+struct task {
+	struct promise_type {
+		// frames of a thread are listed until they are gone
+		promise_type * prev = nullptr, * next = nullptr;
+
+		promise_type();
+		promise_type(const promise_type &) = delete;
+		~promise_type();
+
+		task get_return_object() {
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() {
+		}
+		void unhandled_exception();
+
+		static void * operator new(std::size_t size) {
+			return allocate_frame(size);
+		}
+		static void operator delete(void * frame, std::size_t size) {
+			free_frame(frame, size);
+		}
+	};
+};
+
+// a suspended coroutine waiting for its socket
+struct waiter {
+	std::coroutine_handle<> handle;
+	// the socket may have moved on, true once the coroutine can go on
+	virtual bool ready() = 0;
+protected:
+	~waiter() = default;
+};
+
+class socket;
+
+// co_await gives true once the transfer is done, false if it failed
+class transfer: waiter {
+	socket & sock;
+	bool reading;
+	async_load::loader::progress result = async_load::loader::progress::wait;
+public:
+	transfer(socket & sock, bool reading);
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	bool await_resume() const;
+	bool ready() override;
+};
+
+// co_await gives nothing, it resumes at the next edge of the socket
+class edge: waiter {
+	socket & sock;
+	bool reading;
+public:
+	edge(socket & sock, bool reading);
+	bool await_ready() const;
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() const;
+	bool ready() override;
+};
+
+// A socket added to dispatch with one readable and one writable event,
+// linked once and reused by every transfer. One reader and one writer may
+// wait at a time.
+class socket {
+	friend class transfer;
+	friend class edge;
+	struct parked {
+		waiter * reader = nullptr;
+		waiter * writer = nullptr;
+	};
+	dispatch::fd_ref sock;
+	dispatch::event_ref readable_ev, writable_ev;
+	// shared with the events, which may run once the socket is gone
+	std::shared_ptr<parked> waiting;
+	bool linked = false;
+	async_load::loader io;
+	memory_budget::charge * mem = nullptr;
+
+	void park(waiter * w, bool reading);
+public:
+	socket() = default;
+	socket(const socket &) = delete;
+	socket & operator =(const socket &) = delete;
+	~socket();
+
+	void open(int fd);
+	int fd() const;
+	// for relays and loggers
+	dispatch::fd_ref & ref();
+	// unlinks the events, someone else drives the socket from now on
+	void detach();
+	// detaches, takes the socket out of dispatch and closes it
+	void close();
+	// as async_load::loader::charge_to, for every transfer from now on
+	void charge_to(memory_budget::charge * mem);
+	// the last transfer failed for that
+	bool over_budget() const;
+
+	edge readable();
+	edge writable();
+
+	// first_byte, if given, gets the time the first bytes arrived
+	transfer read_headers(std::string & buf,
+			std::chrono::steady_clock::time_point * first_byte = nullptr);
+	transfer read_fixed(std::string & buf, int length);
+	// the body follows the head already in buf
+	transfer read_chunked(std::string & buf);
+	// buf has to stay put until the transfer is over
+	transfer write_all(const std::string & buf);
+	transfer send_file(int file_fd, off_t offset, std::size_t length);
+};
+
+// An event another thread arms once, co_await returns after that
+class signal {
+	dispatch::event_ref ev;
+	std::coroutine_handle<> handle;
+	bool fired = false;
+public:
+	signal();
+	signal(const signal &) = delete;
+	signal & operator =(const signal &) = delete;
+
+	// to hand to whoever arms it
+	const dispatch::event_ref & event() const;
+
+	bool await_ready() const;
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() const;
+};
+
+// co_await gives a socket connected to host, -1 if that failed
+class connect {
+	const dns_pool & dns;
+	const std::string & host, & port;
+	bool early_data;
+	connect_times * times;
+	signal done;
+	std::future<int> fut;
+public:
+	// early_data and times as in dns_pool::connect_to_remote_server
+	connect(const dns_pool & dns, const std::string & host,
+			const std::string & port, bool early_data = false,
+			connect_times * times = nullptr);
+
+	bool await_ready() const;
+	void await_suspend(std::coroutine_handle<> h);
+	int await_resume();
+};
+
+// co_await returns after ms milliseconds
+class sleep {
+	int ms;
+	dispatch::fd_ref timer;
+	dispatch::event_ref ev;
+	std::coroutine_handle<> handle;
+public:
+	explicit sleep(int ms);
+	sleep(const sleep &) = delete;
+	sleep & operator =(const sleep &) = delete;
+	~sleep();
+
+	bool await_ready() const;
+	// false if there is no timer to wait for
+	bool await_suspend(std::coroutine_handle<> h);
+	void await_resume() const;
+};
+
+// Destroys the frames of the calling thread still waiting for something,
+// before the loop goes away with the events that could resume them
+void destroy_suspended();
+
+struct frame_stats_t {
+	std::uint64_t heap_allocations, reuses;
+};
+
+// all threads together
+frame_stats_t frame_stats();
+
+}
+
+#endif
+
+#endif /* CORO_H_ */
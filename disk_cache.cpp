@@ -0,0 +1,515 @@
+/*
+ * disk_cache.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "disk_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "util.h"
+
+static constexpr std::uint32_t RECORD_MAGIC = 0x50584352; // "PXCR"
+static constexpr std::uint32_t INDEX_MAGIC = 0x50584958; // "PXIX"
+static constexpr std::uint32_t INDEX_VERSION = 1;
+static constexpr int CHECKPOINT_EVERY = 256;
+// stores beyond this wait for nobody, they are dropped
+static constexpr std::size_t MAX_QUEUED_BYTES = 64 << 20;
+
+struct record_header {
+	std::uint32_t magic;
+	std::uint32_t key_length;
+	std::uint32_t vary_length;
+	std::uint32_t head_length;
+	std::uint64_t body_length;
+	std::int64_t stored;
+	std::int64_t expires;
+};
+
+// vary names are kept comma separated in front of the spec,
+// which is either empty or starts with '\n'
+static std::string vary_blob(const std::vector<std::string> & names,
+		const std::string & spec) {
+	std::string res;
+	for (auto & name : names) {
+		res += (res.empty() ? "" : ",") + name;
+	}
+	return res + spec;
+}
+
+static void parse_vary_blob(const std::string & blob,
+		std::vector<std::string> & names, std::string & spec) {
+	std::size_t nl = std::min(blob.find('\n'), blob.size());
+	spec = blob.substr(nl);
+	for (std::size_t pos = 0; pos < nl;) {
+		std::size_t comma = std::min(blob.find(',', pos), nl);
+		names.push_back(blob.substr(pos, comma - pos));
+		pos = comma + 1;
+	}
+}
+
+template<class T>
+static void put(std::string & to, const T & val) {
+	to.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+static void put(std::string & to, const std::string & val) {
+	put(to, std::uint32_t(val.size()));
+	to += val;
+}
+
+template<class T>
+static bool get(const std::string & from, std::size_t & pos, T & val) {
+	if (pos + sizeof(val) > from.size()) {
+		return false;
+	}
+	std::memcpy(&val, from.data() + pos, sizeof(val));
+	pos += sizeof(val);
+	return true;
+}
+
+static bool get(const std::string & from, std::size_t & pos,
+		std::string & val) {
+	std::uint32_t len;
+	if (!get(from, pos, len) || pos + len > from.size()) {
+		return false;
+	}
+	val.assign(from, pos, len);
+	pos += len;
+	return true;
+}
+
+static bool read_exact(int fd, void * to, std::size_t len, off_t offset) {
+	char * p = static_cast<char *>(to);
+	while (len) {
+		ssize_t rd = pread(fd, p, len, offset);
+		if (rd <= 0) {
+			return false;
+		}
+		p += rd;
+		len -= rd;
+		offset += rd;
+	}
+	return true;
+}
+
+disk_cache::segment_file::segment_file(std::uint32_t id, int fd, off_t size) :
+		id(id), fd(fd), size(size) {
+}
+
+disk_cache::segment_file::~segment_file() {
+	close(fd);
+}
+
+disk_cache::disk_cache(const std::string& dir, std::size_t budget_bytes,
+		std::size_t segment_bytes) :
+		dir(dir), budget(budget_bytes), segment_limit(segment_bytes) {
+	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+		throw std::runtime_error("Unable to create cache directory " + dir);
+	}
+	errno = 0;
+	load();
+	writer = std::thread(&disk_cache::writer_loop, this);
+}
+
+disk_cache::~disk_cache() {
+	{
+		std::lock_guard<std::mutex> lg(queue_mutex);
+		stopping = true;
+		queue_cv.notify_one();
+	}
+	writer.join();
+	save_index();
+}
+
+std::string disk_cache::segment_path(std::uint32_t id) const {
+	char name[32];
+	snprintf(name, sizeof(name), "/seg-%08x", id);
+	return dir + name;
+}
+
+void disk_cache::load() {
+	DIR * d = opendir(dir.c_str());
+	if (d == nullptr) {
+		throw std::runtime_error("Unable to open cache directory " + dir);
+	}
+	while (dirent * ent = readdir(d)) {
+		unsigned id;
+		char tail;
+		if (sscanf(ent->d_name, "seg-%8x%c", &id, &tail) != 1) {
+			continue;
+		}
+		int fd = open(segment_path(id).c_str(), O_RDWR | O_CLOEXEC);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			util::log() << "Skipping cache segment " << ent->d_name << ": "
+					<< util::error();
+			if (fd != -1) {
+				close(fd);
+			}
+			continue;
+		}
+		segments[id] = std::make_shared<segment_file>(id, fd, st.st_size);
+	}
+	closedir(d);
+
+	// the saved index covers everything before (checkpoint_seg, checkpoint_off)
+	std::uint32_t checkpoint_seg = 0;
+	off_t checkpoint_off = 0;
+	std::size_t loaded = 0;
+	int index_fd = open((dir + "/index").c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (index_fd != -1 && fstat(index_fd, &st) == 0) {
+		std::string data(st.st_size, '\0');
+		std::size_t pos = 0;
+		std::uint32_t magic, version;
+		std::uint64_t offset, count;
+		if (read_exact(index_fd, &data[0], data.size(), 0)
+				&& get(data, pos, magic) && magic == INDEX_MAGIC
+				&& get(data, pos, version) && version == INDEX_VERSION
+				&& get(data, pos, checkpoint_seg) && get(data, pos, offset)
+				&& get(data, pos, count)) {
+			checkpoint_off = offset;
+			std::int64_t now = time(nullptr);
+			for (std::uint64_t i = 0; i < count; i++) {
+				std::string key, blob;
+				index_entry e;
+				std::int64_t head_offset;
+				if (!get(data, pos, key) || !get(data, pos, e.segment)
+						|| !get(data, pos, head_offset)
+						|| !get(data, pos, e.head_length)
+						|| !get(data, pos, e.body_length)
+						|| !get(data, pos, e.stored)
+						|| !get(data, pos, e.expires)
+						|| !get(data, pos, blob)) {
+					util::log() << "Cache index in " << dir << " is truncated";
+					break;
+				}
+				e.head_offset = head_offset;
+				auto seg = segments.find(e.segment);
+				if (seg == segments.end() || e.expires <= now
+						|| e.head_offset + e.head_length + e.body_length
+								> std::uint64_t(seg->second->size)) {
+					continue;
+				}
+				parse_vary_blob(blob, e.vary, e.vary_spec);
+				index[key] = std::move(e);
+				loaded++;
+			}
+		} else {
+			checkpoint_seg = 0;
+			checkpoint_off = 0;
+		}
+	}
+	if (index_fd != -1) {
+		close(index_fd);
+	}
+
+	std::size_t scanned = 0;
+	for (auto & seg : segments) {
+		used += seg.second->size;
+		if (seg.first >= checkpoint_seg) {
+			off_t from = seg.first == checkpoint_seg ?
+					std::min(checkpoint_off, seg.second->size) : 0;
+			scanned += seg.second->size - from;
+			scan_segment(*seg.second, from);
+		}
+	}
+	if (segments.empty() || segments.rbegin()->second->size >= off_t(segment_limit)) {
+		open_segment(segments.empty() ? 1 : segments.rbegin()->first + 1);
+	}
+	util::log() << "Disk cache " << dir << ": " << index.size() << " objects in "
+			<< segments.size() << " segments, " << loaded
+			<< " from index, scanned " << scanned << " bytes";
+}
+
+off_t disk_cache::scan_segment(segment_file& seg, off_t from) {
+	std::int64_t now = time(nullptr);
+	while (from < seg.size) {
+		record_header hdr;
+		if (!read_exact(seg.fd, &hdr, sizeof(hdr), from)
+				|| hdr.magic != RECORD_MAGIC
+				|| from + off_t(sizeof(hdr)) + hdr.key_length + hdr.vary_length
+						+ hdr.head_length + off_t(hdr.body_length) > seg.size) {
+			break;
+		}
+		std::string key(hdr.key_length, '\0'), blob(hdr.vary_length, '\0');
+		off_t pos = from + sizeof(hdr);
+		if (!read_exact(seg.fd, &key[0], key.size(), pos)
+				|| !read_exact(seg.fd, &blob[0], blob.size(),
+						pos + key.size())) {
+			break;
+		}
+		pos += key.size() + blob.size();
+		if (hdr.expires > now) {
+			index_entry e { seg.id, pos, hdr.head_length, hdr.body_length,
+					hdr.stored, hdr.expires, { }, { } };
+			parse_vary_blob(blob, e.vary, e.vary_spec);
+			index[key] = std::move(e);
+		}
+		from = pos + hdr.head_length + hdr.body_length;
+	}
+	if (from < seg.size) {
+		// torn write at the end of the segment, nothing after it is usable
+		util::log() << "Truncating cache segment " << segment_path(seg.id)
+				<< " at " << from;
+		used -= seg.size - from;
+		seg.size = from;
+		if (ftruncate(seg.fd, from) == -1) {
+			util::log() << "Truncate failed: " << util::error();
+		}
+	}
+	return from;
+}
+
+void disk_cache::open_segment(std::uint32_t id) {
+	int fd = open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+			0644);
+	if (fd == -1) {
+		throw std::runtime_error(
+				"Unable to create cache segment " + segment_path(id));
+	}
+	segments[id] = std::make_shared<segment_file>(id, fd, 0);
+}
+
+void disk_cache::drop_oldest_segment() {
+	auto oldest = segments.begin();
+	for (auto it = index.begin(); it != index.end();) {
+		if (it->second.segment == oldest->first) {
+			it = index.erase(it);
+		} else {
+			it++;
+		}
+	}
+	used -= oldest->second->size;
+	unlink(segment_path(oldest->first).c_str());
+	util::log() << "Disk cache dropped segment " << oldest->first;
+	// segment stays open while some client is still being served from it
+	segments.erase(oldest);
+}
+
+bool disk_cache::lookup(const std::string& key, header_parser& request,
+		hit& to) {
+	if (cache_policy::bypasses_stored(request)) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	// the head is read without the lock, which every loop and the writer
+	// share; the segment stays open while to holds it
+	index_entry e;
+	std::int64_t now = time(nullptr);
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		auto found = index.find(key);
+		auto seg = found == index.end() ?
+				segments.end() : segments.find(found->second.segment);
+		if (seg == segments.end() || found->second.expires <= now
+				|| cache_policy::vary_spec(found->second.vary, request)
+						!= found->second.vary_spec) {
+			if (found != index.end() && (seg == segments.end()
+					|| found->second.expires <= now)) {
+				index.erase(found);
+			}
+			misses.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		e = found->second;
+		to.segment = seg->second;
+	}
+	to.head.resize(e.head_length);
+	if (!read_exact(to.segment->fd, &to.head[0], e.head_length,
+			e.head_offset)) {
+		util::log() << "Unable to read cached object " << key << ": "
+				<< util::error();
+		std::lock_guard<std::mutex> lg(mut);
+		// unless a newer copy took its place meanwhile
+		auto found = index.find(key);
+		if (found != index.end() && found->second.segment == e.segment
+				&& found->second.head_offset == e.head_offset) {
+			index.erase(found);
+		}
+		to.segment.reset();
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	to.head += cache_policy::age_line(now - e.stored);
+	to.body_offset = e.head_offset + e.head_length;
+	to.body_length = e.body_length;
+	hits.fetch_add(1, std::memory_order_relaxed);
+	bytes_saved.fetch_add(to.head.size() + to.body_length,
+			std::memory_order_relaxed);
+	return true;
+}
+
+void disk_cache::store(const std::string& key, header_parser& request,
+		const cache_policy& policy, const std::string& response) {
+	if (key.empty() || !policy.storable) {
+		return;
+	}
+	std::string spec = cache_policy::vary_spec(policy.vary, request);
+	std::string blob = vary_blob(policy.vary, spec);
+	std::int64_t now = time(nullptr);
+	record_header hdr { RECORD_MAGIC, std::uint32_t(key.size()),
+			std::uint32_t(blob.size()), std::uint32_t(policy.head.size()),
+			response.size() - policy.body_offset, now - policy.age, now
+					- policy.age + policy.lifetime };
+	std::size_t total = sizeof(hdr) + key.size() + blob.size()
+			+ policy.head.size() + hdr.body_length;
+	if (total > budget / 4) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lg(queue_mutex);
+		if (queued_bytes + total > MAX_QUEUED_BYTES) {
+			util::debug() << "Disk cache writer is behind, not storing " << key;
+			return;
+		}
+		queued_bytes += total;
+	}
+
+	pending p { key, { }, index_entry { 0, off_t(sizeof(hdr) + key.size()
+			+ blob.size()), hdr.head_length, hdr.body_length, hdr.stored,
+			hdr.expires, policy.vary, spec } };
+	p.record.reserve(total);
+	put(p.record, hdr);
+	p.record += key;
+	p.record += blob;
+	p.record += policy.head;
+	p.record.append(response, policy.body_offset, std::string::npos);
+
+	std::lock_guard<std::mutex> lg(queue_mutex);
+	queue.push_back(std::move(p));
+	queue_cv.notify_one();
+}
+
+void disk_cache::writer_loop() {
+	std::unique_lock<std::mutex> lk(queue_mutex);
+	for (;;) {
+		while (queue.empty() && !stopping) {
+			queue_cv.wait(lk);
+		}
+		if (queue.empty()) {
+			return;
+		}
+		pending p = std::move(queue.front());
+		queue.pop_front();
+		writing = true;
+		lk.unlock();
+		write_record(p);
+		lk.lock();
+		writing = false;
+		queued_bytes -= p.record.size();
+		if (queue.empty()) {
+			drained_cv.notify_all();
+		}
+	}
+}
+
+void disk_cache::write_record(pending& p) {
+	std::shared_ptr<segment_file> seg;
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		seg = segments.rbegin()->second;
+	}
+	// only this thread appends, so the size can't move under us
+	off_t at = seg->size;
+	for (std::size_t written = 0; written < p.record.size();) {
+		ssize_t wr = pwrite(seg->fd, p.record.data() + written,
+				p.record.size() - written, at + written);
+		if (wr <= 0) {
+			util::log() << "Unable to write cache segment " << seg->id << ": "
+					<< util::error();
+			if (ftruncate(seg->fd, at) == -1) {
+				errno = 0;
+			}
+			return;
+		}
+		written += wr;
+	}
+
+	std::unique_lock<std::mutex> lg(mut);
+	seg->size += p.record.size();
+	used += p.record.size();
+	p.entry.segment = seg->id;
+	p.entry.head_offset += at;
+	index[p.key] = std::move(p.entry);
+	auto n = stores.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	if (seg->size >= off_t(segment_limit)) {
+		open_segment(seg->id + 1);
+	}
+	while (used > budget && segments.size() > 1) {
+		drop_oldest_segment();
+	}
+	lg.unlock();
+	if (n % CHECKPOINT_EVERY == 0) {
+		save_index();
+	}
+}
+
+void disk_cache::checkpoint() {
+	std::unique_lock<std::mutex> lk(queue_mutex);
+	while (!queue.empty() || writing) {
+		drained_cv.wait(lk);
+	}
+	lk.unlock();
+	save_index();
+}
+
+void disk_cache::save_index() {
+	std::lock_guard<std::mutex> save(save_mutex);
+	std::string data;
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		auto & active = *segments.rbegin()->second;
+		put(data, INDEX_MAGIC);
+		put(data, INDEX_VERSION);
+		put(data, active.id);
+		put(data, std::uint64_t(active.size));
+		put(data, std::uint64_t(index.size()));
+		for (auto & x : index) {
+			put(data, x.first);
+			put(data, x.second.segment);
+			put(data, std::int64_t(x.second.head_offset));
+			put(data, x.second.head_length);
+			put(data, x.second.body_length);
+			put(data, x.second.stored);
+			put(data, x.second.expires);
+			put(data, vary_blob(x.second.vary, x.second.vary_spec));
+		}
+	}
+	std::string tmp = dir + "/index.tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool ok = fd != -1;
+	for (std::size_t pos = 0; ok && pos < data.size();) {
+		ssize_t wr = write(fd, data.data() + pos, data.size() - pos);
+		ok = wr > 0;
+		pos += ok ? wr : 0;
+	}
+	if (fd != -1) {
+		ok = fsync(fd) == 0 && ok;
+		close(fd);
+	}
+	if (!ok || rename(tmp.c_str(), (dir + "/index").c_str()) == -1) {
+		util::log() << "Unable to save cache index: " << util::error();
+	}
+}
+
+disk_cache::stats_t disk_cache::stats() const {
+	std::lock_guard<std::mutex> lg(mut);
+	return {hits.load(std::memory_order_relaxed),
+		misses.load(std::memory_order_relaxed),
+		stores.load(std::memory_order_relaxed),
+		bytes_saved.load(std::memory_order_relaxed),
+		index.size(), segments.size(), used, budget};
+}
@@ -0,0 +1,115 @@
+/*
+ * disk_cache.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef DISK_CACHE_H_
+#define DISK_CACHE_H_
+
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.h"
+#include "http.h"
+
+// Second cache tier for objects too big for response_cache.
+// Objects are appended to segment files (seg-NNNNNNNN in the cache directory)
+// and located through an in-memory index. When the directory grows over its
+// budget whole segments are dropped, oldest first.
+// The index is saved to the directory on checkpoint() and on destruction; on
+// start only records appended after the saved checkpoint are scanned.
+// Records are written and the index saved by a writer thread, so a store
+// costs the dispatcher one copy of the response; lookups find an object once
+// it is on disk.
+class disk_cache {
+public:
+	// Keeps the segment open while its body is being sent
+	struct segment_file {
+		std::uint32_t id;
+		int fd;
+		off_t size;
+		segment_file(std::uint32_t id, int fd, off_t size);
+		~segment_file();
+	};
+	struct hit {
+		std::shared_ptr<segment_file> segment;
+		std::string head; // complete, with Age
+		off_t body_offset;
+		std::size_t body_length;
+	};
+	struct stats_t {
+		std::uint64_t hits, misses, stores, bytes_saved;
+		std::size_t objects, segments, bytes_used, bytes_budget;
+	};
+
+	disk_cache(const std::string & dir, std::size_t budget_bytes,
+			std::size_t segment_bytes = 64 << 20);
+	~disk_cache();
+
+	bool lookup(const std::string & key, header_parser & request, hit & to);
+	// queues the response for the writer, dropped if too much is queued
+	void store(const std::string & key, header_parser & request,
+			const cache_policy & policy, const std::string & response);
+	// waits for queued stores, then saves the index
+	void checkpoint();
+
+	stats_t stats() const;
+
+private:
+	struct index_entry {
+		std::uint32_t segment;
+		off_t head_offset;
+		std::uint32_t head_length;
+		std::uint64_t body_length;
+		std::int64_t stored, expires; // wall clock seconds
+		std::vector<std::string> vary;
+		std::string vary_spec;
+	};
+	// a record waiting for the writer, head_offset counts from its start
+	struct pending {
+		std::string key;
+		std::string record;
+		index_entry entry;
+	};
+
+	std::string segment_path(std::uint32_t id) const;
+	void load();
+	off_t scan_segment(segment_file & seg, off_t from);
+	void open_segment(std::uint32_t id);
+	void drop_oldest_segment();
+	void writer_loop();
+	void write_record(pending & p);
+	void save_index();
+
+	std::string dir;
+	std::size_t budget, segment_limit;
+	std::size_t used = 0;
+	std::map<std::uint32_t, std::shared_ptr<segment_file>> segments;
+	std::unordered_map<std::string, index_entry> index;
+	mutable std::mutex mut;
+	std::mutex save_mutex; // one index file written at a time
+
+	std::deque<pending> queue;
+	std::size_t queued_bytes = 0;
+	bool writing = false, stopping = false;
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv, drained_cv;
+	std::thread writer;
+
+	std::atomic<std::uint64_t> hits { 0 }, misses { 0 }, stores { 0 },
+			bytes_saved { 0 };
+};
+
+#endif /* DISK_CACHE_H_ */
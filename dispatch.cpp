@@ -2,6 +2,9 @@
 
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iterator>
 #include <mutex>
 #include <stdexcept>
@@ -16,6 +19,8 @@
 #include <signal.h>
 #include <cstring>
 
+#include "metrics.h"
+#include "trace.h"
 #include "util.h"
 
 struct event {
@@ -28,7 +33,7 @@ struct event {
 };
 
 struct link_holer {
-	int event_id;
+	long event_id;
 	int epoll_actions;
 };
 
@@ -42,21 +47,58 @@ struct fd_hold {
 	}
 };
 
-static std::unordered_map<int, event> events;
-static std::unordered_map<int, fd_hold> fds;
-static std::unordered_set<int> armed;
-static int epoll_fd = epoll_create1(0);
-static int manual_fd = eventfd(0, EFD_CLOEXEC);
-static int event_id_counter = 1;
-static int current_action = 0;
-static bool stop = false;
-static std::recursive_mutex data_mutex;
-static std::recursive_mutex armed_mutex;
-
-int add_event(std::function<void()> action) {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	int current_number = event_id_counter++;
-	events.insert( { current_number, event(action) });
+// One loop per dispatcher thread. Event ids carry the index of the loop
+// owning them, so other threads (DNS resolvers, collapsed requests) can arm
+// events of any loop.
+constexpr long MAX_LOOPS = 64;
+
+struct loop_state {
+	std::unordered_map<long, event> events;
+	std::unordered_map<int, fd_hold> fds;
+	std::unordered_set<long> armed;
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int manual_fd = eventfd(0, EFD_CLOEXEC);
+	long index;
+	long event_id_counter = 1;
+	long current_action = 0;
+	std::chrono::steady_clock::duration last_iteration { };
+	std::recursive_mutex data_mutex;
+	std::recursive_mutex armed_mutex;
+
+	explicit loop_state(long index) :
+			index(index) {
+	}
+};
+
+// published after construction, stop_all may look at them from any thread
+static std::atomic<loop_state *> loops[MAX_LOOPS];
+static std::atomic<long> loop_count { 0 };
+static std::atomic<bool> stop { false };
+static thread_local loop_state * this_loop = nullptr;
+
+// loop of the calling thread, made on first use
+static loop_state & current_loop() {
+	if (!this_loop) {
+		long index = loop_count.fetch_add(1);
+		if (index >= MAX_LOOPS) {
+			throw std::logic_error("Too many dispatcher threads");
+		}
+		this_loop = new loop_state(index);
+		loops[index] = this_loop;
+	}
+	return *this_loop;
+}
+
+// event_id must be a real one, -1 (no event) has no loop
+static loop_state & loop_of(long event_id) {
+	return *loops[event_id % MAX_LOOPS];
+}
+
+long add_event(std::function<void()> action) {
+	loop_state & lp = current_loop();
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	long current_number = lp.event_id_counter++ * MAX_LOOPS + lp.index;
+	lp.events.insert( { current_number, event(action) });
 	return current_number;
 }
 
@@ -64,12 +106,13 @@ void add_fd(int fd, int epoll_mode) {
 	if (fd == -1) {
 		return;
 	}
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	auto it = fds.find(fd);
-	if (it != fds.end()) {
+	loop_state & lp = current_loop();
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	auto it = lp.fds.find(fd);
+	if (it != lp.fds.end()) {
 		if (it->second.recycle_marked && it->second.threads.size() == 0) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
-			fds.erase(it);
+			epoll_ctl(lp.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+			lp.fds.erase(it);
 		} else {
 			auto log = util::log();
 			std::string err_str = std::string("Descriptor ")
@@ -81,25 +124,29 @@ void add_fd(int fd, int epoll_mode) {
 			throw std::logic_error(err_str);
 		}
 	}
-	fds.insert( { fd, fd_hold(fd) });
+	lp.fds.insert( { fd, fd_hold(fd) });
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wnarrowing"
 	epoll_event ev { epoll_mode, { .fd = fd } }; // @suppress("Symbol is not resolved")
 #pragma GCC diagnostic pop
-	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	epoll_ctl(lp.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
 	return;
 }
 
-void link(int fd, int epoll_target, int event_id) {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	auto fdd = fds.find(fd);
-	auto evd = events.find(event_id);
+void link(int fd, int epoll_target, long event_id) {
+	if (event_id < 0) {
+		return;
+	}
+	loop_state & lp = loop_of(event_id);
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	auto fdd = lp.fds.find(fd);
+	auto evd = lp.events.find(event_id);
 	link_holer l { event_id, epoll_target };
-	if (fdd == fds.end()) {
+	if (fdd == lp.fds.end()) {
 		util::log() << "Linking unregistered fd to event " << event_id;
 		throw new std::invalid_argument("Linking unregistered fd");
 	}
-	if (evd == events.end()) {
+	if (evd == lp.events.end()) {
 		util::log() << "Linking unregistered event to fd " << fd;
 		throw new std::invalid_argument("Linking unregistered event");
 	}
@@ -107,15 +154,19 @@ void link(int fd, int epoll_target, int event_id) {
 	evd->second.trigger_count++;
 }
 
-void unlink(int fd, int event_id) {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	auto fdd = fds.find(fd);
-	auto evd = events.find(event_id);
-	if (fdd == fds.end()) {
+void unlink(int fd, long event_id) {
+	if (event_id < 0) {
+		return;
+	}
+	loop_state & lp = loop_of(event_id);
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	auto fdd = lp.fds.find(fd);
+	auto evd = lp.events.find(event_id);
+	if (fdd == lp.fds.end()) {
 		util::log() << "Unlinking unregistered fd from event " << event_id;
 		throw new std::invalid_argument("Unlinking unregistered fd");
 	}
-	if (evd == events.end()) {
+	if (evd == lp.events.end()) {
 		util::log() << "Unlinking unregistered event from fd " << fd;
 		throw new std::invalid_argument("Unlinking unregistered event");
 	}
@@ -130,83 +181,117 @@ void unlink(int fd, int event_id) {
 }
 
 void unlink_current(int fd) {
+	long current_action = current_loop().current_action;
 	if (current_action) {
 		unlink(fd, current_action);
 	}
 }
 
-void recycle_event(int event_id) {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	auto evd = events.find(event_id);
-	if (evd != events.end()) {
+void recycle_event(long event_id) {
+	if (event_id < 0) {
+		return;
+	}
+	loop_state & lp = loop_of(event_id);
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	auto evd = lp.events.find(event_id);
+	if (evd != lp.events.end()) {
 		evd->second.recycle_marked = true;
+		TRACE_PROBE(dispatch_recycle, event_id, 0);
 	}
 }
 
 void recycle_fd(int fd) {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	auto fdd = fds.find(fd);
-	if (fdd != fds.end()) {
+	loop_state & lp = current_loop();
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	auto fdd = lp.fds.find(fd);
+	if (fdd != lp.fds.end()) {
 		fdd->second.recycle_marked = true;
 		for (auto x : fdd->second.threads) {
-			if (events.count(x.event_id)) { // only not happens during destruction
-				events.find(x.event_id)->second.trigger_count--;
+			if (lp.events.count(x.event_id)) { // only not happens during destruction
+				lp.events.find(x.event_id)->second.trigger_count--;
 			}
 		}
 	}
 }
 
 void recycle_event_current() {
+	long current_action = current_loop().current_action;
 	if (current_action) {
 		recycle_event(current_action);
 	}
 }
 
-void arm_manual(int event_id) {
-	std::unique_lock<std::recursive_mutex> arm(armed_mutex);
-	if (!stop && events.count(event_id)) {
-		armed.insert(event_id);
-		eventfd_write(manual_fd, 1);
+void arm_manual(long event_id) {
+	if (event_id < 0) {
+		return;
+	}
+	loop_state & lp = loop_of(event_id);
+	std::unique_lock<std::recursive_mutex> arm(lp.armed_mutex);
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	if (!stop && lp.events.count(event_id)) {
+		TRACE_PROBE(dispatch_arm, event_id, 0);
+		lp.armed.insert(event_id);
+		eventfd_write(lp.manual_fd, 1);
 	}
 }
 
-static std::thread dispatcher;
+// SIGINT ends every loop
+void stop_all() {
+	stop = true;
+	for (long i = 0; i < std::min(loop_count.load(), MAX_LOOPS); i++) {
+		// a loop still being made checks stop before it first waits
+		if (loop_state * lp = loops[i].load()) {
+			eventfd_write(lp->manual_fd, 1);
+		}
+	}
+}
 
-void epoll_mark() {
+void epoll_mark(loop_state & lp) {
 	epoll_event poll[1000];
-	int ev = epoll_wait(epoll_fd, poll, 1000, -1);
-	std::unique_lock<std::recursive_mutex> arm(armed_mutex);
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
+	int ev = epoll_wait(lp.epoll_fd, poll, 1000, -1);
+	std::unique_lock<std::recursive_mutex> arm(lp.armed_mutex);
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
 	for (int i = 0; i < ev; i++) {
-		auto fdd = fds.find(poll[i].data.fd);
+		auto fdd = lp.fds.find(poll[i].data.fd);
 		for (auto x : fdd->second.threads) {
 			if (x.epoll_actions & poll[i].events) {
-				armed.insert(x.event_id);
+				lp.armed.insert(x.event_id);
 			}
 		}
 	}
 }
 
-void run_events() {
-	std::unique_lock<std::recursive_mutex> arm(armed_mutex);
-	while (!armed.empty()) {
-		current_action = *armed.begin();
-		armed.erase(armed.begin());
-		auto it = events.find(current_action);
-		if (it != events.end()) {
+// Actions run without armed_mutex held: they arm events of other loops,
+// which takes that loop's armed_mutex, and the other loop may be doing the
+// same to this one.
+static long next_armed(loop_state & lp) {
+	std::lock_guard<std::recursive_mutex> arm(lp.armed_mutex);
+	if (lp.armed.empty()) {
+		return 0;
+	}
+	long event_id = *lp.armed.begin();
+	lp.armed.erase(lp.armed.begin());
+	return event_id;
+}
+
+void run_events(loop_state & lp) {
+	while ((lp.current_action = next_armed(lp))) {
+		auto it = lp.events.find(lp.current_action);
+		if (it != lp.events.end()) {
+			TRACE_PROBE(dispatch_run, lp.current_action, 0);
 			it->second.action();
 		}
 	}
-	current_action = 0;
+	lp.current_action = 0;
 }
 
-void gc() {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	int ev_start = events.size(), fd_start = fds.size();
+void gc(loop_state & lp) {
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	int ev_start = lp.events.size(), fd_start = lp.fds.size();
 	int ev_hastriggers = 0, ev_notrecycled = 0;
-	for (auto it = events.begin(); it != events.end();) {
+	for (auto it = lp.events.begin(); it != lp.events.end();) {
 		if (it->second.recycle_marked && it->second.trigger_count == 0) {
-			it = events.erase(it);
+			it = lp.events.erase(it);
 		} else {
 			if (it->second.recycle_marked) {
 				ev_hastriggers++;
@@ -216,16 +301,16 @@ void gc() {
 			it++;
 		}
 	}
-	for (auto it = fds.begin(); it != fds.end();) {
+	for (auto it = lp.fds.begin(); it != lp.fds.end();) {
 		if (it->second.recycle_marked && it->second.threads.size() == 0) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
-			it = fds.erase(it);
+			epoll_ctl(lp.epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+			it = lp.fds.erase(it);
 		} else {
 			it++;
 		}
 	}
-	int ev_end = events.size(), fd_end = fds.size();
-	auto log = util::log();
+	int ev_end = lp.events.size(), fd_end = lp.fds.size();
+	auto log = util::trace();
 	log << "GC Events: " << ev_start - ev_end << " deleted, " << ev_end
 			<< " left" << util::newl;
 	log << "GC Files : " << fd_start - fd_end << " deleted, " << fd_end
@@ -233,17 +318,24 @@ void gc() {
 }
 
 void dispatch_loop() {
-	add_fd(manual_fd, EPOLLIN);
-	int read_manual = add_event([] {
+	loop_state & lp = current_loop();
+	add_fd(lp.manual_fd, EPOLLIN);
+	int manual_fd = lp.manual_fd;
+	long read_manual = add_event([manual_fd] {
 		unsigned long int l;
 		eventfd_read(manual_fd, &l);
 	});
-	link(manual_fd, EPOLLIN, read_manual);
+	link(lp.manual_fd, EPOLLIN, read_manual);
 	for (int cntr = 1; !stop; cntr++) {
-		epoll_mark();
-		run_events();
+		epoll_mark(lp);
+		util::tick();
+		auto start = std::chrono::steady_clock::now();
+		run_events(lp);
+		// how long events of this wakeup kept the next ones waiting
+		lp.last_iteration = std::chrono::steady_clock::now() - start;
+		metrics::observe(metrics::loop_iteration, lp.last_iteration);
 		if (cntr % 50 == 0) {
-			gc();
+			gc(lp);
 		}
 	}
 }
@@ -257,15 +349,18 @@ void run_dispatcher_in_current_thread() {
 	sigaddset(&sigmask, SIGINT);
 	sigprocmask(SIG_BLOCK, &sigmask, &sigold);
 
-	int sfd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+	// every loop watches for SIGINT, whichever reads it stops them all
+	int sfd = signalfd(-1, &sigmask, SFD_CLOEXEC | SFD_NONBLOCK);
 	fd_ref stdinfd(sfd, EPOLLIN);
 	event_ref over([sfd] {
 		signalfd_siginfo sig;
-		read(sfd, &sig, sizeof(sig));
-		stop = sig.ssi_signo == SIGINT;
+		if (read(sfd, &sig, sizeof(sig)) == sizeof(sig)
+				&& sig.ssi_signo == SIGINT) {
+			stop_all();
+		}
+		errno = 0;
 	});
 	link(stdinfd, EPOLLIN, over);
-	stop = false;
 	dispatch_loop();
 
 	sigprocmask(SIG_SETMASK, &sigold, nullptr);
@@ -321,7 +416,7 @@ event_ref::event_ref(const std::function<void()> & event) {
 	event_id = add_event(event);
 }
 
-int event_ref::id() const {
+long event_ref::id() const {
 	return event_id;
 }
 
@@ -387,18 +482,31 @@ fd_ref::~fd_ref() {
 }
 
 void cleanup() {
-	std::lock_guard<std::recursive_mutex> lg(data_mutex);
-	for (auto it = events.begin(); it != events.end();) {
-		it = events.erase(it);
+	loop_state & lp = current_loop();
+	std::lock_guard<std::recursive_mutex> lg(lp.data_mutex);
+	for (auto it = lp.events.begin(); it != lp.events.end();) {
+		it = lp.events.erase(it);
 	}
 //		events.clear();
-	for (auto it = fds.begin(); it != fds.end();) {
-		if (it->first != 0) {
+	for (auto it = lp.fds.begin(); it != lp.fds.end();) {
+		// the wakeup descriptor stays, other threads may still poke it;
+		// recycled ones were closed by their owners and the number may
+		// belong to another thread by now
+		if (it->first != 0 && it->first != lp.manual_fd
+				&& !it->second.recycle_marked) {
 			::close(it->first);
 		}
 		it++;
 	}
-	fds.clear();
+	lp.fds.clear();
+}
+
+int loop_index() {
+	return current_loop().index;
+}
+
+std::chrono::steady_clock::duration last_iteration() {
+	return current_loop().last_iteration;
 }
 
 }
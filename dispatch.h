@@ -8,6 +8,7 @@
 #ifndef DISPATCH_H_
 #define DISPATCH_H_
 
+#include <chrono>
 #include <functional>
 #include "util.h"
 
@@ -16,7 +17,7 @@
 namespace dispatch {
 
 class event_ref {
-	int event_id;
+	long event_id;
 public:
 	event_ref();
 	event_ref(const std::function<void()> & event);
@@ -25,7 +26,7 @@ public:
 	event_ref(event_ref &&);
 	event_ref & operator =(event_ref &&);
 
-	int id() const;
+	long id() const;
 
 	void recycle();
 
@@ -68,9 +69,18 @@ void recycle_fd(const fd_ref &);
 
 void arm_manual(const event_ref &);
 
+// Every thread calling this runs its own loop; descriptors and events
+// belong to the loop of the thread that made them. Only arm_manual may be
+// called for events of another loop. SIGINT stops all loops.
 void run_dispatcher_in_current_thread();
 void create_dispatcher_thread();
+// cleans up the loop of the calling thread
 void cleanup();
+// index of the calling thread's loop, in order of first use
+int loop_index();
+// how long the events of the previous wakeup of the calling thread's loop
+// ran
+std::chrono::steady_clock::duration last_iteration();
 
 }
 
@@ -13,7 +13,11 @@
 #include <mutex>
 #include <thread>
 #include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "metrics.h"
+#include "topology.h"
 #include "util.h"
 
 struct request {
@@ -22,17 +26,32 @@ struct request {
 	int id;
 	std::reference_wrapper<const dispatch::event_ref> next_event;
 	std::shared_ptr<std::promise<int>> promise;
+	bool early_data;
+	connect_times * times;
 };
 
+// origins worth a fast open attempt, forgotten wholesale when full
+constexpr std::size_t MAX_KNOWN_ORIGINS = 4096;
+
 struct dns_data {
 	std::atomic_int ids;
 	std::list<request> reqs;
+	std::atomic<std::size_t> queued { 0 }; // reqs.size() without the lock
 	std::mutex req_mutex;
 	std::condition_variable task_sleeper;
 	std::atomic_flag work;
 	std::vector<std::thread> threads;
+	socket_tuning::profile profile;
+	std::unordered_set<std::string> known_origins;
+	std::mutex origins_mutex;
+	std::unordered_map<std::string, std::string> pinned_hosts;
+	std::mutex pinned_mutex;
+
+	std::vector<int> cpus; // of the resolvers, empty leaves them anywhere
 
-	dns_data(int thread_count) {
+	dns_data(int thread_count, const socket_tuning::profile & profile,
+			const std::vector<int> & cpus) :
+			profile(profile), cpus(cpus) {
 		ids.store(0);
 		threads.resize(thread_count);
 		work.test_and_set(std::memory_order_relaxed);
@@ -41,12 +60,15 @@ struct dns_data {
 		}
 	}
 	std::future<int> enqueue_request(const std::string& host,
-			const std::string& port, const dispatch::event_ref & event) {
+			const std::string& port, const dispatch::event_ref & event,
+			bool early_data, connect_times * times) {
 		int id = ids.fetch_add(1, std::memory_order_relaxed);
 		request new_req { host, port, id, std::ref(event), std::make_shared<
-				std::promise<int>>() };
+				std::promise<int>>(), early_data, times };
+		metrics::change(metrics::dns_queue_depth, 1);
 		std::lock_guard<std::mutex> lg(req_mutex);
 		reqs.push_front(new_req);
+		queued.store(reqs.size(), std::memory_order_relaxed);
 		task_sleeper.notify_one();
 		return new_req.promise->get_future();
 	}
@@ -61,19 +83,52 @@ struct dns_data {
 		}
 		to = reqs.front();
 		reqs.pop_front();
+		queued.store(reqs.size(), std::memory_order_relaxed);
+		metrics::change(metrics::dns_queue_depth, -1);
 		return true;
 	}
 	void return_request_to_queue(request req) {
+		metrics::change(metrics::dns_queue_depth, 1);
 		std::unique_lock<std::mutex> read_lock(req_mutex);
 		reqs.push_back(req);
+		queued.store(reqs.size(), std::memory_order_relaxed);
 		task_sleeper.notify_one();
 	}
+	// A fast open connect() can't tell which address works, so it's only
+	// tried on origins that accepted a plain connect before
+	bool fast_open(const request & req) {
+		if (!profile.fastopen_connect || !req.early_data) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lg(origins_mutex);
+		return known_origins.count(req.host + ":" + req.port);
+	}
+	void remember_origin(const request & req) {
+		if (!profile.fastopen_connect) {
+			return;
+		}
+		std::lock_guard<std::mutex> lg(origins_mutex);
+		if (known_origins.size() >= MAX_KNOWN_ORIGINS) {
+			known_origins.clear();
+		}
+		known_origins.insert(req.host + ":" + req.port);
+	}
+	// the pinned address of host, or host itself
+	std::string node_for(const std::string & host) {
+		std::lock_guard<std::mutex> lg(pinned_mutex);
+		auto it = pinned_hosts.find(host);
+		return it == pinned_hosts.end() ? host : it->second;
+	}
 	void start_dns_resolver() {
+		if (!cpus.empty() && !topology::pin(cpus)) {
+			util::log() << "Unable to pin resolver to CPUs "
+					<< topology::format_cpus(cpus) << ": " << util::error();
+		}
 		std::unique_lock<std::mutex> read_lock(req_mutex, std::defer_lock);
 		constexpr addrinfo hint { 0, AF_INET, SOCK_STREAM, 0, 0, 0, 0, nullptr };
 		const dispatch::event_ref dummy;
 		request req { "", "", 0, std::ref(dummy), std::shared_ptr<
-				std::promise<int>>() };
+				std::promise<int>>(), false, nullptr };
 		addrinfo * addr;
 		for (;;) {
 			bool success = get_request(req);
@@ -82,8 +137,11 @@ struct dns_data {
 				return;
 			}
 
-			int result = getaddrinfo(req.host.c_str(), req.port.c_str(), &hint,
-					&addr);
+			auto started = std::chrono::steady_clock::now();
+			int result = getaddrinfo(node_for(req.host).c_str(),
+					req.port.c_str(), &hint, &addr);
+			metrics::observe(metrics::dns_resolve,
+					std::chrono::steady_clock::now() - started);
 			switch (result) {
 			case 0:
 				break;
@@ -104,14 +162,22 @@ struct dns_data {
 				exit(0);
 			}
 
-			util::log() << "Resolved domain " << req.host;
+			util::debug() << "Resolved domain " << req.host;
+			if (req.times) {
+				req.times->resolved = std::chrono::steady_clock::now();
+			}
 
 			int sock = -1;
 
 			if (result == 0) {
+				bool early = fast_open(req);
 				for (addrinfo * cr = addr; cr != nullptr; cr = cr->ai_next) {
 					sock = socket(cr->ai_family, cr->ai_socktype,
 							cr->ai_protocol);
+					socket_tuning::apply(sock, profile);
+					if (early) {
+						early = socket_tuning::enable_fastopen_connect(sock);
+					}
 					int conn_srv = connect(sock, cr->ai_addr, cr->ai_addrlen);
 					if (conn_srv == 0) {
 						break;
@@ -121,6 +187,12 @@ struct dns_data {
 				}
 
 				freeaddrinfo(addr);
+				if (sock != -1 && !early) {
+					remember_origin(req);
+				}
+				if (sock != -1 && req.times) {
+					req.times->connected = std::chrono::steady_clock::now();
+				}
 			}
 			req.promise->set_value(sock);
 			dispatch::arm_manual(req.next_event.get());
@@ -143,13 +215,25 @@ struct dns_data {
 	}
 };
 
-dns_pool::dns_pool(int thread_count) {
-	data = std::make_shared<dns_data>(thread_count);
+dns_pool::dns_pool(int thread_count, const socket_tuning::profile & profile,
+		const std::vector<int> & cpus) {
+	data = std::make_shared<dns_data>(thread_count, profile, cpus);
 }
 
 std::future<int> dns_pool::connect_to_remote_server(const std::string& host,
-		const std::string& port, const dispatch::event_ref& event) const {
-	return data->enqueue_request(host, port, event);
+		const std::string& port, const dispatch::event_ref& event,
+		bool early_data, connect_times * times) const {
+	return data->enqueue_request(host, port, event, early_data, times);
+}
+
+void dns_pool::pin_host(const std::string & host,
+		const std::string & address) {
+	std::lock_guard<std::mutex> lg(data->pinned_mutex);
+	data->pinned_hosts[host] = address;
+}
+
+std::size_t dns_pool::queue_depth() const {
+	return data->queued.load(std::memory_order_relaxed);
 }
 
 void dns_pool::stop_pool() {
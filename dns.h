@@ -12,17 +12,36 @@
 #include <vector>
 #include <memory>
 #include <future>
+#include <chrono>
 
 #include "dispatch.h"
+#include "socket_tuning.h"
 
 struct dns_data;
 
+// when the resolver got through each step, filled in before the future is
+// ready
+struct connect_times {
+	std::chrono::steady_clock::time_point resolved, connected;
+};
+
 class dns_pool {
 	std::shared_ptr<dns_data> data;
 public:
-	dns_pool(int thread_count);
+	// server sockets are tuned with profile, resolver threads run on cpus
+	// unless that is empty
+	dns_pool(int thread_count, const socket_tuning::profile & profile = { },
+			const std::vector<int> & cpus = { });
+	// early_data says the first write may ride on the SYN, when fast open
+	// is enabled and the origin was connected before
 	std::future<int> connect_to_remote_server(const std::string& host,
-				const std::string& port, const dispatch::event_ref & event) const;
+				const std::string& port, const dispatch::event_ref & event,
+				bool early_data = false, connect_times * times = nullptr) const;
+	// host resolves to address from now on, without asking the system
+	// resolver
+	void pin_host(const std::string & host, const std::string & address);
+	// requests waiting for a resolver thread
+	std::size_t queue_depth() const;
 	void stop_pool();
 	void stop_wait();
 };
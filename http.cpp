@@ -8,6 +8,7 @@
 #include "http.h"
 
 #include <stddef.h>
+#include <strings.h>
 #include <cctype>
 #include <sstream>
 #include <utility>
@@ -57,6 +58,16 @@ std::unordered_map<std::string, std::string>& header_parser::headers() {
 	return headers_map;
 }
 
+std::string * header_parser::find_header(const std::string& name) {
+	for (auto & x : headers_map) {
+		if (x.first.size() == name.size()
+				&& strncasecmp(x.first.c_str(), name.c_str(), name.size()) == 0) {
+			return &x.second;
+		}
+	}
+	return nullptr;
+}
+
 std::string& header_parser::excess() {
 	return excess_str;
 }
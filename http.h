@@ -19,6 +19,8 @@ public:
 	std::string assemble_head();
 	std::string & request();
 	std::unordered_map<std::string, std::string> & headers();
+	// case-insensitive lookup, nullptr if there is no such header
+	std::string * find_header(const std::string & name);
 	std::string & excess();
 };
 #endif /* HTTP_H_ */
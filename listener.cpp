@@ -0,0 +1,146 @@
+/*
+ * listener.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "listener.h"
+
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "admission.h"
+#include "util.h"
+
+int open_listener(int port, const listener_options& opts) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		throw std::runtime_error("Unable to open socket");
+	}
+
+	int incr = 1;
+	int reuseaddr = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &incr,
+			sizeof(incr));
+	int reuseport = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &incr,
+			sizeof(incr));
+	if (reuseaddr == -1 || reuseport == -1) {
+		close(fd);
+		throw std::runtime_error("Unable to set socket options");
+	}
+	// only wake up once the client has sent something
+	if (opts.defer_accept > 0
+			&& setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+					&opts.defer_accept, sizeof(opts.defer_accept)) == -1) {
+		util::log() << "Unable to set TCP_DEFER_ACCEPT: " << util::error();
+	}
+	if (opts.fastopen > 0
+			&& setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opts.fastopen,
+					sizeof(opts.fastopen)) == -1) {
+		util::log() << "Unable to set TCP_FASTOPEN: " << util::error();
+	}
+
+	struct sockaddr_in srv_addr { };
+	srv_addr.sin_family = AF_INET;
+	srv_addr.sin_addr.s_addr = INADDR_ANY;
+	srv_addr.sin_port = htons((short) port);
+	if (bind(fd, (sockaddr *) &srv_addr, sizeof(srv_addr)) == -1) {
+		close(fd);
+		throw std::runtime_error(
+				"Unable to bind accepting socket to port "
+						+ std::to_string(port));
+	}
+	if (listen(fd, opts.backlog) == -1) {
+		close(fd);
+		throw std::runtime_error(
+				"Unable to listen on port " + std::to_string(port));
+	}
+	return fd;
+}
+
+bool steer_by_cpu(int fd, int count, const std::vector<int>& cpus) {
+	// A = id of the CPU handling the packet
+	std::vector<sock_filter> code { { BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			std::uint32_t(SKF_AD_OFF + SKF_AD_CPU) } };
+	// if (A == cpus[i]) return i; the first listener on a CPU takes it
+	for (int i = 0; i < count && i < int(cpus.size()); i++) {
+		code.push_back( { BPF_JMP | BPF_JEQ | BPF_K, 0, 1,
+				std::uint32_t(cpus[i]) });
+		code.push_back( { BPF_RET | BPF_K, 0, 0, std::uint32_t(i) });
+	}
+	code.push_back( { BPF_ALU | BPF_MOD | BPF_K, 0, 0, std::uint32_t(count) });
+	code.push_back( { BPF_RET | BPF_A, 0, 0, 0 });
+	if (code.size() > BPF_MAXINSNS) {
+		util::log() << "Too many CPUs to steer by";
+		return false;
+	}
+	sock_fprog prog { static_cast<unsigned short>(code.size()), code.data() };
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			sizeof(prog)) == -1) {
+		util::log() << "Unable to attach reuseport program: " << util::error();
+		return false;
+	}
+	return true;
+}
+
+// Held open so a client can still be taken off the queue and refused once
+// the process runs out of descriptors; otherwise it would stay there and
+// keep the level triggered listener readable
+static thread_local int reserve_fd = -1;
+
+static bool refuse_without_fds(int listen_fd) {
+	if (reserve_fd == -1) {
+		return false;
+	}
+	close(reserve_fd);
+	int client = accept4(listen_fd, nullptr, nullptr,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client != -1) {
+		admission::refuse(client, admission::over_connections);
+	}
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	errno = 0;
+	return client != -1;
+}
+
+int accept_clients(int listen_fd, int max,
+		const std::function<void(int)>& on_client) {
+	if (reserve_fd == -1) {
+		reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+	int accepted = 0;
+	while (accepted < max) {
+		int client = accept4(listen_fd, nullptr, nullptr,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				errno = 0;
+				continue;
+			}
+			if ((errno == EMFILE || errno == ENFILE)
+					&& refuse_without_fds(listen_fd)) {
+				util::log() << "Out of descriptors, refused a client";
+				accepted++;
+				continue;
+			}
+			if (errno != EAGAIN) {
+				// retried on the next wakeup
+				util::log() << "Error accepting new client: " << util::error();
+			}
+			errno = 0;
+			break;
+		}
+		accepted++;
+		on_client(client);
+	}
+	return accepted;
+}
@@ -0,0 +1,39 @@
+/*
+ * listener.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef LISTENER_H_
+#define LISTENER_H_
+
+#include <functional>
+#include <vector>
+
+struct listener_options {
+	int backlog = 1024;
+	int defer_accept = 0; // seconds, 0 leaves TCP_DEFER_ACCEPT off
+	int fastopen = 0; // TCP_FASTOPEN queue length, 0 leaves it off
+	int accept_batch = 64; // clients taken per dispatcher wakeup
+};
+
+// Non-blocking listening socket on all IPv4 addresses with SO_REUSEPORT.
+// Throws std::runtime_error saying which step failed.
+int open_listener(int port, const listener_options & opts);
+
+// Steers each new connection within the SO_REUSEPORT group fd belongs to,
+// listeners numbered in the order they were opened: one received on
+// cpus[i] goes to listener i, the first one if several share the CPU, and
+// one on any other CPU to listener (CPU % count). Returns false if the
+// kernel refused the program.
+bool steer_by_cpu(int fd, int count, const std::vector<int> & cpus);
+
+// Accepts non-blocking clients until the queue is empty or max were taken,
+// whichever is first; the listener stays readable if clients are left over.
+// Once the process is out of descriptors clients are refused with a 503
+// instead. Returns the number of clients taken off the queue.
+int accept_clients(int listen_fd, int max,
+		const std::function<void(int)> & on_client);
+
+#endif /* LISTENER_H_ */
@@ -2,222 +2,388 @@
 
 #include <asm-generic/errno-base.h>
 #include <stddef.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <algorithm>
 #include <cerrno>
 #include <cstdlib>
-#include <functional>
 #include <utility>
 #include <cstring>
 
+#include "buffer_pool.h"
+#include "chunked.h"
 #include "util.h"
+#include "zerocopy.h"
 
-constexpr int READ_BUFFER_SIZE = 1 << 12;
+constexpr std::size_t READ_BUFFER_SIZE = buffer_pool::MAX_CLASS_SIZE;
+// Content-Length comes from the peer, so at most this much is reserved up
+// front, longer bodies grow the buffer as they arrive
+constexpr int MAX_RESERVE = 256 << 10;
 
-using intprom = std::promise<int>;
+// SO_RCVLOWAT of sockets waiting for a long fixed length body
+constexpr int MAX_RCVLOWAT = 1 << 17;
+static bool use_rcvlowat = false;
 
-void finish(dispatch::fd_ref & sock, const dispatch::event_ref & next_action,
-		util::logger & log) {
-	dispatch::unlink_current(sock);
-	dispatch::recycle_event_current();
-	dispatch::arm_manual(next_action);
-	log << " (ending " << sock << ") ";
+// Capacity buf ends up with to hold needed bytes: std::string at least
+// doubles when it grows, so that is what gets charged and reserved
+static std::size_t grown_capacity(const std::string & buf,
+		std::size_t needed) {
+	if (needed <= buf.capacity()) {
+		return buf.capacity();
+	}
+	return std::max(needed, 2 * buf.capacity());
 }
 
-void async_load_generic(std::string& buf, dispatch::fd_ref & sock,
-		const dispatch::event_ref & next_action,
-		const dispatch::event_ref & fail_action,
-		std::function<bool(const std::string &, int, util::logger &)> && positive_check) {
+// Reads of all loaders in a thread go through one pooled buffer
+static char * read_buffer() {
+	static thread_local buffer_pool::pooled_buffer buf(READ_BUFFER_SIZE);
+	return buf.data();
+}
+
+using async_load::loader;
+
+loader::loader(int fd) :
+		fd(fd), zc(fd) {
+}
+
+void loader::start_headers(std::string & buf,
+		std::chrono::steady_clock::time_point * first_byte) {
+	what = HEADERS;
+	in = &buf;
+	refused = false;
+	this->first_byte = first_byte;
+}
+
+void loader::start_fixed(std::string & buf, int length) {
+	// the announced length is the peer's word, so the reserve is capped and
+	// left out if the budgets don't allow it
+	int reserve = std::min(length, MAX_RESERVE);
+	if (reserve > 0) {
+		std::size_t want = grown_capacity(buf, buf.size() + reserve);
+		if (want > buf.capacity() && (!mem || mem->resize(want))) {
+			buf.reserve(want);
+			if (mem) {
+				mem->set(buf.capacity());
+			}
+		}
+	}
+	what = FIXED;
+	in = &buf;
+	refused = false;
+	left = length;
+}
+
+void loader::start_chunked(std::string & buf) {
+	what = CHUNKED;
+	in = &buf;
+	refused = false;
+	decoder = chunked_decoder(buf.find("\r\n\r\n") + 4);
+}
+
+void loader::start_upload(const std::string & buf) {
+	what = UPLOAD;
+	out = &buf;
+	offset = 0;
+	// buf has to stay put until zerocopy sends complete, so the upload
+	// waits for them
+	zc = zerocopy::tracker(fd);
+}
+
+void loader::start_file(int file_fd, off_t offset, std::size_t length) {
+	// sendfile has no MSG_DONTWAIT
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	what = FILE;
+	this->file_fd = file_fd;
+	file_offset = offset;
+	file_end = offset + length;
+}
+
+void loader::charge_to(memory_budget::charge * mem) {
+	this->mem = mem;
+}
 
-	auto log = util::log();
+bool loader::over_budget() const {
+	return refused;
+}
 
-	log << "Generic " << sock << " : ";
-	char t[READ_BUFFER_SIZE];
-	if (positive_check(buf, 0, log)) {
-		finish(sock, next_action, log);
+loader::progress loader::step() {
+	progress p = progress::wait;
+	switch (what) {
+	case IDLE:
+		return progress::wait;
+	case HEADERS:
+		p = receive();
+		break;
+	case FIXED: {
+		p = receive();
+		// the rest of the body is known to be coming, so there is no
+		// point in waking up for every segment of it
+		bool waiting = p == progress::wait;
+		if (use_rcvlowat && (waiting || lowat)) {
+			int want = waiting ? std::min(left, MAX_RCVLOWAT) : 1;
+			if (want > 1 || lowat) {
+				setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &want, sizeof(want));
+				lowat = want > 1;
+			}
+		}
+		break;
+	}
+	case CHUNKED:
+		p = receive_chunked();
+		break;
+	case UPLOAD:
+		p = send_buffer();
+		break;
+	case FILE:
+		p = send_file();
+		break;
+	}
+	if (p != progress::wait) {
+		what = IDLE;
+	}
+	return p;
+}
+
+// Returns true once the data the transfer waits for is in
+bool loader::complete(int last_size, util::trace_logger & log) {
+	if (what == FIXED) {
+		left -= last_size;
+		log << "l " << left << " ";
+		return left <= 0;
+	}
+	if (first_byte && last_size > 0
+			&& *first_byte == std::chrono::steady_clock::time_point()) {
+		*first_byte = std::chrono::steady_clock::now();
+	}
+	auto find = in->find("\r\n\r\n",
+			std::max<int>(0, int(in->size()) - last_size - 3));
+	log << "chk " << (find != in->npos) << " ";
+	return find != in->npos;
+}
+
+// Returns false if in may not grow by more bytes within the budgets,
+// checked before they are appended. Like every step of a connection it
+// charges the capacity of in, which is what is resident.
+bool loader::charged(std::size_t more, util::trace_logger & log) {
+	if (!mem) {
+		return true;
+	}
+	std::size_t want = grown_capacity(*in, in->size() + more);
+	if (mem->resize(want)) {
+		if (want > in->capacity()) {
+			in->reserve(want);
+			mem->set(in->capacity());
+		}
+		return true;
+	}
+	log << "OVER BUDGET";
+	refused = true;
+	util::log() << "Fd " << fd << " over memory budget at " << in->size()
+			<< " bytes";
+	return false;
+}
+
+loader::progress loader::receive() {
+	auto log = util::trace();
+
+	log << "Generic fd " << fd << " : ";
+	char * t = read_buffer();
+	if (complete(0, log)) {
 		log << "WIN inst";
-		return;
+		return progress::done;
 	}
 	for (;;) {
-		int res = recv(sock.fd(), t, sizeof(t), MSG_DONTWAIT);
+		int res = recv(fd, t, READ_BUFFER_SIZE, MSG_DONTWAIT);
 		log << res << " ";
 		if (res <= 0) {
 			int eno = errno;
-			log << util::error() << " ";
+			log << util::error_text { eno } << " ";
+			errno = 0;
 			if (res == 0) {
 				log << "EOF";
-				finish(sock, fail_action, log);
+				return progress::fail;
 			} else if (res == -1 && eno == EAGAIN) {
 				log << "WAIT";
-			} else {
-				log << "FAIL";
-				finish(sock, fail_action, log);
+				return progress::wait;
 			}
+			log << "FAIL";
+			return progress::fail;
+		}
+		if (!charged(res, log)) {
+			return progress::fail;
+		}
+		in->append(t, t + res);
+		if (complete(res, log)) {
+			log << "WIN";
+			return progress::done;
+		}
+	}
+}
+
+loader::progress loader::receive_chunked() {
+	char * t = read_buffer();
+	auto log = util::trace();
+	log << "Chunked fd " << fd << " : ";
+	for (;;) {
+		auto st = decoder.feed(*in);
+		if (st == chunked_decoder::status::done) {
+			log << "CHUNKS " << decoder.chunk_count() << " WIN";
+			return progress::done;
+		} else if (st == chunked_decoder::status::error) {
+			log << "BAD FRAMING (" << decoder.error() << ") ";
+			return progress::fail;
+		}
+		int res = recv(fd, t, READ_BUFFER_SIZE, MSG_DONTWAIT);
+		log << "L " << res << " ";
+		if (res <= 0) {
+			int eno = errno;
+			log << util::error_text { eno } << " ";
 			errno = 0;
-			return;
-		} else {
-			buf.append(t, t + res);
-			if (positive_check(buf, res, log)) {
-				finish(sock, next_action, log);
-				log << "WIN";
-				return;
+			if (res == -1 && eno == EAGAIN) {
+				log << "WAIT";
+				return progress::wait;
 			}
+			log << (res == 0 ? "EOF" : "FAIL");
+			return progress::fail;
+		}
+		if (!charged(res, log)) {
+			return progress::fail;
 		}
+		in->append(t, t + res);
 	}
 }
 
-void async_load::headers(std::string& buf, dispatch::fd_ref & sock,
-		const dispatch::event_ref & next_action,
-		const dispatch::event_ref & fail_action) {
-	auto internal =
-			[] (const std::string & buf, int last_size, util::logger & log) -> bool {
-				auto find = buf.find("\r\n\r\n",
-						std::max<int>(0, int(buf.size()) - last_size - 3));
-				log << "chk " << (find != buf.npos) << " ";
-				return find != buf.npos;
-			};
-	dispatch::event_ref d(
-			[&buf, &sock, &next_action, &fail_action, internal]() {
-				async_load_generic(buf, sock, next_action, fail_action, internal);
-			});
-
-	dispatch::link(sock, EPOLLIN | EPOLLRDHUP | EPOLLHUP, d);
-	dispatch::arm_manual(d);
-	util::log() << "Headers " << d.id();
+loader::progress loader::send_buffer() {
+	auto log = util::trace();
+	log << "Upload fd " << fd << " : ";
+	while (offset < out->size()) {
+		iovec iov { const_cast<char *>(out->data()) + offset, out->size()
+				- offset };
+		msghdr msg { };
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		bool zero;
+		ssize_t rs = zc.send(msg, iov.iov_len, MSG_DONTWAIT | MSG_NOSIGNAL,
+				zero);
+		log << rs << (zero ? "z " : " ");
+		if (rs > 0) {
+			offset += rs;
+		} else if (rs == -1 && (errno == EAGAIN || errno == EINPROGRESS)) {
+			// EINPROGRESS: fast open SYN went out without data
+			log << "WAIT";
+			errno = 0;
+			zc.reap();
+			return progress::wait;
+		} else {
+			log << "FAIL (" << util::error_text { errno } << ") ";
+			log << errno;
+			errno = 0;
+			return progress::fail;
+		}
+	}
+	zc.reap();
+	if (zc.pending()) {
+		log << "ZEROCOPY " << zc.completions() << "/" << zc.sends();
+		return progress::wait;
+	}
+	log << "WIN";
+	return progress::done;
 }
 
-void async_load::fixed(std::string& buf, dispatch::fd_ref & sock, int length,
+loader::progress loader::send_file() {
+	auto log = util::trace();
+	log << "Upload file fd " << fd << " : ";
+	while (file_offset < file_end) {
+		ssize_t rs = sendfile(fd, file_fd, &file_offset,
+				file_end - file_offset);
+		log << rs << " ";
+		if (rs == -1 && errno == EAGAIN) {
+			log << "WAIT";
+			errno = 0;
+			return progress::wait;
+		} else if (rs <= 0) {
+			log << "FAIL (" << util::error_text { errno } << ") ";
+			errno = 0;
+			return progress::fail;
+		}
+	}
+	log << "WIN";
+	return progress::done;
+}
+
+static void finish(dispatch::fd_ref & sock,
+		const dispatch::event_ref & next_action) {
+	dispatch::unlink_current(sock);
+	dispatch::recycle_event_current();
+	dispatch::arm_manual(next_action);
+	util::trace() << "Ending " << sock;
+}
+
+// runs ld in an event linked to sock until it is done
+static void run(loader ld, dispatch::fd_ref & sock, int epoll_target,
 		const dispatch::event_ref & next_action,
 		const dispatch::event_ref & fail_action) {
-	dispatch::event_ref d(
-			[&buf, &sock, &next_action, &fail_action, length]() mutable {
-				int & xlen = length;
-				async_load_generic(buf, sock, next_action, fail_action,
-						[&xlen] (const std::string &, int last_size, util::logger & log) {
-							xlen -= last_size;
-							log << "l " << xlen << " ";
-							return xlen <= 0;
-						});
-			});
-	dispatch::link(sock, EPOLLIN | EPOLLRDHUP | EPOLLHUP, d);
+	dispatch::event_ref d([ld, &sock, &next_action, &fail_action]() mutable {
+		switch (ld.step()) {
+		case loader::progress::wait:
+			break;
+		case loader::progress::done:
+			finish(sock, next_action);
+			break;
+		case loader::progress::fail:
+			finish(sock, fail_action);
+			break;
+		}
+	});
+	dispatch::link(sock, epoll_target, d);
 	dispatch::arm_manual(d);
 }
 
-std::pair<int, int> get_new_chunk_size(const std::string & sw) {
-	int rs = 0;
-	rs = std::strtol(sw.data(), nullptr, 16);
-	size_t newt = sw.find("\r\n");
-	if (newt == sw.npos) {
-		return {-1, -1};
-	} else {
-		return {rs, (int)newt + 2};
-	}
-}
+constexpr int READABLE = EPOLLIN | EPOLLRDHUP | EPOLLHUP;
 
-void chunked_check(dispatch::fd_ref & sock,
+void async_load::headers(std::string& buf, dispatch::fd_ref & sock,
 		const dispatch::event_ref & next_action,
-		const dispatch::event_ref & fail_action, int & cpos, int & chunkl,
-		bool & length_pending, std::string & buf) {
-	char t[4096];
-	auto log = util::log();
-	log << "Chunked " << sock << " : ";
-	while (true) {
-		if ((cpos >= (int) buf.size()) | length_pending) {
-			int res = recv(sock.fd(), t, sizeof(t), MSG_DONTWAIT);
-			length_pending = false;
-			log << "L " << res << " ";
-			if (res <= 0) {
-				int eno = errno;
-				log << util::error() << " ";
-				if (res == 0) {
-					log << "EOF";
-				} else if (res == -1 && eno == EAGAIN) {
-					log << "WAIT";
-				} else {
-					log << "FAIL";
-					finish(sock, fail_action, log);
-				}
-				errno = 0;
-				return;
-			} else {
-				buf.append(t, t + res);
-			}
-		} else {
-			if (chunkl > 0) {
-				int mn = std::min(chunkl, (int) buf.length() - cpos);
-				cpos += mn;
-				chunkl -= mn;
-				log << "C- " << mn << " ";
-			} else if (chunkl == 0) {
-				std::string sw(buf, cpos, cpos + 64);
-				auto gn = get_new_chunk_size(sw);
-				if (gn.first < 0) {
-					length_pending = true;
-					continue;
-				}
-				log << "CHUNK " << gn.first << " ";
-				cpos += gn.second;
-				chunkl = gn.first > 0 ? gn.first + 2 : -1;
-			} else {
-				if (buf.find("\r\n\r\n", cpos - 3) != buf.npos) {
-					finish(sock, next_action, log);
-					log << "WIN";
-					return;
-				} else {
-					cpos = buf.length();
-				}
-			}
-		}
-	}
+		const dispatch::event_ref & fail_action,
+		std::chrono::steady_clock::time_point * first_byte) {
+	loader ld(sock.fd());
+	ld.start_headers(buf, first_byte);
+	run(ld, sock, READABLE, next_action, fail_action);
+}
 
+void async_load::fixed(std::string& buf, dispatch::fd_ref & sock, int length,
+		const dispatch::event_ref & next_action,
+		const dispatch::event_ref & fail_action) {
+	loader ld(sock.fd());
+	ld.start_fixed(buf, length);
+	run(ld, sock, READABLE, next_action, fail_action);
 }
 
 void async_load::chunked(std::string& buf, dispatch::fd_ref & sock,
 		const dispatch::event_ref & next_action,
 		const dispatch::event_ref & fail_action) {
-	int cpos = buf.find("\r\n\r\n") + 4;
-	int chunkl = 0;
-	bool length_pending = false;
-	dispatch::event_ref d(
-			[ =, &buf, &sock, &next_action, &fail_action]() mutable {
-				chunked_check(sock, next_action, fail_action, cpos, chunkl, length_pending, buf);
-			});
-	dispatch::link(sock, EPOLLIN | EPOLLRDHUP | EPOLLHUP, d);
-	dispatch::arm_manual(d);
+	loader ld(sock.fd());
+	ld.start_chunked(buf);
+	run(ld, sock, READABLE, next_action, fail_action);
+}
+
+void async_load::set_rcvlowat(bool enable) {
+	use_rcvlowat = enable;
 }
 
 void async_load::upload(std::string& buf, dispatch::fd_ref& sock,
 		const dispatch::event_ref& next_action,
 		const dispatch::event_ref& fail_action) {
-	size_t offs = 0;
-	dispatch::event_ref upl(
-			[&, offs]() mutable {
-				auto log = util::log();
-				log << "Upload " << sock << " : ";
-				while(offs < buf.size()) {
-					int rs = send(sock.fd(), buf.c_str() + offs, buf.size() - offs, MSG_DONTWAIT | MSG_NOSIGNAL);
-					log << rs << " ";
-					if(rs > 0) {
-						offs += rs;
-					} else if (rs == -1 && errno == EAGAIN) {
-						log << "WAIT";
-						return;
-					} else {
-						log << "FAIL (";
-						log << strerror(errno) << ") ";
-						log << errno;
-						finish(sock, fail_action, log);
-						return;
-					}
-				}
-				if(offs == buf.size()) {
-					finish(sock, next_action, log);
-					log << "WIN";
-					offs += 100;
-				} else {
-					log << "SECONDCALL";
-				}
-			});
-	dispatch::link(sock, EPOLLOUT | EPOLLRDHUP | EPOLLHUP, upl);
-	dispatch::arm_manual(upl);
+	loader ld(sock.fd());
+	ld.start_upload(buf);
+	run(ld, sock, EPOLLOUT | EPOLLERR | EPOLLRDHUP | EPOLLHUP, next_action,
+			fail_action);
+}
+
+void async_load::upload_file(int file_fd, off_t offset, std::size_t length,
+		dispatch::fd_ref& sock, const dispatch::event_ref& next_action,
+		const dispatch::event_ref& fail_action) {
+	loader ld(sock.fd());
+	ld.start_file(file_fd, offset, length);
+	run(ld, sock, EPOLLOUT | EPOLLRDHUP | EPOLLHUP, next_action, fail_action);
 }
@@ -1,18 +1,85 @@
 #ifndef LOADERS_H_
 #define LOADERS_H_
 
+#include <sys/types.h>
+#include <chrono>
 #include <future>
 #include <string>
 
+#include "chunked.h"
 #include "dispatch.h"
+#include "memory_budget.h"
+#include "zerocopy.h"
 
 namespace async_load {
 
-// all of these assume sock is added to dispatch
+// One transfer at a time on one socket, driven by whoever owns the events:
+// step() moves as much data as the socket takes right now and tells if the
+// transfer is over. It makes no events and links nothing, so an owner with
+// events of its own for the socket can reuse them for every transfer.
+class loader {
+public:
+	enum class progress {
+		wait, done, fail
+	};
 
+	explicit loader(int fd = -1);
+
+	// first_byte, if given, gets the time the first bytes arrived
+	void start_headers(std::string & buf,
+			std::chrono::steady_clock::time_point * first_byte = nullptr);
+	void start_fixed(std::string & buf, int length);
+	// the body follows the head already in buf
+	void start_chunked(std::string & buf);
+	// buf has to stay put until the upload is done
+	void start_upload(const std::string & buf);
+	// sends length bytes of file_fd starting at offset with sendfile()
+	void start_file(int file_fd, off_t offset, std::size_t length);
+
+	// receiving fails once the bytes received can't be charged to mem within
+	// its budgets, mem has to outlive the loader
+	void charge_to(memory_budget::charge * mem);
+	// the last transfer failed for that
+	bool over_budget() const;
+
+	// done and fail end the transfer, later calls wait until the next start
+	progress step();
+
+private:
+	enum kind {
+		IDLE, HEADERS, FIXED, CHUNKED, UPLOAD, FILE
+	};
+	bool complete(int last_size, util::trace_logger & log);
+	bool charged(std::size_t more, util::trace_logger & log);
+	progress receive();
+	progress receive_chunked();
+	progress send_buffer();
+	progress send_file();
+
+	int fd;
+	kind what = IDLE;
+	std::string * in = nullptr;
+	memory_budget::charge * mem = nullptr; // for in
+	bool refused = false;
+	const std::string * out = nullptr;
+	std::chrono::steady_clock::time_point * first_byte = nullptr;
+	int left = 0; // of a fixed length body
+	bool lowat = false; // SO_RCVLOWAT raised
+	chunked_decoder decoder { 0 };
+	std::size_t offset = 0; // of the upload
+	zerocopy::tracker zc;
+	int file_fd = -1;
+	off_t file_offset = 0, file_end = 0;
+};
+
+// Each of these runs a loader in an event of its own, linked to sock until
+// the transfer is over; they all assume sock is added to dispatch
+
+// first_byte, if given, gets the time the first bytes arrived
 void headers(std::string& buf, dispatch::fd_ref & sock,
 		const dispatch::event_ref & next_action,
-		const dispatch::event_ref & fail_action);
+		const dispatch::event_ref & fail_action,
+		std::chrono::steady_clock::time_point * first_byte = nullptr);
 void fixed(std::string& buf, dispatch::fd_ref & sock, int length,
 		const dispatch::event_ref & next_action,
 		const dispatch::event_ref & fail_action);
@@ -22,6 +89,12 @@ void chunked(std::string& buf, dispatch::fd_ref & sock,
 void upload(std::string& buf, dispatch::fd_ref & sock,
 		const dispatch::event_ref & next_action,
 		const dispatch::event_ref & fail_action);
+// let fixed() raise SO_RCVLOWAT towards the remaining body length
+void set_rcvlowat(bool enable);
+// sends length bytes of file_fd starting at offset with sendfile()
+void upload_file(int file_fd, off_t offset, std::size_t length,
+		dispatch::fd_ref & sock, const dispatch::event_ref & next_action,
+		const dispatch::event_ref & fail_action);
 
 }
 ;
@@ -1,245 +1,987 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <future>
 #include <memory>
 #include <string>
+#include <stdexcept>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 #include <signal.h>
+#include <getopt.h>
 
+#include "access_log.h"
+#include "admission.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "capture.h"
+#include "collapse.h"
+#include "coro.h"
+#include "disk_cache.h"
 #include "dispatch.h"
 #include "dns.h"
 #include "http.h"
+#include "listener.h"
 #include "loaders.h"
+#include "memory_budget.h"
+#include "metrics.h"
 #include "relay.h"
+#include "socket_tuning.h"
+#include "topology.h"
+#include "trace.h"
 #include "util.h"
+#include "zerocopy.h"
 
 using std::string;
 
-class proxy_connection: public std::enable_shared_from_this<proxy_connection> {
-	dispatch::fd_ref client_sock, server_sock;
+// answered by the proxy itself instead of being proxied
+constexpr char STATS_PATH[] = "/__proxy/stats";
+
+// status code of a response head, 0 if there is none
+static int status_of(const string & head) {
+	std::size_t sp = head.find(' ');
+	return sp == string::npos ? 0 : atoi(head.c_str() + sp + 1);
+}
+
+// services shared by all connections
+struct proxy_context {
+	const dns_pool & dns;
+	response_cache & cache;
+	disk_cache * disk;
+	request_collapser & collapser;
+	bool splice_tunnels;
+	const socket_tuning::profile & tuning;
+	admission & gate;
+};
+
+static bool is_stats_request(const string & request) {
+	constexpr std::size_t len = sizeof(STATS_PATH) - 1;
+	return request.compare(0, 4, "GET ") == 0
+			&& request.compare(4, len, STATS_PATH) == 0
+			&& (request[4 + len] == ' ' || request[4 + len] == '?');
+}
+
+static string stats_response(proxy_context & ctx) {
+	string body = metrics::render();
+	auto cs = ctx.cache.stats();
+	body += "# TYPE proxy_cache_requests_total counter\n"
+			"proxy_cache_requests_total{result=\"hit\"} "
+			+ std::to_string(cs.hits) + "\n"
+					"proxy_cache_requests_total{result=\"miss\"} "
+			+ std::to_string(cs.misses) + "\n"
+					"# TYPE proxy_cache_bytes gauge\n"
+					"proxy_cache_bytes " + std::to_string(cs.bytes_used)
+			+ "\n";
+	header_parser hp;
+	hp.request() = "HTTP/1.1 200 OK";
+	hp.headers()["Content-Type"] = "text/plain; version=0.0.4";
+	hp.headers()["Content-Length"] = std::to_string(body.size());
+	hp.headers()["Connection"] = "close";
+	return hp.assemble_head() + body;
+}
+
+// One proxied request, whichever front end drives it: what it keeps for the
+// access log, the metrics and the memory budget, the cache tiers and
+// collapsing, and what the heads turn into on the way. The front ends below
+// only move the bytes and decide what runs next.
+class proxy_exchange {
+public:
+	virtual ~proxy_exchange() = default;
+protected:
+	// how the body after a head in buf ends
+	struct body {
+		enum kind_t {
+			none, fixed, chunked, to_eof
+		} kind;
+		long length; // still to come of a fixed one, INT_LEAST32_MAX to eof
+	};
+
 	string buf;
-	std::vector<dispatch::event_ref> event_vec;
-	std::future<int> fut;
 	int relaycount = 0;
-	const dns_pool & dns;
-	// 0 - fail_client
-	// 1 - fail_server
+	proxy_context & ctx;
+	string host, port;
+	// empty unless the response may be stored in cache
+	string cache_key;
+	header_parser cache_request;
+	bool cache_response = false;
+	disk_cache::hit disk_hit;
+	// set while other connections may be waiting for our response
+	bool collapse_leader = false;
+	std::shared_ptr<string> shared_response;
+	std::shared_ptr<capture::flow> flow; // nullptr unless captured
+	access_log::record access;
+	connect_times dns_times;
+	std::size_t head_growth = 0; // bytes the request head gained upstream
+	bool logged = false;
+	metrics::conn_state state = metrics::none;
+	// charged for buf and the relays of a tunnel
+	std::shared_ptr<memory_budget::account> mem = std::make_shared<
+			memory_budget::account>();
+	memory_budget::charge buf_charge { mem.get() };
+	trace::connection live; // for the SIGUSR1 dump
+	admission::ticket admitted;
+
+	proxy_exchange(int client_sock, proxy_context & ctx,
+			admission::ticket admitted) :
+			ctx(ctx), admitted(std::move(admitted)) {
+		access.mark(access_log::accepted);
+		if (access_log::enabled()) {
+			access.client = access_log::peer_of(client_sock);
+		}
+		metrics::add(metrics::connections_total);
+		live.set_fds(client_sock, -1);
+		live.set_account(mem.get());
+		set_state(metrics::reading_request);
+	}
+
+	virtual dispatch::fd_ref & client_ref() = 0;
+	virtual dispatch::fd_ref & server_ref() = 0;
+	// closes the sockets and calls finish()
+	virtual void cleanup() = 0;
+
+	void set_state(metrics::conn_state to) {
+		metrics::move(state, to);
+		state = to;
+		live.set_state(to);
+	}
+	void enter(const char * step) {
+		buf_charge.set(buf.capacity());
+		live.step(step, buf.size());
+	}
+
+	static bool is_tunnel(header_parser & hp) {
+		return hp.request().compare(0, 7, "CONNECT") == 0;
+	}
+
+	// The request head is in buf. Returns the response when the proxy has
+	// one at hand, nullptr if the request goes on; a disk hit leaves its head
+	// in buf and the body in disk_hit.
+	const string * lookup(header_parser & hp) {
+		access.mark(access_log::headers);
+		access.method = hp.request().substr(0, hp.request().find(' '));
+		access.bytes_in = buf.size();
+		if (is_stats_request(hp.request())) {
+			buf = stats_response(ctx);
+			access.served = "stats";
+			return &buf;
+		}
+		host = hp.headers()["Host"];
+		port = "80";
+		std::size_t colon = host.find(':');
+		if (colon != std::string::npos) {
+			port = host.substr(colon + 1, host.length());
+			host = host.substr(0, colon);
+		}
+		flow = capture::open(host, port, is_tunnel(hp));
+		access.host = host;
+
+		cache_key = cache_policy::key_for(hp, host, port);
+		if (cache_key.empty()) {
+			return nullptr;
+		}
+		if (ctx.cache.lookup(cache_key, hp, buf)) {
+			util::debug() << "Cache hit " << cache_key << " for "
+					<< client_ref();
+			access.served = "cache";
+			return &buf;
+		}
+		if (ctx.disk && ctx.disk->lookup(cache_key, hp, disk_hit)) {
+			util::debug() << "Disk cache hit " << cache_key << " for "
+					<< client_ref();
+			buf = disk_hit.head;
+			access.served = "disk";
+			return &buf;
+		}
+		cache_request = hp;
+		return nullptr;
+	}
+
+	// nullptr if we go to the server, as the leader of whoever asks for
+	// cache_key meanwhile; otherwise wake is armed once the leader is done
+	std::shared_ptr<request_collapser::inflight> collapse(
+			const dispatch::event_ref & wake) {
+		auto collapsed = ctx.collapser.attach(cache_key, wake);
+		if (collapsed) {
+			set_state(metrics::waiting_collapsed);
+			util::debug() << "Collapsed " << cache_key << " for "
+					<< client_ref();
+		} else {
+			collapse_leader = true;
+		}
+		return collapsed;
+	}
+	// true if the leader's response suits us, it is in shared_response then
+	bool take_collapsed(const request_collapser::inflight & collapsed) {
+		if (collapsed.matches(cache_request)) {
+			util::debug() << "Serving collapsed response " << cache_key
+					<< " to " << client_ref();
+			shared_response = collapsed.response;
+			access.served = "collapsed";
+			return true;
+		}
+		util::debug() << "Collapsed request " << cache_key << " for "
+				<< client_ref() << " goes to server";
+		return false;
+	}
+
+	void answer_with(const string & response) {
+		set_state(metrics::responding);
+		access.status = status_of(response);
+	}
+
+	// the resolvers are too far behind to take another lookup
+	bool resolvers_behind() const {
+		return ctx.gate.dns_backlogged(ctx.dns.queue_depth());
+	}
+	// Returns true for a CONNECT. Tunnels answer the client once connected,
+	// so only requests send early.
+	bool connecting(header_parser & hp) {
+		set_state(metrics::connecting);
+		access.mark(access_log::dns_queued);
+		return is_tunnel(hp);
+	}
+	// false, with the reason logged, if no server could be reached
+	bool resolved(int server_sock, header_parser & hp) {
+		access.at[access_log::dns_resolved] = dns_times.resolved;
+		access.at[access_log::connected] = dns_times.connected;
+		if (server_sock == -1) {
+			util::log() << "Could not connect to server "
+					<< hp.headers()["Host"];
+			return false;
+		}
+		return true;
+	}
+	// the front end has taken the server socket over
+	void connected(header_parser & hp) {
+		live.set_fds(client_ref().fd(), server_ref().fd());
+		util::log() << hp.request() << " " << client_ref() << " -> "
+				<< server_ref();
+		util::name_fd(server_ref().fd(), hp.headers()["Host"]);
+	}
+
+	// the request head in buf as it goes to the server
+	body rewrite_request() {
+		header_parser hp;
+		hp.set_string(buf);
+		hp.headers()["Connection"] = "close";
+		std::size_t before = buf.size();
+		buf = hp.assemble_head() + hp.excess();
+		head_growth = buf.size() - before;
+		return body_of(hp, false);
+	}
+	void request_loaded() {
+		access.bytes_in = buf.size() - head_growth;
+		if (flow) {
+			flow->record(capture::direction::to_server, buf.data(),
+					buf.size());
+		}
+	}
+	void request_sent() {
+		access.mark(access_log::uploaded);
+		set_state(metrics::reading_response);
+		buf.clear();
+	}
+
+	// the response head in buf as it goes to the client
+	body rewrite_response() {
+		util::debug() << "Got response from server at " << server_ref();
+		header_parser hp;
+		hp.set_string(buf);
+		access.status = status_of(hp.request());
+		hp.headers()["Connection"] = "close";
+		buf = hp.assemble_head() + hp.excess();
+		body b = body_of(hp, true);
+		cache_response = !cache_key.empty() && b.kind != body::to_eof;
+		// collapsed followers only wait for small bodies of known length
+		if (collapse_leader && (b.kind != body::fixed
+				|| b.length > request_collapser::MAX_BODY)) {
+			ctx.collapser.abandon(cache_key);
+			collapse_leader = false;
+		}
+		return b;
+	}
+	// the response to send, once the caches and followers have it
+	const string & response_loaded() {
+		access.mark(access_log::response_done);
+		set_state(metrics::responding);
+		if (cache_response) {
+			store_response();
+		}
+		const string & response = shared_response ? *shared_response : buf;
+		if (flow) {
+			flow->record(capture::direction::to_client, response.data(),
+					response.size());
+		}
+		return response;
+	}
+	void response_sent(std::size_t head_bytes, bool file_sent) {
+		util::debug() << "Uploaded response to " << client_ref();
+		access.bytes_out = head_bytes;
+		if (file_sent) {
+			access.bytes_out += disk_hit.body_length;
+			disk_hit.segment.reset();
+		}
+	}
+
+	// the front end must have let go of both sockets, the relays take them
+	// over
+	void start_tunnel(std::shared_ptr<proxy_exchange> thisptr) {
+		header_parser hp;
+		hp.request() = "HTTP/1.1 200 Connection established";
+		hp.headers()["Proxy-agent"] = "mylittleproxy 0.1";
+		std::string newbuf = hp.assemble_head();
+		access.served = "tunnel";
+		access.status = 200;
+		set_state(metrics::tunneling);
+		auto fin = [thisptr]() -> void {
+			thisptr->relaycount--;
+			if(thisptr->relaycount == 0) {
+				thisptr->cleanup();
+			}
+		};
+		relaycount = 2;
+		std::string empty;
+		// captured tunnels have to pass through user space
+		if (ctx.splice_tunnels && !flow) {
+			make_splice_relay(client_ref(), server_ref(), empty, fin, mem);
+			make_splice_relay(server_ref(), client_ref(), newbuf, fin, mem);
+		} else {
+			make_relay(client_ref(), server_ref(), empty, fin, flow,
+					capture::direction::to_server, mem);
+			make_relay(server_ref(), client_ref(), newbuf, fin, flow,
+					capture::direction::to_client, mem);
+		}
+		util::debug() << "Started http tunnel between " << client_ref()
+				<< " and " << server_ref().fd();
+	}
+
+	void fail_loading_client() {
+		enter(__func__);
+		util::log() << "Failed loading client fd " << client_ref();
+		cleanup();
+	}
+	// 502 once connected, 504 if the server was never reached
+	string gateway_error() {
+		header_parser hp;
+		if (server_ref().fd() > 0) {
+			hp.request() = "HTTP/1.1 502 Bad Gateway";
+		} else {
+			hp.request() = "HTTP/1.1 504 Gateway Timeout";
+		}
+		util::log() << "Failed connection to server " << server_ref()
+				<< " with client fd " << client_ref();
+		return hp.assemble_head();
+	}
+	const string & shed() {
+		metrics::add(metrics::shed_requests);
+		util::debug() << "Shedding request of " << client_ref();
+		return admission::refusal();
+	}
+	// buf holds the error response from now on
+	void error_response(const string & response) {
+		buf = response;
+		answer_with(buf);
+	}
+	void error_sent() {
+		access.bytes_out = buf.size();
+		cleanup();
+	}
+
+	// what cleanup() leaves once the sockets are closed
+	void finish() {
+		if (!logged) {
+			access.mark(access_log::cleanup);
+			access_log::write(access);
+			logged = true;
+		}
+		set_state(metrics::none);
+		admitted.release();
+		if (collapse_leader) {
+			ctx.collapser.abandon(cache_key);
+			collapse_leader = false;
+		}
+		shared_response.reset();
+		flow.reset();
+		buf = std::string();
+		buf_charge.set(0);
+		mem->close();
+	}
+private:
+	static body body_of(header_parser & hp, bool until_eof) {
+		if (hp.headers().count("Transfer-Encoding")
+				&& hp.headers()["Transfer-Encoding"].find("chunked")
+						!= std::string::npos) {
+			return {body::chunked, 0};
+		}
+		if (hp.headers().count("Content-Length")) {
+			return {body::fixed, stol(hp.headers()["Content-Length"])
+					- static_cast<long>(hp.excess().length())};
+		}
+		if (until_eof) {
+			return {body::to_eof, INT_LEAST32_MAX};
+		}
+		return {body::none, 0};
+	}
+
+	void store_response() {
+		auto policy = cache_policy::evaluate(buf);
+		if (!ctx.cache.store(cache_key, cache_request, policy, buf)
+				&& ctx.disk) {
+			ctx.disk->store(cache_key, cache_request, policy, buf);
+		}
+		if (collapse_leader) {
+			shared_response = std::make_shared<string>(std::move(buf));
+			buf.clear();
+			ctx.collapser.complete(cache_key, shared_response, policy,
+					cache_request);
+			collapse_leader = false;
+		}
+	}
+};
+
+#if defined(PROXY_COROUTINES)
+
+// The connection as a coroutine: every step of a request is a co_await in
+// run() and what the steps hand each other lives in its frame
+class proxy_connection: public proxy_exchange,
+		public std::enable_shared_from_this<proxy_connection> {
+	coro::socket client, server;
+public:
+	proxy_connection(int client_sock, proxy_context & ctx,
+			admission::ticket admitted) :
+			proxy_exchange(client_sock, ctx, std::move(admitted)) {
+		client.charge_to(&buf_charge);
+		server.charge_to(&buf_charge);
+		client.open(client_sock);
+	}
+	void start() {
+		run(shared_from_this());
+	}
+private:
+	dispatch::fd_ref & client_ref() override {
+		return client.ref();
+	}
+	dispatch::fd_ref & server_ref() override {
+		return server.ref();
+	}
+
+	// self is never read, holding it in the frame keeps the connection alive
+	// until the request is over
+	coro::task run([[maybe_unused]] std::shared_ptr<proxy_connection> self) {
+		enter("load_request_headers");
+		util::name_fd(client.fd(), string("client") + std::to_string(client.fd()));
+		util::debug() << "Start loading request headers on socket "
+				<< client.ref();
+		if (!co_await client.read_headers(buf)) {
+			fail_loading_client();
+			co_return;
+		}
+		enter("process_request_headers");
+		header_parser hp;
+		hp.set_string(buf);
+		const string * response = lookup(hp);
+
+		if (!response && !cache_key.empty()) {
+			coro::signal wake;
+			if (auto collapsed = collapse(wake.event())) {
+				co_await wake;
+				enter("process_collapsed_response");
+				if (take_collapsed(*collapsed)) {
+					response = shared_response.get();
+				} else {
+					hp = cache_request;
+				}
+			}
+		}
+
+		if (response) {
+			answer_with(*response);
+		} else {
+			if (resolvers_behind()) {
+				co_await shed_request();
+				error_sent();
+				co_return;
+			}
+			enter("connect_to_server");
+			bool tunnel = connecting(hp);
+			int ssock = co_await coro::connect(ctx.dns, host, port, !tunnel,
+					&dns_times);
+			enter("process_request_headers_2");
+			if (!resolved(ssock, hp)) {
+				co_await fail_connecting_to_server();
+				error_sent();
+				co_return;
+			}
+			server.open(ssock);
+			connected(hp);
+			if (tunnel) {
+				start_connect_tunnel();
+				co_return;
+			}
+
+			enter("upload_request_to_server");
+			set_state(metrics::uploading);
+			body in = rewrite_request();
+			bool ok = true;
+			if (in.kind == body::chunked) {
+				ok = co_await client.read_chunked(buf);
+			} else if (in.kind == body::fixed) {
+				ok = co_await client.read_fixed(buf, in.length);
+			}
+			if (ok) {
+				enter("upload_request_to_server_2");
+				request_loaded();
+				ok = co_await server.write_all(buf);
+			}
+			if (!ok) {
+				co_await fail_connecting_to_server();
+				error_sent();
+				co_return;
+			}
+
+			enter("upload_request_to_server_3");
+			request_sent();
+			if (!co_await server.read_headers(buf,
+					&access.at[access_log::first_byte])) {
+				co_await fail_connecting_to_server();
+				error_sent();
+				co_return;
+			}
+
+			enter("process_response_headers");
+			body out = rewrite_response();
+			if (out.kind == body::chunked) {
+				ok = co_await server.read_chunked(buf);
+			} else {
+				// a body to eof is pumped until the server closes
+				ok = co_await server.read_fixed(buf, out.length)
+						|| (out.kind == body::to_eof && !server.over_budget());
+			}
+			if (!ok) {
+				co_await fail_connecting_to_server();
+				error_sent();
+				co_return;
+			}
+
+			enter("process_response_headers_2");
+			response = &response_loaded();
+		}
+
+		enter("send_response");
+		bool sent = co_await client.write_all(*response);
+		bool file_sent = false;
+		if (sent && disk_hit.segment) {
+			enter("send_file");
+			sent = co_await client.send_file(disk_hit.segment->fd,
+					disk_hit.body_offset, disk_hit.body_length);
+			file_sent = true;
+		}
+		if (!sent) {
+			fail_loading_client();
+			co_return;
+		}
+		response_sent(response->size(), file_sent);
+		cleanup();
+	}
+
+	void start_connect_tunnel() {
+		enter(__func__);
+		client.detach();
+		server.detach();
+		start_tunnel(shared_from_this());
+	}
+
+	coro::transfer fail_connecting_to_server() {
+		enter(__func__);
+		return send_error(gateway_error());
+	}
+	coro::transfer shed_request() {
+		enter(__func__);
+		return send_error(shed());
+	}
+	coro::transfer send_error(const string & response) {
+		error_response(response);
+		return client.write_all(buf);
+	}
+	void cleanup() override {
+		enter(__func__);
+		client.close();
+		server.close();
+		finish();
+	}
+};
+
+#else
+
+class proxy_connection: public proxy_exchange,
+		public std::enable_shared_from_this<proxy_connection> {
+	// the events of a connection, made once in start() and reused by every
+	// step
+	enum slot {
+		CLIENT_READABLE,
+		CLIENT_WRITABLE,
+		SERVER_READABLE,
+		SERVER_WRITABLE,
+		RESOLVED, // armed by the DNS pool or a collapsed request
+		SLOTS,
+		NO_SLOT = SLOTS
+	};
+	// what the connection is doing and the slot it waits on
+	enum phase {
+		READING_REQUEST, // client readable
+		WAITING_COLLAPSED, // resolved
+		CONNECTING, // resolved
+		READING_REQUEST_BODY, // client readable
+		SENDING_REQUEST, // server writable
+		READING_RESPONSE, // server readable
+		READING_RESPONSE_BODY, // server readable
+		SENDING_RESPONSE, // client writable
+		SENDING_HEAD, // client writable, the body follows from disk
+		SENDING_FILE, // client writable
+		SENDING_ERROR, // client writable
+		TUNNELING, // the relays have events of their own
+		DONE
+	};
+	static constexpr int READABLE = EPOLLIN | EPOLLRDHUP | EPOLLHUP;
+	static constexpr int WRITABLE = EPOLLOUT | EPOLLERR | EPOLLRDHUP | EPOLLHUP;
+
+	dispatch::fd_ref client_sock, server_sock;
+	dispatch::event_ref events[SLOTS];
+	phase at = READING_REQUEST;
+	slot waiting = NO_SLOT;
+	bool client_linked = false, server_linked = false;
+	async_load::loader client_io, server_io;
+	const string * response = nullptr; // being sent to the client
+	bool to_eof = false; // the response body ends when the server closes
+	std::future<int> fut;
+	header_parser request_head; // as it goes to the server
+	std::shared_ptr<request_collapser::inflight> collapsed;
 public:
-	proxy_connection(int client_sock, const dns_pool & p) :
-			client_sock(client_sock,
-			EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET), dns(p) {
+	proxy_connection(int client_sock, proxy_context & ctx,
+			admission::ticket admitted) :
+			proxy_exchange(client_sock, ctx, std::move(admitted)), client_sock(
+					client_sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET), client_io(
+					client_sock) {
+		client_io.charge_to(&buf_charge);
 	}
 	void start() {
+		auto thisptr = shared_from_this();
+		for (int s = 0; s < SLOTS; s++) {
+			events[s] = dispatch::event_ref(
+					std::bind(&proxy_connection::advance, thisptr, slot(s)));
+		}
+		dispatch::link(client_sock, READABLE, events[CLIENT_READABLE]);
+		dispatch::link(client_sock, WRITABLE, events[CLIENT_WRITABLE]);
+		client_linked = true;
 		load_request_headers();
 	}
 private:
+	dispatch::fd_ref & client_ref() override {
+		return client_sock;
+	}
+	dispatch::fd_ref & server_ref() override {
+		return server_sock;
+	}
+	// Every event of the connection ends up here, only the one the current
+	// phase waits on moves it along
+	void advance(slot s) {
+		if (s != waiting) {
+			return;
+		}
+		if (at == WAITING_COLLAPSED) {
+			waiting = NO_SLOT;
+			process_collapsed_response();
+		} else if (at == CONNECTING) {
+			waiting = NO_SLOT;
+			process_request_headers_2();
+		} else {
+			pump();
+		}
+	}
+	void await(phase p, slot s) {
+		at = p;
+		waiting = s;
+		// the events are edge triggered, so whatever the socket has or takes
+		// already has to be moved now
+		if (s != RESOLVED) {
+			pump();
+		}
+	}
+	void pump() {
+		auto & io = waiting == SERVER_READABLE || waiting == SERVER_WRITABLE ?
+				server_io : client_io;
+		auto p = io.step();
+		if (p == async_load::loader::progress::wait) {
+			return;
+		}
+		waiting = NO_SLOT;
+		loaded(p == async_load::loader::progress::done);
+	}
+	// the transfer of the current phase is over
+	void loaded(bool ok) {
+		switch (at) {
+		case READING_REQUEST:
+			if (ok) {
+				process_request_headers();
+			} else {
+				fail_loading_client();
+			}
+			break;
+		case READING_REQUEST_BODY:
+			if (ok) {
+				upload_request_to_server_2();
+			} else {
+				fail_connecting_to_server();
+			}
+			break;
+		case SENDING_REQUEST:
+			if (ok) {
+				upload_request_to_server_3();
+			} else {
+				fail_connecting_to_server();
+			}
+			break;
+		case READING_RESPONSE:
+			if (ok) {
+				process_response_headers();
+			} else {
+				fail_connecting_to_server();
+			}
+			break;
+		case READING_RESPONSE_BODY:
+			if (ok || (to_eof && !server_io.over_budget())) {
+				process_response_headers_2();
+			} else {
+				fail_connecting_to_server();
+			}
+			break;
+		case SENDING_RESPONSE:
+		case SENDING_FILE:
+			if (ok) {
+				enter("response_sent");
+				response_sent(response->size(), at == SENDING_FILE);
+				cleanup();
+			} else {
+				fail_loading_client();
+			}
+			break;
+		case SENDING_HEAD:
+			if (ok) {
+				send_file();
+			} else {
+				fail_loading_client();
+			}
+			break;
+		case SENDING_ERROR:
+			error_sent();
+			break;
+		default:
+			break;
+		}
+	}
+	void unlink_events() {
+		if (client_linked) {
+			dispatch::unlink(client_sock, events[CLIENT_READABLE]);
+			dispatch::unlink(client_sock, events[CLIENT_WRITABLE]);
+			client_linked = false;
+		}
+		if (server_linked) {
+			dispatch::unlink(server_sock, events[SERVER_READABLE]);
+			dispatch::unlink(server_sock, events[SERVER_WRITABLE]);
+			server_linked = false;
+		}
+	}
 	void load_request_headers() {
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::fail_loading_client,
-						shared_from_this()));
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::fail_connecting_to_server,
-						shared_from_this()));
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::process_request_headers,
-						shared_from_this()));
+		enter(__func__);
 		util::name_fd(client_sock.fd(),
 				string("client") + std::to_string(client_sock.fd()));
-		util::log() << "Start loading request headers on socket "
+		util::debug() << "Start loading request headers on socket "
 				<< client_sock;
-		async_load::headers(buf, client_sock, event_vec.back(), event_vec[0]);
+		client_io.start_headers(buf);
+		await(READING_REQUEST, CLIENT_READABLE);
 	}
 	void process_request_headers() {
+		enter(__func__);
 //		log << "Got headers on socket " << client_sock << "\n";
 		header_parser hp;
 		hp.set_string(buf);
-		std::string host = hp.headers()["Host"];
-		std::string port = "80";
-		std::size_t colon = host.find(':');
-		if (colon != std::string::npos) {
-			port = host.substr(colon + 1, host.length());
-			host = host.substr(0, colon);
+		if (const string * r = lookup(hp)) {
+			if (disk_hit.segment) {
+				serve_from_disk();
+			} else {
+				serve_from_cache(*r);
+			}
+			return;
+		}
+		if (!cache_key.empty()) {
+			collapsed = collapse(events[RESOLVED]);
+			if (collapsed) {
+				await(WAITING_COLLAPSED, RESOLVED);
+				return;
+			}
+		}
+		connect_to_server(hp);
+	}
+	void process_collapsed_response() {
+		enter(__func__);
+		if (take_collapsed(*collapsed)) {
+			serve_from_cache(*shared_response);
+		} else {
+			connect_to_server(cache_request);
+		}
+		collapsed.reset();
+	}
+	void connect_to_server(header_parser & hp) {
+		enter(__func__);
+		if (resolvers_behind()) {
+			shed_request();
+			return;
 		}
-		std::ofstream os(std::string("log/") + "->" + host + ":" + port,
-				std::ios::out | std::ios::binary | std::ios::ate);
-		os << "\nNEW CONNECTION\n";
-		os << buf;
-		os.flush();
 //		log << "Connecting to server " << host << ":" << port << "\n";
 
-		event_vec.push_back(dispatch::event_ref());
-
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::process_request_headers_2,
-						shared_from_this(), hp));
-
-		fut = dns.connect_to_remote_server(host, port, event_vec.back());
+		bool tunnel = connecting(hp);
+		request_head = hp;
+		await(CONNECTING, RESOLVED);
+		fut = ctx.dns.connect_to_remote_server(host, port, events[RESOLVED],
+				!tunnel, &dns_times);
 	}
-	void process_request_headers_2(header_parser hp) {
+	void process_request_headers_2() {
+		enter(__func__);
 		int ssock = fut.get();
-		if (ssock == -1) {
-			util::log() << "Could not connect to server "
-					<< hp.headers()["Host"];
-			dispatch::arm_manual(event_vec[1]);
+		if (!resolved(ssock, request_head)) {
+			fail_connecting_to_server();
 			return;
 		}
 		server_sock = dispatch::fd_ref(ssock,
 		EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
-		util::log() << hp.request() << " " << client_sock << " -> "
-				<< server_sock;
-		util::name_fd(server_sock.fd(), hp.headers()["Host"]);
+		server_io = async_load::loader(ssock);
+		server_io.charge_to(&buf_charge);
+		dispatch::link(server_sock, READABLE, events[SERVER_READABLE]);
+		dispatch::link(server_sock, WRITABLE, events[SERVER_WRITABLE]);
+		server_linked = true;
+		connected(request_head);
 //		log << "Connected to server " << host << ":" << port << " at socket "
 //				<< server_sock << "\n";
-		if (hp.request().compare(0, 7, "CONNECT") == 0) {
+		if (is_tunnel(request_head)) {
 			start_connect_tunnel();
 		} else {
+			set_state(metrics::uploading);
 			upload_request_to_server();
 		}
 	}
 	void upload_request_to_server() {
-		header_parser hp;
-		hp.set_string(buf);
-		hp.headers()["Connection"] = "close";
-		buf = hp.assemble_head() + hp.excess();
-
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::upload_request_to_server_2,
-						shared_from_this()));
-
-		if (hp.headers().count("Transfer-Encoding")
-				&& hp.headers()["Transfer-Encoding"].find("chunked")
-						!= std::string::npos) {
-			// chunked
-
-			async_load::chunked(buf, client_sock, event_vec.back(),
-					event_vec[1]);
-		} else if (hp.headers().count("Content-Length")) {
-			async_load::fixed(buf, client_sock,
-					stol(hp.headers()["Content-Length"]) - hp.excess().length(),
-					event_vec.back(), event_vec[1]);
-			// body
+		enter(__func__);
+		body in = rewrite_request();
+		if (in.kind == body::chunked) {
+			client_io.start_chunked(buf);
+		} else if (in.kind == body::fixed) {
+			client_io.start_fixed(buf, in.length);
 		} else {
 			upload_request_to_server_2();
 			return;
 		}
+		await(READING_REQUEST_BODY, CLIENT_READABLE);
 	}
 	void upload_request_to_server_2() {
-
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::upload_request_to_server_3,
-						shared_from_this()));
-
-		async_load::upload(buf, server_sock, event_vec.back(), event_vec[1]);
+		enter(__func__);
+		request_loaded();
+		server_io.start_upload(buf);
+		await(SENDING_REQUEST, SERVER_WRITABLE);
 	}
 	void upload_request_to_server_3() {
+		enter(__func__);
 
 //		log << "Uploaded client request from " << client_sock << " to "
 //				<< server_sock << "\n";
-		buf.clear();
-
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::process_response_headers,
-						shared_from_this()));
-		async_load::headers(buf, server_sock, event_vec.back(), event_vec[1]);
+		request_sent();
+		server_io.start_headers(buf, &access.at[access_log::first_byte]);
+		await(READING_RESPONSE, SERVER_READABLE);
 	}
 
 	void process_response_headers() {
-		util::log() << "Got response from server at " << server_sock;
-		header_parser hp;
-		hp.set_string(buf);
-		hp.headers()["Connection"] = "close";
-		buf = hp.assemble_head() + hp.excess();
-
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				std::bind(&proxy_connection::process_response_headers_2,
-						shared_from_this()));
-		if (hp.headers().count("Transfer-Encoding")
-				&& hp.headers()["Transfer-Encoding"].find("chunked")
-						!= std::string::npos) {
-			// chunked
-
-			async_load::chunked(buf, server_sock, event_vec.back(),
-					event_vec[1]);
-		} else if (hp.headers().count("Content-Length")) {
-			// fixed length body
-			async_load::fixed(buf, server_sock,
-					stol(hp.headers()["Content-Length"]) - hp.excess().length(),
-					event_vec.back(), event_vec[1]);
+		enter(__func__);
+		body out = rewrite_response();
+		if (out.kind == body::chunked) {
+			server_io.start_chunked(buf);
 		} else {
-			async_load::fixed(buf, server_sock,
-			INT_LEAST32_MAX, event_vec.back(), event_vec.back());
-			// pump until ends
+			// a body to eof is pumped until the server closes
+			to_eof = out.kind == body::to_eof;
+			server_io.start_fixed(buf, out.length);
 		}
-
+		await(READING_RESPONSE_BODY, SERVER_READABLE);
 	}
+
 	void process_response_headers_2() {
+		enter(__func__);
 //		log << "Downloaded server response from " << server_sock.fd() << " "
 //				<< buf.length() << " bytes\n";
-		auto thisptr = shared_from_this();
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				[this, thisptr] {
-					util::log() << "Uploaded server response from " << server_sock << " to "
-					<< client_sock;
-					cleanup();
-				});
-		async_load::upload(buf, client_sock, event_vec.back(), event_vec[1]);
+		send_response(response_loaded());
 	}
 
-	void start_connect_tunnel() {
-		header_parser hp;
-		hp.request() = "HTTP/1.1 200 Connection established";
-		hp.headers()["Proxy-agent"] = "mylittleproxy 0.1";
-		std::string newbuf = hp.assemble_head();
-		auto thisptr = shared_from_this();
-		auto fin = [thisptr]() -> void {
-			thisptr->relaycount--;
-			if(thisptr->relaycount == 0) {
-				thisptr->cleanup();
-			}
-		};
-		relaycount = 2;
-		std::string empty;
-		make_relay(client_sock, server_sock, empty, fin);
-		make_relay(server_sock, client_sock, newbuf, fin);
-		util::log() << "Started http tunnel between " << client_sock << " and "
-				<< server_sock.fd();
+	void serve_from_cache(const string & response) {
+		enter(__func__);
+		answer_with(response);
+		send_response(response);
 	}
 
-	void fail_loading_client() {
-		util::log() << "Failed loading client fd " << client_sock;
-		cleanup();
+	void send_response(const string & response) {
+		enter(__func__);
+		this->response = &response;
+		client_io.start_upload(response);
+		await(SENDING_RESPONSE, CLIENT_WRITABLE);
 	}
-	void fail_connecting_to_server() {
-		header_parser hp;
-		if (server_sock.fd() > 0) {
-			hp.request() = "HTTP/1.1 502 Bad Gateway";
-		} else {
-			hp.request() = "HTTP/1.1 504 Gateway Timeout";
-		}
-		util::log() << "Failed connection to server " << server_sock
-				<< " with client fd " << client_sock;
 
-		buf = hp.assemble_head();
+	void serve_from_disk() {
+		enter(__func__);
+		answer_with(buf);
+		response = &buf;
+		client_io.start_upload(buf);
+		await(SENDING_HEAD, CLIENT_WRITABLE);
+	}
 
-		auto thisptr = shared_from_this();
-		auto fin = [thisptr]() -> void {
-			thisptr->cleanup();
-		};
-		event_vec.emplace_back( // @suppress("Ambiguous problem")
-				fin);
+	void send_file() {
+		enter(__func__);
+		client_io.start_file(disk_hit.segment->fd, disk_hit.body_offset,
+				disk_hit.body_length);
+		await(SENDING_FILE, CLIENT_WRITABLE);
+	}
+
+	void start_connect_tunnel() {
+		enter(__func__);
+		unlink_events();
+		at = TUNNELING;
+		start_tunnel(shared_from_this());
+	}
 
-		async_load::upload(buf, client_sock, event_vec.back(),
-				event_vec.back());
+	void fail_connecting_to_server() {
+		enter(__func__);
+		send_error(gateway_error());
+	}
+	void shed_request() {
+		enter(__func__);
+		send_error(shed());
 	}
-	void cleanup() {
+	void send_error(const string & response) {
+		error_response(response);
+		client_io.start_upload(buf);
+		await(SENDING_ERROR, CLIENT_WRITABLE);
+	}
+	void cleanup() override {
+		enter(__func__);
+		at = DONE;
+		waiting = NO_SLOT;
+		// links go before the descriptors, which can't be collected while
+		// they have any
+		unlink_events();
 		if (client_sock.fd() != -1) {
 			int fd = client_sock.fd();
 			client_sock.recycle();
@@ -250,17 +992,308 @@ private:
 			server_sock.recycle();
 			close(fd);
 		}
-		buf = std::string();
-		event_vec.clear();
-	}
-public:
-	~proxy_connection() {
+		finish();
+		// the events hold the last references to the connection
+		for (auto & ev : events) {
+			ev.recycle();
+		}
 	}
 };
 
+#endif
+
+static const option long_options[] = {
+		{ "cache-size", required_argument, nullptr, 'c' },
+		{ "disk-cache", required_argument, nullptr, 'd' },
+		{ "disk-cache-size", required_argument, nullptr, 'D' },
+		{ "no-splice", no_argument, nullptr, 'S' },
+		{ "rcvlowat", no_argument, nullptr, 'L' },
+		{ "zerocopy", required_argument, nullptr, 'z' },
+		{ "backlog", required_argument, nullptr, 'b' },
+		{ "defer-accept", required_argument, nullptr, 'a' },
+		{ "fastopen", required_argument, nullptr, 'o' },
+		{ "accept-batch", required_argument, nullptr, 'B' },
+		{ "workers", required_argument, nullptr, 'w' },
+		{ "pin-cpus", no_argument, nullptr, 'P' },
+		{ "loop-cpus", required_argument, nullptr, 'x' },
+		{ "resolver-cpus", required_argument, nullptr, 'y' },
+		{ "steer-cpu", no_argument, nullptr, 'C' },
+		{ "no-nodelay", no_argument, nullptr, 'N' },
+		{ "keepalive", required_argument, nullptr, 'k' },
+		{ "sndbuf", required_argument, nullptr, 'O' },
+		{ "rcvbuf", required_argument, nullptr, 'I' },
+		{ "notsent-lowat", required_argument, nullptr, 'W' },
+		{ "fastopen-connect", no_argument, nullptr, 'T' },
+		{ "access-log", required_argument, nullptr, 'l' },
+		{ "resolve", required_argument, nullptr, 'r' },
+		{ "capture", required_argument, nullptr, 'p' },
+		{ "capture-host", required_argument, nullptr, 'H' },
+		{ "capture-sample", required_argument, nullptr, 's' },
+		{ "capture-flow-kb", required_argument, nullptr, 'f' },
+		{ "capture-file-mb", required_argument, nullptr, 'F' },
+		{ "max-connections", required_argument, nullptr, 'm' },
+		{ "max-client-connections", required_argument, nullptr, 'M' },
+		{ "client-rate", required_argument, nullptr, 'R' },
+		{ "max-loop-lag", required_argument, nullptr, 'g' },
+		{ "max-dns-queue", required_argument, nullptr, 'q' },
+		{ "memory-budget", required_argument, nullptr, 'u' },
+		{ "connection-memory", required_argument, nullptr, 'U' },
+		{ nullptr, 0, nullptr, 0 } };
+
 int main(int argc, char** argv) {
+	long cache_mb = 64;
+	long disk_cache_mb = 1024;
+	const char * disk_cache_dir = nullptr;
+	bool splice_tunnels = true;
+	capture::config capture_cfg;
+	const char * access_log_path = nullptr;
+	listener_options listen_opts;
+	std::vector<int> loop_cpus, resolver_cpus;
+	int workers = 1;
+	bool pin_cpus = false, steer_cpu = false;
+	socket_tuning::profile tuning;
+	std::vector<std::pair<string, string>> pinned_hosts;
+	admission_limits limits;
+	std::size_t memory_mb = 0, connection_memory_kb = 0;
+	limits.max_connections = -1; // from the descriptor limit unless given
+	for (int opt; (opt = getopt_long(argc, argv, "", long_options, nullptr))
+			!= -1;) {
+		switch (opt) {
+		case 'c':
+			cache_mb = atol(optarg);
+			if (cache_mb < 0) {
+				printf("Invalid cache size %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'd':
+			disk_cache_dir = optarg;
+			break;
+		case 'D':
+			disk_cache_mb = atol(optarg);
+			if (disk_cache_mb < 1) {
+				printf("Invalid disk cache size %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'S':
+			splice_tunnels = false;
+			break;
+		case 'L':
+			async_load::set_rcvlowat(true);
+			break;
+		case 'z':
+			if (atol(optarg) < 1) {
+				printf("Invalid zerocopy threshold %s", optarg);
+				exit(0);
+			}
+			zerocopy::set_threshold(atol(optarg) << 10);
+			break;
+		case 'b':
+			listen_opts.backlog = atoi(optarg);
+			if (listen_opts.backlog < 1) {
+				printf("Invalid backlog %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'a':
+			listen_opts.defer_accept = atoi(optarg);
+			break;
+		case 'o':
+			listen_opts.fastopen = atoi(optarg);
+			break;
+		case 'B':
+			listen_opts.accept_batch = atoi(optarg);
+			if (listen_opts.accept_batch < 1) {
+				printf("Invalid accept batch %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > 64) {
+				printf("Invalid amount of workers %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'P':
+			pin_cpus = true;
+			break;
+		case 'x':
+			loop_cpus = topology::parse_cpus(optarg);
+			if (loop_cpus.empty()) {
+				printf("Invalid loop CPUs %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'y':
+			resolver_cpus = topology::parse_cpus(optarg);
+			if (resolver_cpus.empty()) {
+				printf("Invalid resolver CPUs %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'C':
+			steer_cpu = true;
+			break;
+		case 'N':
+			tuning.nodelay = false;
+			break;
+		case 'k':
+			tuning.keepalive_idle = atoi(optarg);
+			if (tuning.keepalive_idle < 0) {
+				printf("Invalid keepalive time %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'O':
+			if (atoi(optarg) < 1) {
+				printf("Invalid send buffer size %s", optarg);
+				exit(0);
+			}
+			tuning.sndbuf = atoi(optarg) << 10;
+			break;
+		case 'I':
+			if (atoi(optarg) < 1) {
+				printf("Invalid receive buffer size %s", optarg);
+				exit(0);
+			}
+			tuning.rcvbuf = atoi(optarg) << 10;
+			break;
+		case 'W':
+			if (atoi(optarg) < 1) {
+				printf("Invalid unsent low watermark %s", optarg);
+				exit(0);
+			}
+			socket_tuning::set_relay_lowat(atoi(optarg) << 10);
+			break;
+		case 'T':
+			tuning.fastopen_connect = true;
+			break;
+		case 'l':
+			access_log_path = optarg;
+			break;
+		case 'r': {
+			const char * eq = strchr(optarg, '=');
+			if (!eq || eq == optarg || !eq[1]) {
+				printf("Invalid host pin %s", optarg);
+				exit(0);
+			}
+			pinned_hosts.emplace_back(string(optarg, eq - optarg),
+					string(eq + 1));
+			break;
+		}
+		case 'p':
+			capture_cfg.dir = optarg;
+			break;
+		case 'H':
+			capture_cfg.hosts.push_back(optarg);
+			break;
+		case 's':
+			capture_cfg.sample_one_in = atoi(optarg);
+			if (capture_cfg.sample_one_in < 1) {
+				printf("Invalid capture sampling %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'f':
+			if (atol(optarg) < 0) {
+				printf("Invalid capture flow size %s", optarg);
+				exit(0);
+			}
+			capture_cfg.flow_bytes = atol(optarg) << 10;
+			break;
+		case 'F':
+			if (atol(optarg) < 1) {
+				printf("Invalid capture file size %s", optarg);
+				exit(0);
+			}
+			capture_cfg.file_bytes = atol(optarg) << 20;
+			break;
+		case 'm':
+			limits.max_connections = atoi(optarg);
+			if (limits.max_connections < 0) {
+				printf("Invalid connection limit %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'M':
+			limits.max_client_connections = atoi(optarg);
+			if (limits.max_client_connections < 0) {
+				printf("Invalid client connection limit %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'R': {
+			// RATE or RATE/BURST
+			char * end;
+			limits.client_rate = strtod(optarg, &end);
+			if (*end == '/') {
+				limits.client_burst = strtod(end + 1, &end);
+			}
+			if (*end || limits.client_rate < 0 || limits.client_burst < 0) {
+				printf("Invalid client rate %s", optarg);
+				exit(0);
+			}
+			break;
+		}
+		case 'g':
+			limits.max_loop_lag_ms = atoi(optarg);
+			if (limits.max_loop_lag_ms < 0) {
+				printf("Invalid loop lag %s", optarg);
+				exit(0);
+			}
+			break;
+		case 'q':
+			if (atol(optarg) < 0) {
+				printf("Invalid DNS queue limit %s", optarg);
+				exit(0);
+			}
+			limits.max_dns_queue = atol(optarg);
+			break;
+		case 'u':
+			if (atol(optarg) < 1) {
+				printf("Invalid memory budget %s", optarg);
+				exit(0);
+			}
+			memory_mb = atol(optarg);
+			break;
+		case 'U':
+			if (atol(optarg) < 1) {
+				printf("Invalid connection memory budget %s", optarg);
+				exit(0);
+			}
+			connection_memory_kb = atol(optarg);
+			break;
+		default:
+			exit(0);
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
+	if (limits.max_connections == -1) {
+		limits.max_connections = connections_for_fd_limit();
+	}
+
 	if (argc <= 1) {
-		printf("Usage: proxy port (dns_threads)\n");
+		printf("Usage: proxy [--cache-size=MB] [--disk-cache=DIR] "
+				"[--disk-cache-size=MB] [--no-splice] [--rcvlowat]\n"
+				"       [--zerocopy=KB] [--backlog=N] [--defer-accept=SECONDS]\n"
+				"       [--fastopen=QUEUE] [--accept-batch=N] [--workers=N] "
+				"[--pin-cpus]\n"
+				"       [--loop-cpus=LIST] [--resolver-cpus=LIST]\n"
+				"       [--steer-cpu] [--no-nodelay] [--keepalive=SECONDS] "
+				"[--sndbuf=KB]\n"
+				"       [--rcvbuf=KB] [--notsent-lowat=KB] [--fastopen-connect]\n"
+				"       [--access-log=FILE] [--resolve=HOST=ADDRESS]...\n"
+				"       [--max-connections=N] [--max-client-connections=N]\n"
+				"       [--client-rate=PER_SECOND[/BURST]] [--max-loop-lag=MS]\n"
+				"       [--max-dns-queue=N] [--memory-budget=MB] "
+				"[--connection-memory=KB]\n"
+				"       [--capture=DIR [--capture-host=HOST]... "
+				"[--capture-sample=N]\n"
+				"        [--capture-flow-kb=KB] [--capture-file-mb=MB]] "
+				"port (dns_threads)\n");
 		exit(0);
 	}
 	int port = atoi(argv[1]);
@@ -268,13 +1301,6 @@ int main(int argc, char** argv) {
 		printf("Invalid port number %s", argv[1]);
 		exit(0);
 	}
-	int accept_fd = socket(AF_INET, SOCK_STREAM, 0);
-
-	if (accept_fd == -1) {
-		printf("Unable to open socket");
-		exit(0);
-	}
-
 	int dns_threads = 0;
 	if (argc > 2) {
 		dns_threads = atoi(argv[2]);
@@ -286,57 +1312,178 @@ int main(int argc, char** argv) {
 		dns_threads = 3;
 	}
 
-	int incr = 1;
-	int reuseaddr = setsockopt(accept_fd, SOL_SOCKET, SO_REUSEADDR, &incr,
-			sizeof(incr));
-	int reuseport = setsockopt(accept_fd, SOL_SOCKET, SO_REUSEPORT, &incr,
-			sizeof(incr));
-
-	if (reuseaddr == -1 || reuseport == -1) {
-		printf("Unable to set socket options");
-		exit(0);
-	}
-
-	struct sockaddr_in srv_addr;
-	srv_addr.sin_family = AF_INET;
-	srv_addr.sin_addr.s_addr = INADDR_ANY;
-	srv_addr.sin_port = htons((short) port);
-	if (bind(accept_fd, (sockaddr *) &srv_addr, sizeof(srv_addr)) == -1) {
-		printf("Unable to bind accepting socket to port %d", port);
-		exit(0);
-	}
-	if (listen(accept_fd, 10) == -1) {
-		printf("Unable to listen on port %d", port);
+	// one listener per worker, all in one SO_REUSEPORT group
+	std::vector<int> accept_fds;
+	try {
+		for (int i = 0; i < workers; i++) {
+			accept_fds.push_back(open_listener(port, listen_opts));
+		}
+	} catch (std::runtime_error & e) {
+		printf("%s", e.what());
 		exit(0);
 	}
-
 	sigset_t sigmask;
 	sigemptyset(&sigmask);
 	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGUSR2);
 	pthread_sigmask(SIG_BLOCK, &sigmask, nullptr);
 
-	dns_pool dns(dns_threads);
+	// SIGUSR1 lists live connections, SIGUSR2 switches trace probes on and
+	// off
+	std::atomic<bool> stopping { false };
+	std::thread signal_thread([&stopping] {
+		sigset_t usr;
+		sigemptyset(&usr);
+		sigaddset(&usr, SIGUSR1);
+		sigaddset(&usr, SIGUSR2);
+		for (int sig; sigwait(&usr, &sig) == 0 && !stopping;) {
+			if (sig == SIGUSR2) {
+				trace::set_enabled(!trace::enabled());
+				util::log() << "Trace probes "
+						<< (trace::enabled() ? "on" : "off");
+				continue;
+			}
+			string conns = trace::dump();
+			util::log() << "Live connections:";
+			for (std::size_t pos = 0, end; pos < conns.size(); pos = end + 1) {
+				end = conns.find('\n', pos);
+				util::log() << "  " << conns.substr(pos, end - pos);
+			}
+		}
+	});
 
-	dispatch::fd_ref acceptor(accept_fd, EPOLLIN);
+	// Loop i runs on loop_cpus[i % size]. Resolvers block in getaddrinfo()
+	// and connect(), so unless told otherwise they keep off the CPUs of the
+	// loops while there are others.
+	if (pin_cpus && loop_cpus.empty()) {
+		loop_cpus = topology::online_cpus();
+	}
+	std::vector<int> used_loop_cpus;
+	for (int i = 0; i < workers && i < int(loop_cpus.size()); i++) {
+		used_loop_cpus.push_back(loop_cpus[i]);
+	}
+	std::sort(used_loop_cpus.begin(), used_loop_cpus.end());
+	if (resolver_cpus.empty() && !used_loop_cpus.empty()) {
+		for (int cpu : topology::online_cpus()) {
+			if (!std::binary_search(used_loop_cpus.begin(),
+					used_loop_cpus.end(), cpu)) {
+				resolver_cpus.push_back(cpu);
+			}
+		}
+	}
+	// connections go to the listener of the loop on the CPU that received
+	// them
+	std::vector<int> worker_cpus;
+	for (int i = 0; i < workers && !loop_cpus.empty(); i++) {
+		worker_cpus.push_back(loop_cpus[i % loop_cpus.size()]);
+	}
+	if (steer_cpu && !steer_by_cpu(accept_fds[0], workers, worker_cpus)) {
+		printf("Unable to steer connections by CPU");
+		exit(0);
+	}
+	util::log() << "Topology: " << topology::describe();
+	for (int i = 0; i < workers; i++) {
+		if (loop_cpus.empty()) {
+			util::log() << "Loop " << i << " on any CPU";
+		} else {
+			int cpu = loop_cpus[i % loop_cpus.size()];
+			util::log() << "Loop " << i << " on CPU " << cpu << " (node "
+					<< topology::node_of_cpu(cpu) << ")";
+		}
+	}
+	util::log() << dns_threads << " resolvers on "
+			<< (resolver_cpus.empty() ?
+					string("any CPU") :
+					"CPUs " + topology::format_cpus(resolver_cpus));
 
-	dispatch::event_ref accept_ev([accept_fd, &dns] {
-		struct sockaddr_in cli_addr;
-		socklen_t cli_size = sizeof(cli_addr);
-		int new_client = accept(accept_fd, (sockaddr *) &cli_addr, &cli_size);
-		if(new_client == -1) {
-			util::log() << "Error accepting new client: " << util::error();
-			return;
+	dns_pool dns(dns_threads, tuning, resolver_cpus);
+	for (auto & pin : pinned_hosts) {
+		dns.pin_host(pin.first, pin.second);
+	}
+	response_cache cache(cache_mb << 20);
+	std::unique_ptr<disk_cache> disk;
+	if (disk_cache_dir) {
+		disk = std::make_unique<disk_cache>(disk_cache_dir,
+				disk_cache_mb << 20);
+	}
+	request_collapser collapser;
+	if (!capture_cfg.dir.empty()) {
+		capture::start(capture_cfg);
+	}
+	if (access_log_path) {
+		try {
+			access_log::start(access_log_path);
+		} catch (std::runtime_error & e) {
+			printf("%s", e.what());
+			exit(0);
 		}
-		util::log() << "Accepted client " << new_client;
-		auto prox = std::make_shared<proxy_connection>(new_client, dns);
-		prox->start();
-	});
+	}
+	memory_budget::set_budgets(memory_mb << 20, connection_memory_kb << 10);
+	admission gate(limits);
+	proxy_context ctx { dns, cache, disk.get(), collapser, splice_tunnels,
+			tuning, gate };
+
+	// Worker 0 is the main thread. Connections stay on the loop of the
+	// worker that accepted them.
+	auto serve = [&](int worker) {
+		if (!loop_cpus.empty()
+				&& !topology::pin( { loop_cpus[worker % loop_cpus.size()] })) {
+			util::log() << "Unable to pin worker " << worker << ": "
+					<< util::error();
+		}
+		int accept_fd = accept_fds[worker];
+		dispatch::fd_ref acceptor(accept_fd, EPOLLIN);
+
+		// the listener is level triggered, clients over the batch limit wake
+		// the next iteration
+		dispatch::event_ref accept_ev([accept_fd, &ctx, &listen_opts] {
+			int n = accept_clients(accept_fd, listen_opts.accept_batch,
+					[&ctx](int new_client) {
+						admission::ticket admitted;
+						auto v = ctx.gate.admit(new_client, admitted);
+						if (v != admission::admitted) {
+							admission::refuse(new_client, v);
+							return;
+						}
+						socket_tuning::apply(new_client, ctx.tuning);
+						auto prox = std::make_shared<proxy_connection>(new_client,
+								ctx, std::move(admitted));
+						prox->start();
+					});
+			util::debug() << "Accepted " << n << " clients";
+		});
+
+		dispatch::link(acceptor, EPOLLIN, accept_ev);
 
-	dispatch::link(acceptor, EPOLLIN, accept_ev);
+		dispatch::run_dispatcher_in_current_thread();
+	};
+	std::vector<std::thread> worker_threads;
+	for (int i = 1; i < workers; i++) {
+		worker_threads.emplace_back([&serve, i] {
+			serve(i);
+#if defined(PROXY_COROUTINES)
+			coro::destroy_suspended();
+#endif
+			dispatch::cleanup();
+		});
+	}
+
+	util::log() << "Started proxy server on port " << port << " with "
+			<< workers << " workers";
+	if (limits.max_connections > 0) {
+		util::log() << "Admitting up to " << limits.max_connections
+				<< " connections";
+	}
 
-	util::log() << "Started proxy server on port " << port;
+	serve(0);
+	for (auto & t : worker_threads) {
+		t.join();
+	}
 
-	dispatch::run_dispatcher_in_current_thread();
+	stopping = true;
+	pthread_kill(signal_thread.native_handle(), SIGUSR1);
+	signal_thread.join();
 
 	util::log() << "Stopped dispatcher. Stopping DNS pool";
 
@@ -344,7 +1491,47 @@ int main(int argc, char** argv) {
 
 	util::log() << "Stopped DNS pool. Closing stray sockets";
 
+	auto cs = cache.stats();
+	util::log() << "Cache: " << cs.hits << " hits, " << cs.misses
+			<< " misses, " << cs.bytes_saved << " bytes saved, " << cs.objects
+			<< " objects in " << cs.bytes_used << " bytes, "
+			<< collapser.collapsed() << " requests collapsed";
+	if (disk) {
+		auto ds = disk->stats();
+		util::log() << "Disk cache: " << ds.hits << " hits, " << ds.misses
+				<< " misses, " << ds.bytes_saved << " bytes saved, "
+				<< ds.objects << " objects in " << ds.segments << " segments";
+		disk->checkpoint();
+	}
+
+#if defined(PROXY_COROUTINES)
+	coro::destroy_suspended();
+#endif
 	dispatch::cleanup();
 
+	auto bs = buffer_pool::stats();
+	util::log() << "Buffers: " << bs.heap_allocations << " allocated, "
+			<< bs.reuses << " reused, " << bs.bytes_cached << " bytes cached";
+#if defined(PROXY_COROUTINES)
+	auto fs = coro::frame_stats();
+	util::log() << "Coroutine frames: " << fs.heap_allocations
+			<< " allocated, " << fs.reuses << " reused";
+#endif
+
+	if (!capture_cfg.dir.empty()) {
+		capture::stop();
+		auto ps = capture::stats();
+		util::log() << "Capture: " << ps.flows << " flows, " << ps.records
+				<< " records, " << ps.bytes << " bytes in " << ps.files
+				<< " files, " << ps.dropped << " records dropped";
+	}
+
+	if (access_log_path) {
+		access_log::stop();
+		auto as = access_log::stats();
+		util::log() << "Access log: " << as.records << " records, "
+				<< as.dropped << " dropped";
+	}
+
 	util::log() << "All done. Have a good day!";
 }
@@ -0,0 +1,160 @@
+/*
+ * memory_budget.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "memory_budget.h"
+
+#include <algorithm>
+
+#include "metrics.h"
+
+namespace memory_budget {
+
+// peak bucket i counts connections that held less than 2^(i + 10) bytes, the
+// last one everything bigger
+constexpr int PEAK_BUCKETS = 18;
+
+static std::atomic<std::size_t> total_budget { 0 }, connection_budget { 0 };
+static std::atomic<std::size_t> charged { 0 };
+static std::atomic<std::uint64_t> live { 0 }, refusals { 0 };
+static std::atomic<std::uint64_t> peaks[PEAK_BUCKETS];
+static std::atomic<std::uint64_t> peak_sum { 0 };
+
+void set_budgets(std::size_t total_bytes, std::size_t connection_bytes) {
+	total_budget = total_bytes;
+	connection_budget = connection_bytes;
+}
+
+std::size_t used() {
+	return charged.load(std::memory_order_relaxed);
+}
+
+bool over_budget() {
+	std::size_t budget = total_budget.load(std::memory_order_relaxed);
+	return budget && used() > budget;
+}
+
+account::account() {
+	live.fetch_add(1, std::memory_order_relaxed);
+}
+
+account::~account() {
+	charged.fetch_sub(size(), std::memory_order_relaxed);
+	close();
+}
+
+void account::close() {
+	if (closed) {
+		return;
+	}
+	closed = true;
+	live.fetch_sub(1, std::memory_order_relaxed);
+	int bucket = 0;
+	while (bucket < PEAK_BUCKETS - 1
+			&& peak >= (std::size_t(1) << (bucket + 10))) {
+		bucket++;
+	}
+	peaks[bucket].fetch_add(1, std::memory_order_relaxed);
+	peak_sum.fetch_add(peak, std::memory_order_relaxed);
+}
+
+bool account::grow(std::size_t by) {
+	std::size_t after = size() + by;
+	std::size_t per_conn = connection_budget.load(std::memory_order_relaxed);
+	std::size_t budget = total_budget.load(std::memory_order_relaxed);
+	bool refuse = per_conn && after > per_conn;
+	// over the total only the connections holding more than their share
+	// stop, the small ones may still finish and give theirs back
+	if (!refuse && budget && used() + by > budget) {
+		std::uint64_t n = std::max<std::uint64_t>(1,
+				live.load(std::memory_order_relaxed));
+		refuse = after > budget / n;
+	}
+	if (refuse) {
+		refusals.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	force_grow(by);
+	return true;
+}
+
+void account::force_grow(std::size_t by) {
+	// only the owning thread writes
+	std::size_t now = size() + by;
+	bytes.store(now, std::memory_order_relaxed);
+	peak = std::max(peak, now);
+	charged.fetch_add(by, std::memory_order_relaxed);
+}
+
+void account::shrink(std::size_t by) {
+	bytes.store(size() - by, std::memory_order_relaxed);
+	charged.fetch_sub(by, std::memory_order_relaxed);
+}
+
+std::size_t account::size() const {
+	return bytes.load(std::memory_order_relaxed);
+}
+
+charge::charge(account * to) :
+		acct(to) {
+}
+
+charge::~charge() {
+	set(0);
+}
+
+bool charge::resize(std::size_t bytes) {
+	if (!acct || bytes <= held) {
+		set(bytes);
+		return true;
+	}
+	if (!acct->grow(bytes - held)) {
+		return false;
+	}
+	held = bytes;
+	return true;
+}
+
+void charge::set(std::size_t bytes) {
+	if (!acct) {
+		return;
+	}
+	if (bytes > held) {
+		acct->force_grow(bytes - held);
+	} else {
+		acct->shrink(held - bytes);
+	}
+	held = bytes;
+}
+
+std::size_t charge::size() const {
+	return held;
+}
+
+stats_t stats() {
+	return {used(), total_budget.load(), connection_budget.load(), live.load(),
+		refusals.load()};
+}
+
+void render_peaks(std::string & out) {
+	const char * name = "proxy_connection_memory_peak_bytes";
+	metrics::line(out, "# TYPE %s histogram", name);
+	std::uint64_t count = 0;
+	for (int i = 0; i < PEAK_BUCKETS; i++) {
+		count += peaks[i].load(std::memory_order_relaxed);
+		if (i < PEAK_BUCKETS - 1) {
+			metrics::line(out, "%s_bucket{le=\"%zu\"} %llu", name,
+					std::size_t(1) << (i + 10), (unsigned long long) count);
+		}
+	}
+	metrics::line(out, "%s_bucket{le=\"+Inf\"} %llu", name,
+			(unsigned long long) count);
+	metrics::line(out, "%s_sum %llu", name,
+			(unsigned long long) peak_sum.load(std::memory_order_relaxed));
+	metrics::line(out, "%s_count %llu", name, (unsigned long long) count);
+}
+
+}
@@ -0,0 +1,86 @@
+/*
+ * memory_budget.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef MEMORY_BUDGET_H_
+#define MEMORY_BUDGET_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Memory held by connections, charged to an account per connection and to a
+// total. Every buffer a connection holds is charged by a charge object that
+// follows its size; buffers that only grow while data arrives are checked
+// against the budgets, the rest is charged anyway. With the total over its
+// budget new clients are refused, relays read less at a time and a
+// connection may only grow up to its share of the budget, so the biggest
+// ones are failed first.
+namespace memory_budget {
+
+// 0 leaves a budget off
+void set_budgets(std::size_t total_bytes, std::size_t connection_bytes);
+
+// bytes charged to all accounts
+std::size_t used();
+bool over_budget();
+
+class account {
+	std::atomic<std::size_t> bytes { 0 };
+	std::size_t peak = 0;
+	bool closed = false;
+public:
+	account();
+	account(const account &) = delete;
+	account & operator =(const account &) = delete;
+	~account();
+
+	// false, leaving the account as it was, if the budgets don't allow by
+	// more bytes
+	bool grow(std::size_t by);
+	void force_grow(std::size_t by);
+	void shrink(std::size_t by);
+
+	std::size_t size() const;
+	// the connection is done: its peak goes to the stats and it no longer
+	// counts for the shares of the budget, whatever is charged stays so
+	// until given back
+	void close();
+};
+
+// One buffer charged to an account
+class charge {
+	account * acct = nullptr;
+	std::size_t held = 0;
+public:
+	// nullptr charges nothing
+	explicit charge(account * to = nullptr);
+	charge(const charge &) = delete;
+	charge & operator =(const charge &) = delete;
+	~charge();
+
+	// false, keeping the old charge, if growing to bytes is over budget
+	bool resize(std::size_t bytes);
+	// charges bytes whatever the budgets say
+	void set(std::size_t bytes);
+	std::size_t size() const;
+};
+
+struct stats_t {
+	std::size_t used, budget, connection_budget;
+	std::uint64_t accounts; // alive
+	std::uint64_t refused; // growths over budget
+};
+
+stats_t stats();
+
+// peak memory of finished connections as a Prometheus histogram
+void render_peaks(std::string & out);
+
+}
+
+#endif /* MEMORY_BUDGET_H_ */
@@ -0,0 +1,196 @@
+/*
+ * metrics.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "metrics.h"
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "memory_budget.h"
+
+namespace metrics {
+
+// histogram bucket i counts durations below 2^i microseconds, the last one
+// everything longer
+constexpr int BUCKETS = 24;
+
+static const char * const counter_names[COUNTERS] = {
+		"proxy_connections_total", "proxy_relayed_bytes_total",
+		"proxy_refused_connections_total",
+		"proxy_refused_client_connections_total",
+		"proxy_rate_limited_connections_total",
+		"proxy_refused_lagging_connections_total",
+		"proxy_refused_memory_connections_total",
+		"proxy_shed_requests_total" };
+static const char * const gauge_names[GAUGES] = { "proxy_dns_queue_depth" };
+static const char * const state_names[STATES] = { "none", "reading_request",
+		"waiting_collapsed", "connecting", "uploading", "reading_response",
+		"responding", "tunneling" };
+static const char * const histogram_names[HISTOGRAMS] = {
+		"proxy_dns_resolve_seconds", "proxy_loop_iteration_seconds" };
+
+struct block {
+	std::atomic<std::uint64_t> counters[COUNTERS];
+	std::atomic<std::int64_t> gauges[GAUGES];
+	std::atomic<std::int64_t> active[STATES];
+	std::atomic<std::uint64_t> entered[STATES];
+	std::atomic<std::uint64_t> buckets[HISTOGRAMS][BUCKETS];
+	std::atomic<std::uint64_t> sums_us[HISTOGRAMS];
+};
+
+// blocks outlive their threads, the totals must not go back
+static std::vector<std::unique_ptr<block>> blocks;
+static std::mutex blocks_mutex;
+static thread_local block * local = nullptr;
+
+static block & mine() {
+	if (!local) {
+		std::unique_ptr<block> b(new block());
+		local = b.get();
+		std::lock_guard<std::mutex> lg(blocks_mutex);
+		blocks.push_back(std::move(b));
+	}
+	return *local;
+}
+
+// only the owning thread writes, so no read-modify-write is needed
+template<class T>
+static void bump(std::atomic<T> & a, T by) {
+	a.store(a.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+void add(counter c, std::uint64_t n) {
+	bump(mine().counters[c], n);
+}
+
+void change(gauge g, std::int64_t by) {
+	bump(mine().gauges[g], by);
+}
+
+void move(conn_state from, conn_state to) {
+	block & b = mine();
+	bump<std::int64_t>(b.active[from], -1);
+	bump<std::int64_t>(b.active[to], 1);
+	bump<std::uint64_t>(b.entered[to], 1);
+}
+
+void observe(histogram h, std::chrono::steady_clock::duration d) {
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	int bucket = 0;
+	while (bucket < BUCKETS - 1 && us >= (1LL << bucket)) {
+		bucket++;
+	}
+	block & b = mine();
+	bump<std::uint64_t>(b.buckets[h][bucket], 1);
+	bump<std::uint64_t>(b.sums_us[h], us);
+}
+
+const char * state_name(conn_state s) {
+	return state_names[s];
+}
+
+void line(std::string & out, const char * fmt, ...) {
+	char text[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+	out += text;
+	out += '\n';
+}
+
+std::string render() {
+	std::lock_guard<std::mutex> lg(blocks_mutex);
+	std::string out;
+	for (int c = 0; c < COUNTERS; c++) {
+		std::uint64_t sum = 0;
+		for (auto & b : blocks) {
+			sum += b->counters[c].load(std::memory_order_relaxed);
+		}
+		line(out, "# TYPE %s counter", counter_names[c]);
+		line(out, "%s %llu", counter_names[c], (unsigned long long) sum);
+	}
+	for (int g = 0; g < GAUGES; g++) {
+		std::int64_t sum = 0;
+		for (auto & b : blocks) {
+			sum += b->gauges[g].load(std::memory_order_relaxed);
+		}
+		line(out, "# TYPE %s gauge", gauge_names[g]);
+		line(out, "%s %lld", gauge_names[g], (long long) sum);
+	}
+	line(out, "# TYPE proxy_connections_active gauge");
+	for (int s = none + 1; s < STATES; s++) {
+		std::int64_t sum = 0;
+		for (auto & b : blocks) {
+			sum += b->active[s].load(std::memory_order_relaxed);
+		}
+		line(out, "proxy_connections_active{state=\"%s\"} %lld", state_names[s],
+				(long long) sum);
+	}
+	line(out, "# TYPE proxy_connection_states_total counter");
+	for (int s = none + 1; s < STATES; s++) {
+		std::uint64_t sum = 0;
+		for (auto & b : blocks) {
+			sum += b->entered[s].load(std::memory_order_relaxed);
+		}
+		line(out, "proxy_connection_states_total{state=\"%s\"} %llu",
+				state_names[s], (unsigned long long) sum);
+	}
+	for (int h = 0; h < HISTOGRAMS; h++) {
+		line(out, "# TYPE %s histogram", histogram_names[h]);
+		std::uint64_t count = 0, sum_us = 0;
+		for (int i = 0; i < BUCKETS; i++) {
+			for (auto & b : blocks) {
+				count += b->buckets[h][i].load(std::memory_order_relaxed);
+			}
+			if (i < BUCKETS - 1) {
+				line(out, "%s_bucket{le=\"%g\"} %llu", histogram_names[h],
+						(1LL << i) / 1e6, (unsigned long long) count);
+			}
+		}
+		for (auto & b : blocks) {
+			sum_us += b->sums_us[h].load(std::memory_order_relaxed);
+		}
+		line(out, "%s_bucket{le=\"+Inf\"} %llu", histogram_names[h],
+				(unsigned long long) count);
+		line(out, "%s_sum %g", histogram_names[h], sum_us / 1e6);
+		line(out, "%s_count %llu", histogram_names[h],
+				(unsigned long long) count);
+	}
+	auto bs = buffer_pool::stats();
+	line(out, "# TYPE proxy_buffer_bytes gauge");
+	line(out, "proxy_buffer_bytes{use=\"in_use\"} %llu",
+			(unsigned long long) bs.bytes_in_use);
+	line(out, "proxy_buffer_bytes{use=\"cached\"} %llu",
+			(unsigned long long) bs.bytes_cached);
+	line(out, "# TYPE proxy_buffer_allocations_total counter");
+	line(out, "proxy_buffer_allocations_total{from=\"heap\"} %llu",
+			(unsigned long long) bs.heap_allocations);
+	line(out, "proxy_buffer_allocations_total{from=\"pool\"} %llu",
+			(unsigned long long) bs.reuses);
+	auto ms = memory_budget::stats();
+	line(out, "# TYPE proxy_memory_bytes gauge");
+	line(out, "proxy_memory_bytes{use=\"connections\"} %zu", ms.used);
+	line(out, "# TYPE proxy_memory_budget_bytes gauge");
+	line(out, "proxy_memory_budget_bytes{scope=\"total\"} %zu", ms.budget);
+	line(out, "proxy_memory_budget_bytes{scope=\"connection\"} %zu",
+			ms.connection_budget);
+	line(out, "# TYPE proxy_memory_accounts gauge");
+	line(out, "proxy_memory_accounts %llu", (unsigned long long) ms.accounts);
+	line(out, "# TYPE proxy_memory_refusals_total counter");
+	line(out, "proxy_memory_refusals_total %llu",
+			(unsigned long long) ms.refused);
+	memory_budget::render_peaks(out);
+	return out;
+}
+
+}
@@ -0,0 +1,73 @@
+/*
+ * metrics.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Counters for the stats page. Every thread updates a block of its own with
+// plain relaxed loads and stores, so no update ever contends on a cache line
+// or takes a lock; render() adds the blocks of all threads up. Gauges may go
+// up on one thread and down on another, only their sum means anything.
+namespace metrics {
+
+enum counter {
+	connections_total,
+	bytes_relayed, // by tunnel relays
+	refused_connections, // over the connection limit
+	refused_client_connections, // over the limit of their address
+	rate_limited, // their address ran out of tokens
+	refused_lagging, // the accepting loop was lagging
+	refused_memory, // memory was over budget
+	shed_requests, // answered 503 instead of queueing a lookup
+	COUNTERS
+};
+
+enum gauge {
+	dns_queue_depth,
+	GAUGES
+};
+
+// what a connection is waiting for
+enum conn_state {
+	none,
+	reading_request,
+	waiting_collapsed,
+	connecting,
+	uploading,
+	reading_response,
+	responding,
+	tunneling,
+	STATES
+};
+
+enum histogram {
+	dns_resolve, // getaddrinfo()
+	loop_iteration, // running the events of one dispatcher wakeup
+	HISTOGRAMS
+};
+
+void add(counter c, std::uint64_t n = 1);
+void change(gauge g, std::int64_t by);
+// counts the connection out of from and into to
+void move(conn_state from, conn_state to);
+void observe(histogram h, std::chrono::steady_clock::duration d);
+
+const char * state_name(conn_state s);
+
+// Prometheus text format
+std::string render();
+// appends one printf formatted line of it, for modules rendering their own
+void line(std::string & out, const char * fmt, ...)
+		__attribute__((format(printf, 2, 3)));
+
+}
+
+#endif /* METRICS_H_ */
@@ -1,79 +1,154 @@
 #include "relay.h"
+#include "metrics.h"
+#include "socket_tuning.h"
 #include "util.h"
 
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <cassert>
+#include <vector>
+
+
+// Stop listening to in_fd until the buffer drains below a quarter, so a slow
+// receiver holds at most one buffer per direction
+void relay::pause_reading() {
+	dispatch::unlink(in_fd, ev);
+	reading = false;
+	util::debug() << "Relay " << in_fd << " -> " << out_fd << " paused at "
+			<< buf.size();
+}
+
+void relay::resume_reading() {
+	dispatch::link(in_fd, EPOLLIN | EPOLLRDHUP | EPOLLHUP, ev);
+	reading = true;
+	util::debug() << "Relay " << in_fd << " -> " << out_fd << " resumed at "
+			<< buf.size();
+}
+
+// Ring bytes sent with zerocopy are consumed only once the kernel is done
+// with them; copied sends queued behind them wait their turn.
+void relay::release_lent() {
+	zc.reap();
+	while (lent_sends.size() && zc.completions() >= lent_sends.front().first) {
+		buf.consume(lent_sends.front().second);
+		lent -= lent_sends.front().second;
+		lent_sends.pop_front();
+	}
+}
+
+ssize_t relay::write_some() {
+	if (lent) {
+		release_lent();
+	}
+	iovec iov[2];
+	msghdr msg { };
+	msg.msg_iov = iov;
+	msg.msg_iovlen = buf.readable(iov, lent);
+	if (msg.msg_iovlen == 0) {
+		if (lent) {
+			// nothing to do until completions arrive
+			errno = EAGAIN;
+			return -1;
+		}
+		return 0;
+	}
+	std::size_t length = iov[0].iov_len
+			+ (msg.msg_iovlen > 1 ? iov[1].iov_len : 0);
+	bool zero;
+	ssize_t clw = zc.send(msg, length, MSG_DONTWAIT | MSG_NOSIGNAL, zero);
+	if (clw > 0) {
+		metrics::add(metrics::bytes_relayed, clw);
+		if (zero || lent) {
+			lent_sends.emplace_back(zc.sends(), clw);
+			lent += clw;
+			release_lent();
+		} else {
+			buf.consume(clw);
+		}
+	}
+	return clw;
+}
 
 void relay::loop_once() {
-	ssize_t clr, clw;
-	int clr_errno, clw_errno;
-	char t[8192];
 	while (true) {
-		auto log = util::log();
+		auto log = util::trace();
+		ssize_t clr = 0, clw = 0;
+		bool read_blocked = false, read_done = false;
 		errno = 0;
-		clr = clw = 0;
 		switch (st) {
 		case READ_WRITE:
-
-			clr = recv(in_fd.fd(), t, sizeof(t), MSG_DONTWAIT);
-
-			for(int i = 0; i < clr; i++){
-				os.put(t[i]);
+			if (reading) {
+				// the ring follows the read size whenever it is drained,
+				// short of memory it takes the smallest one
+				std::size_t want = memory_budget::over_budget() ?
+						buffer_pool::MIN_CLASS_SIZE : sizer.size();
+				if (buf.empty() && buf.capacity() != want) {
+					buf.resize(want);
+				}
+				std::size_t space = buf.space();
+				iovec iov[2];
+				msghdr msg { };
+				msg.msg_iov = iov;
+				msg.msg_iovlen = buf.writable(iov);
+				clr = recvmsg(in_fd.fd(), &msg, MSG_DONTWAIT);
+				if (clr > 0) {
+					sizer.update(clr, space);
+					if (tap) {
+						tap->record(dir, iov, msg.msg_iovlen, clr);
+					}
+					buf.produce(clr);
+					if (buf.size() >= buf.capacity() / 4 * 3
+							|| (buf.size() > buf.capacity() / 4
+									&& memory_budget::over_budget())) {
+						pause_reading();
+					}
+				} else if (clr < 0 && errno == EAGAIN) {
+					read_blocked = true;
+				} else {
+					read_done = true;
+				}
 			}
-			os.flush();
-
-			if (clr > 0) {
-				buf.append(t, t + clr);
-			}
-
-			clr_errno = errno;
 			errno = 0;
-
-			clw = send(out_fd.fd(), buf.c_str(), buf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
-
-			if (clw > 0) {
-				buf.erase(buf.begin(), buf.begin() + clw);
+			clw = write_some();
+			if (!reading && buf.size() <= buf.capacity() / 4) {
+				resume_reading();
 			}
 
-			clw_errno = errno;
-			errno = 0;
-
 			log << "Relay " << in_fd << " -> " << out_fd << " in " << clr
 					<< " out " << clw << " bufs " << buf.size() << util::newl;
 
-			if (clw < 0) {
+			if (clw < 0 && errno != EAGAIN) {
 				st = FINISHED;
 				log << "Relay " << in_fd << " -> " << out_fd << " done";
-			} else if (clr == 0 || (clr == -1 && clr_errno != EAGAIN)) {
+			} else if (read_done) {
 				log << "Relay " << in_fd << " -> " << out_fd << " read all";
 				st = WRITE_REST;
-			} else if (clr_errno == EAGAIN
-					&& (buf.size() == 0 || clw_errno == EAGAIN)) {
+			} else if ((read_blocked || !reading)
+					&& (buf.empty() || clw < 0)) {
+				errno = 0;
 				return;
 			}
+			errno = 0;
 			break;
 		case WRITE_REST:
-			clw = 0;
-			if (buf.size()) {
-				clw = send(out_fd.fd(), buf.c_str(), buf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
-				clw_errno = errno;
-				errno = 0;
-			}
-
-			if (buf.empty() || (clw_errno == -1 && clw_errno != EAGAIN)) {
+			clw = write_some();
+			if (buf.empty() || (clw < 0 && errno != EAGAIN)) {
 				log << "Relay " << in_fd << " -> " << out_fd << " done";
 				st = FINISHED;
-			} else if (clw_errno == EAGAIN) {
+			} else if (clw < 0) {
+				errno = 0;
 				return;
 			}
+			errno = 0;
 			break;
 		case FINISHED:
 			dispatch::unlink_current(in_fd);
 			dispatch::unlink_current(out_fd);
-			dispatch::recycle_event_current();
+			ev.recycle();
 			finisher();
 			return;
 		}
@@ -88,34 +163,234 @@ relay & relay::set_finisher(std::function<void()> on_finish) {
 relay::~relay() {
 }
 
-relay::relay(dispatch::fd_ref & in_fd, dispatch::fd_ref & out_fd) :
-		in_fd(in_fd), out_fd(out_fd), st(READ_WRITE) {
-	std::string str;
-	if(util::get_name(in_fd.fd()).substr(0, 6) == "client"){
-		str = std::string("log/") + "->" + util::get_name(out_fd.fd());
-	} else {
-		str = std::string("log/") + "<-" + util::get_name(in_fd.fd());
-	}
-	os = std::ofstream(str, std::ios::out | std::ios::binary | std::ios::ate);
-	os << "\nNEW RELAY\n";
+relay::relay(dispatch::fd_ref & in_fd, dispatch::fd_ref & out_fd,
+		std::size_t capacity, std::shared_ptr<memory_budget::account> acct) :
+		in_fd(in_fd), out_fd(out_fd), st(READ_WRITE), acct(std::move(acct)), buf(
+				capacity, this->acct.get()), zc(out_fd.fd()) {
 }
 
-relay & relay::set_buffer(std::string && data) {
-	buf = data;
+relay & relay::set_capture(std::shared_ptr<capture::flow> flow,
+		capture::direction d) {
+	tap = std::move(flow);
+	dir = d;
 	return *this;
 }
 
 relay& relay::set_buffer(const std::string& data) {
-	buf = data;
+	buf.append(data.data(), data.size());
 	return *this;
 }
 
 void make_relay(dispatch::fd_ref& in_fd, dispatch::fd_ref& out_fd,
-		std::string data, std::function<void()> on_finish) {
-	auto ptr = std::make_shared<relay>(in_fd, out_fd);
-	ptr->set_buffer(data).set_finisher(on_finish);
+		std::string data, std::function<void()> on_finish,
+		std::shared_ptr<capture::flow> flow, capture::direction dir,
+		std::shared_ptr<memory_budget::account> acct) {
+	auto ptr = std::make_shared<relay>(in_fd, out_fd,
+			std::max(buffer_pool::MIN_CLASS_SIZE, data.size() * 2),
+			std::move(acct));
+	if (flow) {
+		flow->record(dir, data.data(), data.size());
+	}
+	ptr->set_buffer(data).set_finisher(on_finish).set_capture(std::move(flow),
+			dir);
+
+	socket_tuning::apply_relay(out_fd.fd());
+
+	// the relay keeps its event to relink in_fd after pausing
+	ptr->ev = dispatch::event_ref(std::bind(&relay::loop_once, ptr));
+	dispatch::link(in_fd, EPOLLIN | EPOLLRDHUP | EPOLLHUP, ptr->ev);
+	// EPOLLERR brings zerocopy completions
+	dispatch::link(out_fd, EPOLLOUT | EPOLLERR | EPOLLRDHUP | EPOLLHUP,
+			ptr->ev);
+	dispatch::arm_manual(ptr->ev);
+}
+
+constexpr int PIPE_SIZE = 1 << 18;
+constexpr std::size_t PIPE_POOL_MAX = 64;
+
+struct pipe_pair {
+	int rd, wr;
+	std::size_t capacity;
+};
+
+// Pipes are only returned here empty, so they can be handed out as is.
+// Every dispatcher thread keeps its own pool.
+static thread_local std::vector<pipe_pair> pipe_pool;
+
+static bool acquire_pipe(pipe_pair & to) {
+	if (!pipe_pool.empty()) {
+		to = pipe_pool.back();
+		pipe_pool.pop_back();
+		return true;
+	}
+	int fds[2];
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+		util::log() << "Unable to create splice pipe: " << util::error();
+		return false;
+	}
+	fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+	int sz = fcntl(fds[1], F_GETPIPE_SZ);
+	to = pipe_pair { fds[0], fds[1], std::size_t(sz > 0 ? sz : 1 << 16) };
+	return true;
+}
+
+static void release_pipe(const pipe_pair & p, bool empty) {
+	if (empty && pipe_pool.size() < PIPE_POOL_MAX) {
+		pipe_pool.push_back(p);
+	} else {
+		close(p.rd);
+		close(p.wr);
+	}
+}
+
+static void set_nonblocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+splice_relay::splice_relay(dispatch::fd_ref& in_fd, dispatch::fd_ref& out_fd,
+		int pipe_rd, int pipe_wr, std::size_t pipe_capacity) :
+		in_fd(in_fd), out_fd(out_fd), st(READ_WRITE), pipe_rd(pipe_rd), pipe_wr(
+				pipe_wr), pipe_capacity(pipe_capacity) {
+}
+
+splice_relay::~splice_relay() {
+	if (pipe_rd != -1) {
+		release_pipe(pipe_pair { pipe_rd, pipe_wr, pipe_capacity }, in_pipe == 0);
+	}
+}
+
+splice_relay& splice_relay::set_buffer(std::string&& data) {
+	buf = std::move(data);
+	return *this;
+}
+
+splice_relay& splice_relay::set_finisher(std::function<void()> on_finish) {
+	finisher = on_finish;
+	return *this;
+}
+
+splice_relay& splice_relay::set_account(
+		std::shared_ptr<memory_budget::account> a) {
+	acct = std::move(a);
+	return *this;
+}
+
+// Sockets splice() can't read from (EINVAL) go through the copy relay
+void splice_relay::fall_back() {
+	util::log() << "Relay " << in_fd << " -> " << out_fd
+			<< " can't splice, copying";
+	dispatch::unlink_current(in_fd);
+	dispatch::unlink_current(out_fd);
+	dispatch::recycle_event_current();
+	make_relay(in_fd, out_fd, std::move(buf), finisher, nullptr,
+			capture::direction::to_server, std::move(acct));
+}
+
+void splice_relay::loop_once() {
+	constexpr unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+	while (true) {
+		auto log = util::trace();
+		ssize_t clr = 0, clw = 0;
+		// reading is skipped while the pipe is full
+		bool read_blocked = false, read_done = false;
+		errno = 0;
+		switch (st) {
+		case READ_WRITE:
+			if (in_pipe < pipe_capacity) {
+				clr = splice(in_fd.fd(), nullptr, pipe_wr, nullptr,
+						pipe_capacity - in_pipe, flags);
+				if (clr > 0) {
+					in_pipe += clr;
+				} else if (clr < 0 && errno == EAGAIN) {
+					read_blocked = true;
+				} else if (clr < 0 && errno == EINVAL && moved == 0) {
+					fall_back();
+					return;
+				} else {
+					read_done = true;
+				}
+			}
+			errno = 0;
+			clw = write_some();
+
+			log << "Splice " << in_fd << " -> " << out_fd << " in " << clr
+					<< " out " << clw << " piped " << in_pipe << util::newl;
+
+			if (clw < 0 && errno != EAGAIN) {
+				st = FINISHED;
+				log << "Splice " << in_fd << " -> " << out_fd << " done";
+			} else if (read_done) {
+				log << "Splice " << in_fd << " -> " << out_fd << " read all";
+				st = WRITE_REST;
+			} else if ((read_blocked || in_pipe == pipe_capacity)
+					&& ((in_pipe == 0 && buf.empty()) || clw < 0)) {
+				errno = 0;
+				return;
+			}
+			errno = 0;
+			break;
+		case WRITE_REST:
+			clw = write_some();
+			if ((buf.empty() && in_pipe == 0) || (clw < 0 && errno != EAGAIN)) {
+				log << "Splice " << in_fd << " -> " << out_fd << " done";
+				st = FINISHED;
+			} else if (clw < 0) {
+				errno = 0;
+				return;
+			}
+			errno = 0;
+			break;
+		case FINISHED:
+			dispatch::unlink_current(in_fd);
+			dispatch::unlink_current(out_fd);
+			dispatch::recycle_event_current();
+			finisher();
+			return;
+		}
+	}
+}
+
+// Returns 0 if there is nothing to write, errno is left as set by the call
+ssize_t splice_relay::write_some() {
+	ssize_t clw = 0;
+	if (buf.size()) {
+		clw = send(out_fd.fd(), buf.c_str(), buf.size(),
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (clw > 0) {
+			metrics::add(metrics::bytes_relayed, clw);
+			buf.erase(0, clw);
+		}
+	} else if (in_pipe) {
+		clw = splice(pipe_rd, nullptr, out_fd.fd(), nullptr, in_pipe,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (clw > 0) {
+			metrics::add(metrics::bytes_relayed, clw);
+			in_pipe -= clw;
+			moved += clw;
+		}
+	}
+	return clw;
+}
+
+void make_splice_relay(dispatch::fd_ref& in_fd, dispatch::fd_ref& out_fd,
+		std::string data, std::function<void()> on_finish,
+		std::shared_ptr<memory_budget::account> acct) {
+	pipe_pair p;
+	if (!acquire_pipe(p)) {
+		make_relay(in_fd, out_fd, std::move(data), on_finish, nullptr,
+				capture::direction::to_server, std::move(acct));
+		return;
+	}
+	// splice() only honours O_NONBLOCK on the socket side
+	set_nonblocking(in_fd.fd());
+	set_nonblocking(out_fd.fd());
+	socket_tuning::apply_relay(out_fd.fd());
+	auto ptr = std::make_shared<splice_relay>(in_fd, out_fd, p.rd, p.wr,
+			p.capacity);
+	ptr->set_buffer(std::move(data)).set_finisher(on_finish).set_account(
+			std::move(acct));
 
-	dispatch::event_ref d(std::bind(&relay::loop_once, ptr));
+	dispatch::event_ref d(std::bind(&splice_relay::loop_once, ptr));
 	dispatch::link(in_fd, EPOLLIN | EPOLLRDHUP | EPOLLHUP, d);
 	dispatch::link(out_fd, EPOLLOUT | EPOLLRDHUP | EPOLLHUP, d);
 	dispatch::arm_manual(d);
@@ -8,12 +8,17 @@
 #ifndef RELAY_H_
 #define RELAY_H_
 
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <string>
 #include <memory>
-#include <fstream>
 
+#include "capture.h"
 #include "dispatch.h"
+#include "memory_budget.h"
+#include "ring_buffer.h"
+#include "zerocopy.h"
 
 class relay: public std::enable_shared_from_this<relay> {
 	enum state {
@@ -22,23 +27,87 @@ class relay: public std::enable_shared_from_this<relay> {
 	dispatch::fd_ref & in_fd;
 	dispatch::fd_ref & out_fd;
 	state st;
-	std::string buf;
+	std::shared_ptr<memory_budget::account> acct; // charged for buf
+	// paused at 3/4 full, or past 1/4 while memory is over budget, resumed
+	// at 1/4
+	ring_buffer buf;
+	buffer_pool::read_sizer sizer;
+	bool reading = true;
+	dispatch::event_ref ev;
 	std::function<void()> finisher;
-	std::ofstream os;
+	std::shared_ptr<capture::flow> tap; // nullptr unless captured
+	capture::direction dir = capture::direction::to_server;
+	zerocopy::tracker zc;
+	// sends still using ring memory: completion count that frees them, bytes
+	std::deque<std::pair<std::uint32_t, std::size_t>> lent_sends;
+	std::size_t lent = 0;
 
+	void release_lent();
+	void pause_reading();
+	void resume_reading();
+	ssize_t write_some();
 public:
 
-	relay(dispatch::fd_ref & in_fd, dispatch::fd_ref & out_fd);
+	relay(dispatch::fd_ref & in_fd, dispatch::fd_ref & out_fd,
+			std::size_t capacity,
+			std::shared_ptr<memory_budget::account> acct = nullptr);
 	void loop_once();
 
-	relay & set_buffer(std::string && data);
 	relay & set_buffer(const std::string & data);
 	relay & set_finisher(std::function<void()> on_finish);
+	relay & set_capture(std::shared_ptr<capture::flow> flow,
+			capture::direction d);
 
 	~relay();
+
+	friend void make_relay(dispatch::fd_ref& in_fd, dispatch::fd_ref& out_fd,
+			std::string data, std::function<void()> on_finish,
+			std::shared_ptr<capture::flow> flow, capture::direction dir,
+			std::shared_ptr<memory_budget::account> acct);
 };
 
+// Relayed bytes (including data) are recorded to flow if it is set, the
+// buffer is charged to acct if it is set
 void make_relay(dispatch::fd_ref& in_fd, dispatch::fd_ref& out_fd,
-		std::string data, std::function<void()> on_finish);
+		std::string data, std::function<void()> on_finish,
+		std::shared_ptr<capture::flow> flow = nullptr,
+		capture::direction dir = capture::direction::to_server,
+		std::shared_ptr<memory_budget::account> acct = nullptr);
+
+// Relay that moves bytes socket -> pipe -> socket with splice(), so payload
+// never reaches user space. Pipes come from a per-thread pool.
+class splice_relay: public std::enable_shared_from_this<splice_relay> {
+	enum state {
+		READ_WRITE, WRITE_REST, FINISHED
+	};
+	dispatch::fd_ref & in_fd;
+	dispatch::fd_ref & out_fd;
+	state st;
+	std::string buf; // sent before anything spliced
+	int pipe_rd, pipe_wr;
+	std::size_t pipe_capacity, in_pipe = 0;
+	std::size_t moved = 0;
+	std::function<void()> finisher;
+	// for the copy relay taking over
+	std::shared_ptr<memory_budget::account> acct;
+
+	void fall_back();
+	ssize_t write_some();
+public:
+	splice_relay(dispatch::fd_ref & in_fd, dispatch::fd_ref & out_fd, int pipe_rd,
+			int pipe_wr, std::size_t pipe_capacity);
+	void loop_once();
+
+	splice_relay & set_buffer(std::string && data);
+	splice_relay & set_finisher(std::function<void()> on_finish);
+	splice_relay & set_account(std::shared_ptr<memory_budget::account> a);
+
+	~splice_relay();
+};
+
+// Falls back to make_relay when no pipe is available
+void make_splice_relay(dispatch::fd_ref& in_fd, dispatch::fd_ref& out_fd,
+		std::string data, std::function<void()> on_finish,
+		std::shared_ptr<memory_budget::account> acct = nullptr);
 
 #endif /* RELAY_H_ */
@@ -0,0 +1,107 @@
+/*
+ * ring_buffer.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+static std::size_t round_up_pow2(std::size_t v) {
+	std::size_t res = 1;
+	while (res < v) {
+		res <<= 1;
+	}
+	return res;
+}
+
+ring_buffer::ring_buffer(std::size_t capacity, memory_budget::account * acct) :
+		mem(acct), cap(round_up_pow2(capacity)), mask(cap - 1) {
+}
+
+std::size_t ring_buffer::size() const {
+	return used;
+}
+
+std::size_t ring_buffer::capacity() const {
+	return cap;
+}
+
+std::size_t ring_buffer::space() const {
+	return cap - used;
+}
+
+bool ring_buffer::empty() const {
+	return used == 0;
+}
+
+int ring_buffer::readable(iovec (&iov)[2]) const {
+	return readable(iov, 0);
+}
+
+int ring_buffer::readable(iovec (&iov)[2], std::size_t skip) const {
+	if (used <= skip) {
+		return 0;
+	}
+	std::size_t start = (head + skip) & mask;
+	std::size_t left = used - skip;
+	std::size_t first = std::min(left, cap - start);
+	iov[0] = iovec { data.data() + start, first };
+	iov[1] = iovec { data.data(), left - first };
+	return left > first ? 2 : 1;
+}
+
+int ring_buffer::writable(iovec (&iov)[2]) {
+	if (used == cap) {
+		return 0;
+	}
+	if (!data) {
+		data = buffer_pool::pooled_buffer(cap);
+		mem.set(data.capacity());
+	}
+	std::size_t tail = (head + used) & mask;
+	std::size_t first = std::min(cap - used, cap - tail);
+	iov[0] = iovec { data.data() + tail, first };
+	iov[1] = iovec { data.data(), cap - used - first };
+	return cap - used > first ? 2 : 1;
+}
+
+void ring_buffer::produce(std::size_t n) {
+	used += n;
+}
+
+void ring_buffer::consume(std::size_t n) {
+	used -= n;
+	head = used ? (head + n) & mask : 0;
+	if (used == 0) {
+		data.reset();
+		mem.set(0);
+	}
+}
+
+bool ring_buffer::resize(std::size_t capacity) {
+	if (used) {
+		return false;
+	}
+	data.reset();
+	mem.set(0);
+	cap = round_up_pow2(capacity);
+	mask = cap - 1;
+	return true;
+}
+
+std::size_t ring_buffer::append(const char* from, std::size_t length) {
+	iovec iov[2];
+	int cnt = writable(iov);
+	std::size_t copied = 0;
+	for (int i = 0; i < cnt && copied < length; i++) {
+		std::size_t n = std::min(iov[i].iov_len, length - copied);
+		std::memcpy(iov[i].iov_base, from + copied, n);
+		copied += n;
+	}
+	produce(copied);
+	return copied;
+}
@@ -0,0 +1,55 @@
+/*
+ * ring_buffer.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include <sys/uio.h>
+#include <cstddef>
+
+#include "buffer_pool.h"
+#include "memory_budget.h"
+
+// Fixed-capacity byte ring. Free space and stored data are exposed as up to
+// two iovecs, so sockets can be read into and written from it directly.
+// Memory comes from buffer_pool when space is first asked for and goes back
+// whenever the ring is drained, so idle rings hold nothing. It is charged to
+// acct while it holds memory.
+class ring_buffer {
+	buffer_pool::pooled_buffer data;
+	memory_budget::charge mem;
+	std::size_t cap, mask;
+	std::size_t head = 0; // position of the first stored byte
+	std::size_t used = 0;
+public:
+	// capacity is rounded up to a power of two
+	explicit ring_buffer(std::size_t capacity,
+			memory_budget::account * acct = nullptr);
+
+	std::size_t size() const;
+	std::size_t capacity() const;
+	std::size_t space() const;
+	bool empty() const;
+
+	// fill iov with the stored bytes / the free space, return iovec count
+	int readable(iovec (&iov)[2]) const;
+	// stored bytes past the first skip ones
+	int readable(iovec (&iov)[2], std::size_t skip) const;
+	int writable(iovec (&iov)[2]);
+
+	// mark n bytes as stored after writing to writable() / as sent
+	void produce(std::size_t n);
+	void consume(std::size_t n);
+
+	// only while empty, returns false otherwise
+	bool resize(std::size_t capacity);
+
+	// copies as much as fits, returns amount copied
+	std::size_t append(const char * from, std::size_t length);
+};
+
+#endif /* RING_BUFFER_H_ */
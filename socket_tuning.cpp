@@ -0,0 +1,65 @@
+/*
+ * socket_tuning.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "socket_tuning.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "util.h"
+
+namespace socket_tuning {
+
+static int relay_lowat = 0;
+
+static bool set(int fd, int level, int name, int value, const char * what) {
+	if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+		util::log() << "Unable to set " << what << " on " << fd << ": "
+				<< util::error();
+		return false;
+	}
+	return true;
+}
+
+void apply(int fd, const profile & p) {
+	if (p.nodelay) {
+		set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	}
+	if (p.keepalive_idle > 0 && set(fd, SOL_SOCKET, SO_KEEPALIVE, 1,
+			"SO_KEEPALIVE")) {
+		set(fd, IPPROTO_TCP, TCP_KEEPIDLE, p.keepalive_idle, "TCP_KEEPIDLE");
+		set(fd, IPPROTO_TCP, TCP_KEEPINTVL, p.keepalive_interval,
+				"TCP_KEEPINTVL");
+		set(fd, IPPROTO_TCP, TCP_KEEPCNT, p.keepalive_count, "TCP_KEEPCNT");
+	}
+	// fixing a size switches autotuning off for that direction
+	if (p.sndbuf > 0) {
+		set(fd, SOL_SOCKET, SO_SNDBUF, p.sndbuf, "SO_SNDBUF");
+	}
+	if (p.rcvbuf > 0) {
+		set(fd, SOL_SOCKET, SO_RCVBUF, p.rcvbuf, "SO_RCVBUF");
+	}
+}
+
+void apply_relay(int fd) {
+	if (relay_lowat > 0) {
+		set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, relay_lowat,
+				"TCP_NOTSENT_LOWAT");
+	}
+}
+
+void set_relay_lowat(int bytes) {
+	relay_lowat = bytes;
+}
+
+bool enable_fastopen_connect(int fd) {
+	return set(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1,
+			"TCP_FASTOPEN_CONNECT");
+}
+
+}
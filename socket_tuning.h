@@ -0,0 +1,42 @@
+/*
+ * socket_tuning.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef SOCKET_TUNING_H_
+#define SOCKET_TUNING_H_
+
+// TCP options for client and server sockets. Options the kernel refuses
+// are logged and skipped, the socket stays usable either way.
+namespace socket_tuning {
+
+struct profile {
+	bool nodelay = true; // request heads go out without waiting for acks
+	int keepalive_idle = 60; // seconds before probing, 0 leaves keepalive off
+	int keepalive_interval = 10;
+	int keepalive_count = 5;
+	int sndbuf = 0; // bytes, 0 keeps kernel autotuning
+	int rcvbuf = 0;
+	// TCP_FASTOPEN_CONNECT for origins connected before
+	bool fastopen_connect = false;
+};
+
+// everything but fastopen_connect
+void apply(int fd, const profile & p);
+
+// TCP_NOTSENT_LOWAT for sockets relays write to, 0 (the default) leaves it
+// off. EPOLLOUT then only fires once unsent bytes drop below the mark, so
+// relayed data waits in the relay buffer instead of the socket.
+void set_relay_lowat(int bytes);
+void apply_relay(int fd);
+
+// Before connect(): connect() returns at once and the SYN carries the first
+// write once the kernel holds a cookie for the destination. Connection
+// errors surface on that write instead.
+bool enable_fastopen_connect(int fd);
+
+}
+
+#endif /* SOCKET_TUNING_H_ */
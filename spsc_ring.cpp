@@ -0,0 +1,159 @@
+/*
+ * spsc_ring.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "spsc_ring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+spsc_ring::spsc_ring(std::size_t capacity) {
+	cap = 1;
+	while (cap < capacity) {
+		cap <<= 1;
+	}
+	mask = cap - 1;
+	data.reset(new char[cap]);
+}
+
+void spsc_ring::copy_in(std::size_t pos, const void * from,
+		std::size_t length) {
+	if (length == 0) {
+		return;
+	}
+	std::size_t off = pos & mask;
+	std::size_t first = std::min(length, cap - off);
+	std::memcpy(data.get() + off, from, first);
+	std::memcpy(data.get(), static_cast<const char *>(from) + first,
+			length - first);
+}
+
+bool spsc_ring::push(const void * prefix, std::size_t prefix_length,
+		const iovec * iov, int iovcnt, std::size_t length) {
+	std::size_t t = tail.load(std::memory_order_relaxed);
+	std::size_t h = head.load(std::memory_order_acquire);
+	if (cap - (t - h) < prefix_length + length) {
+		return false;
+	}
+	copy_in(t, prefix, prefix_length);
+	t += prefix_length;
+	std::size_t left = length;
+	for (int i = 0; i < iovcnt && left; i++) {
+		std::size_t n = std::min(left, iov[i].iov_len);
+		copy_in(t, iov[i].iov_base, n);
+		t += n;
+		left -= n;
+	}
+	tail.store(t, std::memory_order_release);
+	return true;
+}
+
+std::size_t spsc_ring::peek(iovec (&iov)[2], std::size_t & end) const {
+	end = tail.load(std::memory_order_acquire);
+	std::size_t h = head.load(std::memory_order_relaxed);
+	std::size_t n = end - h;
+	std::size_t off = h & mask;
+	std::size_t first = std::min(n, cap - off);
+	iov[0] = {data.get() + off, first};
+	iov[1] = {data.get(), n - first};
+	return n;
+}
+
+void spsc_ring::release(std::size_t end) {
+	head.store(end, std::memory_order_release);
+}
+
+static std::atomic<std::uint64_t> writer_ids { 0 };
+// ring of every writer the thread pushed to, by writer id
+static thread_local std::vector<std::pair<std::uint64_t,
+		std::shared_ptr<spsc_ring>>> local_rings;
+
+ring_writer::ring_writer(std::size_t ring_bytes,
+		std::chrono::milliseconds idle, sink write) :
+		id(writer_ids.fetch_add(1)), ring_bytes(ring_bytes), idle(idle), write(
+				std::move(write)) {
+	thread = std::thread(&ring_writer::run, this);
+}
+
+ring_writer::~ring_writer() {
+	stop();
+}
+
+spsc_ring & ring_writer::local_ring() {
+	for (auto & r : local_rings) {
+		if (r.first == id) {
+			return *r.second;
+		}
+	}
+	auto ring = std::make_shared<spsc_ring>(ring_bytes);
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		rings.push_back(ring);
+	}
+	local_rings.emplace_back(id, ring);
+	return *ring;
+}
+
+bool ring_writer::push(const void * prefix, std::size_t prefix_length,
+		const iovec * iov, int iovcnt, std::size_t length) {
+	return local_ring().push(prefix, prefix_length, iov, iovcnt, length);
+}
+
+// Writes out everything pushed so far, a ring at a time
+bool ring_writer::drain() {
+	std::vector<std::shared_ptr<spsc_ring>> batch;
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		for (auto it = rings.begin(); it != rings.end();) {
+			iovec iov[2];
+			std::size_t end;
+			if (it->use_count() == 1 && (*it)->peek(iov, end) == 0) {
+				it = rings.erase(it);
+			} else {
+				batch.push_back(*it++);
+			}
+		}
+	}
+	bool any = false;
+	for (auto & r : batch) {
+		iovec iov[2];
+		std::size_t end;
+		std::size_t n = r->peek(iov, end);
+		if (n == 0) {
+			continue;
+		}
+		any = true;
+		write(iov, 2, n);
+		r->release(end);
+	}
+	return any;
+}
+
+void ring_writer::run() {
+	std::unique_lock<std::mutex> lk(mut);
+	while (!stopping) {
+		lk.unlock();
+		bool any = drain();
+		lk.lock();
+		if (!any) {
+			cv.wait_for(lk, idle);
+		}
+	}
+	lk.unlock();
+	drain();
+}
+
+void ring_writer::stop() {
+	{
+		std::lock_guard<std::mutex> lg(mut);
+		stopping = true;
+	}
+	cv.notify_one();
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * spsc_ring.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <sys/uio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Single producer / single consumer byte ring handing records from a working
+// thread to a writer thread without locks. head and tail only grow, their
+// difference is the amount of data waiting for the writer.
+class spsc_ring {
+	std::unique_ptr<char[]> data;
+	std::size_t cap, mask;
+	std::atomic<std::size_t> head { 0 }, tail { 0 };
+
+	void copy_in(std::size_t pos, const void * from, std::size_t length);
+public:
+	// capacity is rounded up to a power of two
+	explicit spsc_ring(std::size_t capacity);
+
+	// Producer side: prefix followed by the first length bytes of iov, all
+	// or nothing. False if it doesn't fit.
+	bool push(const void * prefix, std::size_t prefix_length,
+			const iovec * iov, int iovcnt, std::size_t length);
+
+	// Consumer side: data ready to be written as up to two iovecs
+	std::size_t peek(iovec (&iov)[2], std::size_t & end) const;
+	void release(std::size_t end);
+};
+
+// A writer thread draining one spsc_ring per producing thread into a sink.
+// Threads get their ring on their first push; rings of finished threads go
+// once the writer emptied them. The sink gets what one ring holds at a time
+// and runs on the writer thread only.
+class ring_writer {
+public:
+	// iov holds length bytes in iovcnt parts
+	using sink = std::function<void(iovec * iov, int iovcnt,
+			std::size_t length)>;
+
+	// idle is how long the writer sleeps after finding all rings empty
+	ring_writer(std::size_t ring_bytes, std::chrono::milliseconds idle,
+			sink write);
+	ring_writer(const ring_writer &) = delete;
+	ring_writer & operator =(const ring_writer &) = delete;
+	~ring_writer();
+
+	// as spsc_ring::push into the calling thread's ring, false if it is full
+	bool push(const void * prefix, std::size_t prefix_length,
+			const iovec * iov, int iovcnt, std::size_t length);
+	// writes out everything pushed so far and ends the writer thread
+	void stop();
+
+private:
+	spsc_ring & local_ring();
+	bool drain();
+	void run();
+
+	const std::uint64_t id; // tells writers apart in the thread's rings
+	std::size_t ring_bytes;
+	std::chrono::milliseconds idle;
+	sink write;
+	std::mutex mut;
+	std::condition_variable cv;
+	bool stopping = false;
+	std::vector<std::shared_ptr<spsc_ring>> rings;
+	std::thread thread;
+};
+
+#endif /* SPSC_RING_H_ */
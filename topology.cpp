@@ -0,0 +1,155 @@
+/*
+ * topology.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "topology.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+
+namespace topology {
+
+struct layout {
+	std::vector<int> cpus; // online ones
+	std::vector<int> node_by_cpu;
+	std::vector<std::pair<int, std::vector<int>>> nodes; // id, CPUs
+};
+
+static std::string read_line(const std::string & path) {
+	std::ifstream in(path);
+	std::string line;
+	std::getline(in, line);
+	return line;
+}
+
+static layout load() {
+	layout l;
+	l.cpus = parse_cpus(read_line("/sys/devices/system/cpu/online"));
+	if (l.cpus.empty()) {
+		for (int i = 0, n = std::thread::hardware_concurrency(); i < n; i++) {
+			l.cpus.push_back(i);
+		}
+	}
+	l.node_by_cpu.assign(l.cpus.empty() ? 1 : l.cpus.back() + 1, 0);
+	for (int id : parse_cpus(read_line("/sys/devices/system/node/online"))) {
+		auto cpus = parse_cpus(
+				read_line("/sys/devices/system/node/node" + std::to_string(id)
+						+ "/cpulist"));
+		for (int cpu : cpus) {
+			if (cpu < int(l.node_by_cpu.size())) {
+				l.node_by_cpu[cpu] = id;
+			}
+		}
+		l.nodes.emplace_back(id, std::move(cpus));
+	}
+	if (l.nodes.empty()) {
+		l.nodes.emplace_back(0, l.cpus);
+	}
+	return l;
+}
+
+static const layout & machine() {
+	static const layout l = load();
+	return l;
+}
+
+std::vector<int> parse_cpus(const std::string & list) {
+	std::vector<int> cpus;
+	const char * p = list.c_str();
+	while (*p) {
+		char * end;
+		long first = strtol(p, &end, 10), last = first;
+		if (end == p || first < 0) {
+			return {};
+		}
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first) {
+				return {};
+			}
+			p = end;
+		}
+		if (last >= CPU_SETSIZE) {
+			return {};
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p && *p != '\n') {
+			return {};
+		} else {
+			break;
+		}
+	}
+	std::sort(cpus.begin(), cpus.end());
+	cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+	return cpus;
+}
+
+std::string format_cpus(const std::vector<int> & cpus) {
+	std::string out;
+	for (std::size_t i = 0; i < cpus.size();) {
+		std::size_t j = i;
+		while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+			j++;
+		}
+		if (!out.empty()) {
+			out += ',';
+		}
+		out += std::to_string(cpus[i]);
+		if (j > i) {
+			out += '-' + std::to_string(cpus[j]);
+		}
+		i = j + 1;
+	}
+	return out;
+}
+
+std::vector<int> online_cpus() {
+	return machine().cpus;
+}
+
+int node_of_cpu(int cpu) {
+	const layout & l = machine();
+	return cpu >= 0 && cpu < int(l.node_by_cpu.size()) ?
+			l.node_by_cpu[cpu] : 0;
+}
+
+int current_node() {
+	return node_of_cpu(sched_getcpu());
+}
+
+bool pin(const std::vector<int> & cpus) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		CPU_SET(cpu, &set);
+	}
+	return !cpus.empty()
+			&& pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::string describe() {
+	const layout & l = machine();
+	std::string out = std::to_string(l.cpus.size()) + " CPU"
+			+ (l.cpus.size() == 1 ? "" : "s") + " on "
+			+ std::to_string(l.nodes.size()) + " NUMA node"
+			+ (l.nodes.size() == 1 ? "" : "s") + ":";
+	for (std::size_t i = 0; i < l.nodes.size(); i++) {
+		out += (i ? ", node" : " node") + std::to_string(l.nodes[i].first)
+				+ " " + format_cpus(l.nodes[i].second);
+	}
+	return out;
+}
+
+}
@@ -0,0 +1,37 @@
+/*
+ * topology.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+
+// CPUs and NUMA nodes of the machine as sysfs lists them, read once. Without
+// /sys/devices/system/node every CPU is on node 0.
+namespace topology {
+
+// CPUs of a list like "0-3,8,10-11" in the kernel's cpulist format, empty
+// if it doesn't parse
+std::vector<int> parse_cpus(const std::string & list);
+// the other way around, ranges folded
+std::string format_cpus(const std::vector<int> & cpus);
+
+std::vector<int> online_cpus();
+int node_of_cpu(int cpu);
+// node of the CPU the calling thread runs on, stays put once it is pinned
+int current_node();
+
+// binds the calling thread to cpus, false if the kernel refused
+bool pin(const std::vector<int> & cpus);
+
+// nodes and their CPUs, one line
+std::string describe();
+
+}
+
+#endif /* TOPOLOGY_H_ */
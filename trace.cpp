@@ -0,0 +1,118 @@
+/*
+ * trace.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "trace.h"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "util.h"
+
+namespace trace {
+
+std::atomic<bool> probes_on { false };
+
+// live connections of one thread, its mutex only contends with dump()
+struct registry {
+	std::mutex mut;
+	std::unordered_set<const connection *> live;
+};
+
+// registries outlive their threads, connections may still point at them
+static std::vector<std::unique_ptr<registry>> registries;
+static std::mutex registries_mutex;
+static thread_local registry * local = nullptr;
+
+static registry & mine() {
+	if (!local) {
+		std::unique_ptr<registry> r(new registry());
+		local = r.get();
+		std::lock_guard<std::mutex> lg(registries_mutex);
+		registries.push_back(std::move(r));
+	}
+	return *local;
+}
+
+void set_enabled(bool on) {
+	probes_on.store(on, std::memory_order_relaxed);
+}
+
+void fire(const char * probe, long a, long b) {
+	util::log() << "probe " << probe << " " << a << " " << b;
+}
+
+void fire(const char * probe, long a, const char * s) {
+	util::log() << "probe " << probe << " " << a << " " << s;
+}
+
+connection::connection() :
+		reg(mine()) {
+	std::lock_guard<std::mutex> lg(reg.mut);
+	reg.live.insert(this);
+}
+
+connection::~connection() {
+	std::lock_guard<std::mutex> lg(reg.mut);
+	reg.live.erase(this);
+}
+
+void connection::set_fds(int client, int server) {
+	client_fd.store(client, std::memory_order_relaxed);
+	server_fd.store(server, std::memory_order_relaxed);
+}
+
+void connection::step(const char * name, std::size_t buffered_bytes) {
+	step_name.store(name, std::memory_order_relaxed);
+	buffered.store(buffered_bytes, std::memory_order_relaxed);
+	TRACE_PROBE_STR(conn_step, client_fd.load(std::memory_order_relaxed),
+			name);
+}
+
+void connection::set_state(metrics::conn_state to) {
+	state.store(to, std::memory_order_relaxed);
+	TRACE_PROBE(conn_state, client_fd.load(std::memory_order_relaxed), to);
+}
+
+void connection::set_account(const memory_budget::account * mem) {
+	this->mem.store(mem, std::memory_order_relaxed);
+}
+
+std::string connection::describe() const {
+	char line[256];
+	auto acct = mem.load(std::memory_order_relaxed);
+	std::size_t charged = acct ? acct->size() : 0;
+	auto age = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - since).count();
+	snprintf(line, sizeof(line),
+			"client=%d server=%d state=%s step=%s age_ms=%lld buffered=%zu "
+					"memory=%zu",
+			client_fd.load(std::memory_order_relaxed),
+			server_fd.load(std::memory_order_relaxed),
+			metrics::state_name(
+					metrics::conn_state(state.load(std::memory_order_relaxed))),
+			step_name.load(std::memory_order_relaxed), (long long) age,
+			buffered.load(std::memory_order_relaxed), charged);
+	return line;
+}
+
+std::string dump() {
+	std::lock_guard<std::mutex> lg(registries_mutex);
+	std::string out;
+	for (auto & r : registries) {
+		std::lock_guard<std::mutex> rlg(r->mut);
+		for (auto c : r->live) {
+			out += c->describe();
+			out += '\n';
+		}
+	}
+	return out;
+}
+
+}
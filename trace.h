@@ -0,0 +1,95 @@
+/*
+ * trace.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "memory_budget.h"
+#include "metrics.h"
+
+// Probes at every connection step and state change and where the dispatcher
+// arms, runs and recycles events. Built with -DPROXY_USDT (needs
+// <sys/sdt.h>) they are USDT probes of provider "proxy" for bpftrace or perf,
+// nops until attached. Otherwise they cost a relaxed load and an untaken
+// branch until switched on with set_enabled() (SIGUSR2), then they log a
+// line each.
+//
+// Probes and their arguments:
+//   dispatch_arm, dispatch_run, dispatch_recycle   event id
+//   conn_step    client fd, name of the proxy_connection method entered
+//   conn_state   client fd, metrics::conn_state
+#if defined(PROXY_USDT)
+#include <sys/sdt.h>
+#define TRACE_PROBE(probe, a, b) STAP_PROBE2(proxy, probe, a, b)
+#define TRACE_PROBE_STR(probe, a, s) STAP_PROBE2(proxy, probe, a, s)
+#else
+#define TRACE_PROBE(probe, a, b) \
+	do { \
+		if (__builtin_expect(trace::enabled(), 0)) { \
+			trace::fire(#probe, (long) (a), (long) (b)); \
+		} \
+	} while (0)
+#define TRACE_PROBE_STR(probe, a, s) \
+	do { \
+		if (__builtin_expect(trace::enabled(), 0)) { \
+			trace::fire(#probe, (long) (a), (const char *) (s)); \
+		} \
+	} while (0)
+#endif
+
+namespace trace {
+
+extern std::atomic<bool> probes_on;
+
+inline bool enabled() {
+	return probes_on.load(std::memory_order_relaxed);
+}
+void set_enabled(bool on);
+void fire(const char * probe, long a, long b);
+void fire(const char * probe, long a, const char * s);
+
+struct registry;
+
+// Where a live connection is, for dump(). Owned by the connection's thread,
+// the fields are atomic because dump() reads them from another one.
+class connection {
+	registry & reg;
+	const std::chrono::steady_clock::time_point since =
+			std::chrono::steady_clock::now();
+	std::atomic<int> client_fd { -1 }, server_fd { -1 };
+	std::atomic<const char *> step_name { "" };
+	std::atomic<int> state { metrics::none };
+	std::atomic<std::size_t> buffered { 0 };
+	std::atomic<const memory_budget::account *> mem { nullptr };
+public:
+	connection();
+	connection(const connection &) = delete;
+	~connection();
+
+	void set_fds(int client, int server);
+	// name has to be a literal, __func__ does
+	void step(const char * name, std::size_t buffered_bytes);
+	void set_state(metrics::conn_state to);
+	// reported until the connection goes, which mem has to outlive
+	void set_account(const memory_budget::account * mem);
+
+	// one line
+	std::string describe() const;
+};
+
+// every live connection of every thread, one per line
+std::string dump();
+
+}
+
+#endif /* TRACE_H_ */
@@ -10,25 +10,169 @@
 #include <sys/socket.h>
 #include <cstring>
 #include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
 #include <unordered_map>
 
+#include "spsc_ring.h"
+
 namespace util {
 
 newline newl;
 
-logger log() {
-	return logger();
+// per thread, lines that don't fit are dropped rather than waited for
+constexpr std::size_t LOG_RING_SIZE = 1 << 19;
+constexpr std::size_t STAMP_LENGTH = 9; // "HH:MM:SS "
+
+// never freed, threads may still log while the process exits
+static ring_writer * writer = nullptr;
+static std::once_flag writer_once;
+static std::atomic<bool> writing { false };
+static std::atomic<std::uint64_t> dropped { 0 };
+
+struct clock_state {
+	std::time_t second = -1;
+	bool ticking = false;
+	char stamp[STAMP_LENGTH + 1];
+};
+
+static thread_local clock_state local_clock;
+
+static void refresh(clock_state & c) {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (ts.tv_sec != c.second) {
+		c.second = ts.tv_sec;
+		std::tm local;
+		localtime_r(&c.second, &local);
+		strftime(c.stamp, sizeof(c.stamp), "%T ", &local);
+	}
+}
+
+void tick() {
+	local_clock.ticking = true;
+	refresh(local_clock);
+}
+
+static void write_lines(iovec * iov, int iovcnt, std::size_t) {
+	write_all(STDERR_FILENO, iov, iovcnt);
+	// only the writer thread gets here
+	static std::uint64_t reported = 0;
+	std::uint64_t lost = dropped.load(std::memory_order_relaxed);
+	if (lost != reported) {
+		char note[64];
+		int n = snprintf(note, sizeof(note), "(%llu log lines dropped)\n",
+				(unsigned long long) (lost - reported));
+		iovec line { note, std::size_t(n) };
+		write_all(STDERR_FILENO, &line, 1);
+		reported = lost;
+	}
+}
+
+static void stop_writer() {
+	writing = false;
+	writer->stop();
+}
+
+static void start_writer() {
+	writer = new ring_writer(LOG_RING_SIZE, std::chrono::milliseconds(10),
+			write_lines);
+	writing = true;
+	std::atexit(stop_writer);
+}
+
+static void emit(const char * s, std::size_t n) {
+	clock_state & c = local_clock;
+	if (!c.ticking) {
+		refresh(c);
+	}
+	std::call_once(writer_once, start_writer);
+	iovec iov[3] = { { c.stamp, STAMP_LENGTH }, { const_cast<char *>(s), n }, {
+			const_cast<char *>("\n"), 1 } };
+	if (!writing.load(std::memory_order_relaxed)) {
+		// the writer is gone, this late nobody minds waiting
+		write_all(STDERR_FILENO, iov, 3);
+		return;
+	}
+	if (!writer->push(c.stamp, STAMP_LENGTH, iov + 1, 2, n + 1)) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+logger::logger(logger && oth) :
+		length(oth.length), spill(std::move(oth.spill)) {
+	std::memcpy(line, oth.line, length);
+	oth.length = 0;
+	oth.spill.clear();
+}
+
+void logger::append(const char * s, std::size_t n) {
+	if (spill.empty() && length + n <= sizeof(line)) {
+		std::memcpy(line + length, s, n);
+		length += n;
+		return;
+	}
+	if (spill.empty()) {
+		spill.assign(line, length);
+	}
+	spill.append(s, n);
+}
+
+void logger::format(const char * s) {
+	append(s, std::strlen(s));
+}
+
+void logger::format(const std::string & s) {
+	append(s.data(), s.size());
+}
+
+void logger::format(char c) {
+	append(&c, 1);
+}
+
+void logger::format(bool b) {
+	format(b ? '1' : '0');
+}
+
+void logger::format(double d) {
+	char num[32];
+	int n = snprintf(num, sizeof(num), "%g", d);
+	append(num, std::size_t(n));
+}
+
+void logger::format_signed(long long v) {
+	if (v < 0) {
+		format('-');
+		// well defined for the smallest value too
+		format_unsigned(0ULL - static_cast<unsigned long long>(v));
+	} else {
+		format_unsigned(v);
+	}
+}
+
+void logger::format_unsigned(unsigned long long v) {
+	char num[24];
+	char * p = num + sizeof(num);
+	do {
+		*--p = char('0' + v % 10);
+		v /= 10;
+	} while (v);
+	append(p, num + sizeof(num) - p);
 }
 
 void logger::flush() {
-	std::string str = uss.get()->str();
-	if (str.length() > 0) {
-		uss = std::make_unique<std::ostringstream>();
-		auto tm = std::chrono::system_clock::to_time_t(
-				std::chrono::system_clock::now());
-		std::clog << std::put_time(std::localtime(&tm), "%T") << " " << str
-				<< "\n";
+	if (!spill.empty()) {
+		emit(spill.data(), spill.size());
+		spill.clear();
+	} else if (length > 0) {
+		emit(line, length);
 	}
+	length = 0;
 }
 
 logger & logger::operator <<(const newline &) {
@@ -36,23 +180,53 @@ logger & logger::operator <<(const newline &) {
 	return *this;
 }
 
+logger & logger::operator <<(const error_text & e) {
+	format(strerror(e.code));
+	return *this;
+}
+
 logger::~logger() {
 	flush();
 }
 
 std::unordered_map<int, std::string> names;
+std::mutex names_mutex;
 
 void name_fd(int fd, std::string fd_name) {
+	std::lock_guard<std::mutex> lg(names_mutex);
 	names[fd] = fd_name;
 }
 
-const std::string& get_name(int fd) {
+std::string get_name(int fd) {
+	std::lock_guard<std::mutex> lg(names_mutex);
 	if (names.count(fd) == 0) {
 		names[fd] = std::to_string(fd);
 	}
 	return names[fd];
 }
 
+bool write_all(int fd, iovec * iov, int iovcnt) {
+	while (iovcnt) {
+		ssize_t wr = writev(fd, iov, iovcnt);
+		if (wr < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		while (iovcnt && std::size_t(wr) >= iov->iov_len) {
+			wr -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = static_cast<char *>(iov->iov_base) + wr;
+			iov->iov_len -= wr;
+		}
+	}
+	return true;
+}
+
 std::string error() {
 	std::string res(strerror(errno));
 	errno = 0;
@@ -9,44 +9,133 @@
 #define UTIL_H_
 
 #include <stddef.h>
-#include <chrono>
-#include <ctime>
-#include <iomanip>
-#include <iostream>
+#include <sys/uio.h>
+#include <sstream>
 #include <string>
+#include <type_traits>
 
 #include <memory>
 
+// Lines below this level are compiled out, see util::level. The default
+// keeps everything; release builds pass -DLOG_LEVEL=2.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 0
+#endif
+
 namespace util {
 
+enum class level {
+	trace, // every read and write of the loaders and relays
+	debug, // connection life cycle
+	info,
+	warning,
+	error
+};
+
 struct newline {
 };
 
 extern newline newl;
 
+// strerror(code), only looked up if the line is kept
+struct error_text {
+	int code;
+};
+
+// Formats one line on the stack. Finished lines go to a ring of the calling
+// thread and a background thread writes them out in batches, so logging
+// never waits for the terminal.
 class logger {
-	std::unique_ptr<std::ostringstream> uss = std::make_unique<std::ostringstream>();
-//	std::ostringstream ss;
+	char line[256];
+	std::size_t length = 0;
+	std::string spill; // whole line once it outgrows line
+
+	void append(const char * s, std::size_t n);
+	void format(const char * s);
+	void format(const std::string & s);
+	void format(char c);
+	void format(bool b);
+	void format(double d);
+	void format_signed(long long v);
+	void format_unsigned(unsigned long long v);
+	template<class T>
+	typename std::enable_if<std::is_integral<T>::value>::type format(T v) {
+		if (std::is_signed<T>::value) {
+			format_signed(v);
+		} else {
+			format_unsigned(v);
+		}
+	}
+	template<class T>
+	typename std::enable_if<!std::is_arithmetic<T>::value>::type format(
+			const T & t) {
+		std::ostringstream ss;
+		ss << t;
+		format(ss.str());
+	}
 public:
 	void flush();
 	logger() = default;
-	logger(logger &&) = default;
+	logger(logger &&);
 	logger(const logger &) = delete;
 	logger & operator <<(const newline &);
+	logger & operator <<(const error_text &);
 	template<class T>
-	logger & operator <<(T t) {
-		(*uss.get()) << t;
+	logger & operator <<(const T & t) {
+		format(t);
 		return *this;
 	}
 	~logger();
 };
 
-std::string error();
+// Stands in for logger below LOG_LEVEL, everything streamed into it is
+// dropped at compile time
+class null_logger {
+public:
+	null_logger & operator <<(const newline &) {
+		return *this;
+	}
+	template<class T>
+	null_logger & operator <<(const T &) {
+		return *this;
+	}
+};
+
+template<level L>
+using logger_at = typename std::conditional<(int(L) >= LOG_LEVEL), logger,
+		null_logger>::type;
+
+using trace_logger = logger_at<level::trace>;
 
-logger log();
+template<level L>
+logger_at<L> log_at() {
+	return logger_at<L>();
+}
+
+inline logger_at<level::info> log() {
+	return log_at<level::info>();
+}
+
+inline trace_logger trace() {
+	return log_at<level::trace>();
+}
+
+inline logger_at<level::debug> debug() {
+	return log_at<level::debug>();
+}
+
+// Refreshes the time stamp of lines logged by the calling thread. Dispatcher
+// threads call it once per iteration; threads that never do look at the
+// clock for every line.
+void tick();
+
+std::string error();
 
 void name_fd(int fd, std::string fd_name);
-const std::string & get_name(int fd);
+std::string get_name(int fd);
+
+// writev until everything is written, false on error
+bool write_all(int fd, iovec * iov, int iovcnt);
 
 }
 
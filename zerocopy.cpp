@@ -0,0 +1,101 @@
+/*
+ * zerocopy.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#include "zerocopy.h"
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <cerrno>
+
+#include "util.h"
+
+namespace zerocopy {
+
+static std::size_t min_length = 0;
+
+void set_threshold(std::size_t bytes) {
+	min_length = bytes;
+}
+
+tracker::tracker(int fd) :
+		fd(fd) {
+}
+
+ssize_t tracker::send(const msghdr & msg, std::size_t length, int flags,
+		bool & zero) {
+	zero = min_length && length >= min_length && !copied;
+	if (zero && !enabled) {
+		int one = 1;
+		enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))
+				== 0;
+		if (!enabled) {
+			util::log() << "SO_ZEROCOPY unavailable on " << fd << ": "
+					<< util::error();
+			copied = true;
+			zero = false;
+		}
+	}
+	if (zero) {
+		ssize_t res = sendmsg(fd, &msg, flags | MSG_ZEROCOPY);
+		if (res >= 0) {
+			sent++;
+			return res;
+		}
+		// out of pinned memory allowance, copy this one
+		if (errno != ENOBUFS) {
+			return res;
+		}
+		errno = 0;
+		zero = false;
+	}
+	return sendmsg(fd, &msg, flags);
+}
+
+void tracker::reap() {
+	while (pending()) {
+		char control[128];
+		msghdr msg { };
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			errno = 0;
+			return;
+		}
+		for (cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm;
+				cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+					&& !(cm->cmsg_level == SOL_IPV6
+							&& cm->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			auto serr = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cm));
+			if (serr->ee_errno != 0
+					|| serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			// completions come as inclusive ranges of send numbers
+			completed += serr->ee_data - serr->ee_info + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				copied = true;
+			}
+		}
+	}
+}
+
+std::uint32_t tracker::sends() const {
+	return sent;
+}
+
+std::uint32_t tracker::completions() const {
+	return completed;
+}
+
+bool tracker::pending() const {
+	return completed != sent;
+}
+
+}
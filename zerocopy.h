@@ -0,0 +1,50 @@
+/*
+ * zerocopy.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mk2
+ */
+
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+
+// MSG_ZEROCOPY sends. The kernel sends straight from user memory, so a
+// buffer handed to a zerocopy send must stay untouched until its completion
+// shows up on the socket error queue (EPOLLERR). Sends below the threshold
+// use the normal copy path.
+namespace zerocopy {
+
+// 0 (the default) disables zerocopy sends
+void set_threshold(std::size_t bytes);
+
+// Tracks the zerocopy sends of one socket. Completions are numbered per
+// socket, so only one tracker may send on a socket at a time.
+class tracker {
+	int fd;
+	bool enabled = false;
+	bool copied = false; // kernel fell back to copying, don't bother
+	std::uint32_t sent = 0, completed = 0;
+public:
+	explicit tracker(int fd = -1);
+
+	// sendmsg with MSG_ZEROCOPY added when the message is big enough;
+	// zero tells if the memory is now lent to the kernel
+	ssize_t send(const msghdr & msg, std::size_t length, int flags,
+			bool & zero);
+	// reads completions from the error queue, call on EPOLLERR
+	void reap();
+
+	// zerocopy sends so far / completed so far
+	std::uint32_t sends() const;
+	std::uint32_t completions() const;
+	bool pending() const;
+};
+
+}
+
+#endif /* ZEROCOPY_H_ */